@@ -0,0 +1,221 @@
+#include "AniFile.h"
+
+#include "Utils.h"
+
+namespace
+{
+    constexpr DWORD MakeFourCC(char a, char b, char c, char d)
+    {
+        return DWORD(BYTE(a)) | (DWORD(BYTE(b)) << 8) | (DWORD(BYTE(c)) << 16) | (DWORD(BYTE(d)) << 24);
+    }
+
+    const DWORD ID_RIFF = MakeFourCC('R', 'I', 'F', 'F');
+    const DWORD ID_ACON = MakeFourCC('A', 'C', 'O', 'N');
+    const DWORD ID_ANIH = MakeFourCC('a', 'n', 'i', 'h');
+    const DWORD ID_RATE = MakeFourCC('r', 'a', 't', 'e');
+    const DWORD ID_SEQ = MakeFourCC('s', 'e', 'q', ' ');
+    const DWORD ID_LIST = MakeFourCC('L', 'I', 'S', 'T');
+    const DWORD ID_FRAM = MakeFourCC('f', 'r', 'a', 'm');
+    const DWORD ID_ICON = MakeFourCC('i', 'c', 'o', 'n');
+
+    DWORD Read32(const BYTE* p)
+    {
+        DWORD v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    // Chunks are padded to an even size
+    DWORD Padded(DWORD size)
+    {
+        return size + (size & 1);
+    }
+
+    void WriteChunkHeader(HANDLE hFile, DWORD id, DWORD size)
+    {
+        const DWORD h[2] = { id, size };
+        CheckWriteFile(hFile, h, sizeof(h));
+    }
+
+    void WritePadding(HANDLE hFile, DWORD size)
+    {
+        if (size & 1)
+        {
+            const BYTE pad = 0;
+            CheckWriteFile(hFile, &pad, 1);
+        }
+    }
+}
+
+AniFile AniFile::Load(LPCTSTR lpFilename)
+{
+    const HANDLE hFile = CreateFile(lpFilename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    CHECK(hFile != INVALID_HANDLE_VALUE);
+
+    try
+    {
+        LARGE_INTEGER size;
+        CHECK(GetFileSizeEx(hFile, &size));
+        if (size.QuadPart > MAXDWORD)
+            throw Error(TEXT("Invalid ani"));
+
+        std::vector<BYTE> data(static_cast<size_t>(size.QuadPart));
+        CheckReadFile(hFile, data.data(), static_cast<DWORD>(data.size()));
+        CloseHandle(hFile);
+
+        return FromMemory(std::move(data));
+    }
+    catch (...)
+    {
+        CloseHandle(hFile);
+        throw;
+    }
+}
+
+AniFile AniFile::FromMemory(std::vector<BYTE> data)
+{
+    AniFile ani;
+    ani.file = std::move(data);
+    ani.header = {};
+
+    const BYTE* p = ani.file.data();
+    const size_t size = ani.file.size();
+    if (size < 12 || Read32(p) != ID_RIFF || Read32(p + 8) != ID_ACON)
+        throw Error(TEXT("Invalid ani"));
+
+    const size_t end = (std::min)(size, size_t(8) + Read32(p + 4));
+    bool bHasHeader = false;
+    size_t pos = 12;
+    while (pos + 8 <= end)
+    {
+        const DWORD id = Read32(p + pos);
+        const DWORD len = Read32(p + pos + 4);
+        const size_t offset = pos + 8;
+        if (len > end - offset)
+            throw Error(TEXT("Invalid ani"));
+
+        if (id == ID_ANIH)
+        {
+            if (len < sizeof(ANIHEADER))
+                throw Error(TEXT("Invalid ani"));
+            memcpy(&ani.header, p + offset, sizeof(ANIHEADER));
+            bHasHeader = true;
+        }
+        else if (id == ID_LIST && len >= 4 && Read32(p + offset) == ID_FRAM)
+        {
+            const size_t fend = offset + len;
+            size_t fpos = offset + 4;
+            while (fpos + 8 <= fend)
+            {
+                const DWORD fid = Read32(p + fpos);
+                const DWORD flen = Read32(p + fpos + 4);
+                if (flen > fend - fpos - 8)
+                    throw Error(TEXT("Invalid ani"));
+                if (fid == ID_ICON)
+                    ani.frames.push_back({ { fpos + 8, flen }, {} });
+                fpos += 8 + Padded(flen);
+            }
+        }
+        ani.chunks.push_back({ pos, len });
+
+        pos = offset + Padded(len);
+    }
+
+    if (!bHasHeader)
+        throw Error(TEXT("Invalid ani"));
+    if (!(ani.header.bfAttributes & AF_ICON))
+        throw Error(TEXT("Raw bitmap ani frames not supported"));
+
+    return ani;
+}
+
+bool AniFile::IsFrameList(const Chunk& chunk) const
+{
+    return Read32(file.data() + chunk.offset) == ID_LIST && chunk.size >= 4 && Read32(file.data() + chunk.offset + 8) == ID_FRAM;
+}
+
+// The size of a LIST fram chunk with its icon chunks as they are now, frame is the index of its first icon chunk and is moved past them
+DWORD AniFile::GetFrameListSize(const Chunk& chunk, size_t& frame) const
+{
+    const BYTE* p = file.data();
+    const size_t fend = chunk.offset + 8 + chunk.size;
+    DWORD size = 4;
+    size_t fpos = chunk.offset + 12;
+    while (fpos + 8 <= fend)
+    {
+        const DWORD flen = Read32(p + fpos + 4);
+        size += 8 + Padded(Read32(p + fpos) == ID_ICON ? GetFrameSize(frame++) : flen);
+        fpos += 8 + Padded(flen);
+    }
+    return size;
+}
+
+void AniFile::Save(LPCTSTR lpFilename) const
+{
+    DWORD dwRiffSize = 4;
+    size_t frame = 0;
+    for (const Chunk& chunk : chunks)
+        dwRiffSize += 8 + Padded(IsFrameList(chunk) ? GetFrameListSize(chunk, frame) : chunk.size);
+
+    const HANDLE hFile = CreateFile(lpFilename, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    CHECK(hFile != INVALID_HANDLE_VALUE);
+
+    try
+    {
+        WriteChunkHeader(hFile, ID_RIFF, dwRiffSize);
+        CheckWriteFile(hFile, &ID_ACON, sizeof(DWORD));
+
+        const BYTE* p = file.data();
+        frame = 0;
+        for (const Chunk& chunk : chunks)
+        {
+            if (!IsFrameList(chunk))
+            {
+                CheckWriteFile(hFile, p + chunk.offset, 8 + chunk.size);
+                WritePadding(hFile, chunk.size);
+                continue;
+            }
+
+            // Sub-chunks other than icon are copied as they are
+            size_t next = frame;
+            WriteChunkHeader(hFile, ID_LIST, GetFrameListSize(chunk, next));
+            CheckWriteFile(hFile, &ID_FRAM, sizeof(DWORD));
+            const size_t fend = chunk.offset + 8 + chunk.size;
+            size_t fpos = chunk.offset + 12;
+            while (fpos + 8 <= fend)
+            {
+                const DWORD flen = Read32(p + fpos + 4);
+                if (Read32(p + fpos) == ID_ICON)
+                {
+                    WriteChunkHeader(hFile, ID_ICON, GetFrameSize(frame));
+                    CheckWriteFile(hFile, GetFrameData(frame), GetFrameSize(frame));
+                    WritePadding(hFile, GetFrameSize(frame));
+                    ++frame;
+                }
+                else
+                {
+                    CheckWriteFile(hFile, p + fpos, 8 + flen);
+                    WritePadding(hFile, flen);
+                }
+                fpos += 8 + Padded(flen);
+            }
+        }
+
+        CloseHandle(hFile);
+    }
+    catch (...)
+    {
+        CloseHandle(hFile);
+        throw;
+    }
+}
+
+IconFile AniFile::GetFrame(size_t i, bool bIgnoreValidatePng, std::pmr::memory_resource* mr) const
+{
+    return IconFile::FromMemory(GetFrameData(i), GetFrameSize(i), bIgnoreValidatePng, mr);
+}
+
+void AniFile::SetFrame(size_t i, const IconFile& IconData, bool bIgnoreValidatePng)
+{
+    frames[i].replaced = IconData.SaveToMemory(bIgnoreValidatePng);
+}
@@ -0,0 +1,79 @@
+#pragma once
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <vector>
+#include <memory_resource>
+
+#include "IconFile.h"
+#include "Parallel.h"
+
+struct ANIHEADER
+{
+    DWORD cbSize; // = sizeof(ANIHEADER)
+    DWORD nFrames;
+    DWORD nSteps;
+    DWORD iWidth;
+    DWORD iHeight;
+    DWORD iBitCount;
+    DWORD nPlanes;
+    DWORD iDispRate; // in jiffies (1/60 s)
+    DWORD bfAttributes;
+};
+
+#define AF_ICON     0x0001 // frames are icon or cursor files
+#define AF_SEQUENCE 0x0002 // has a 'seq ' chunk
+
+// Animated cursor (RIFF ACON).
+// Frames stay as raw bytes and are only parsed into an IconFile when asked for.
+// Save writes every chunk back where it was, only the payloads of replaced frames change.
+class AniFile
+{
+public:
+    static AniFile Load(LPCTSTR lpFilename);
+    static AniFile FromMemory(std::vector<BYTE> data);
+
+    void Save(LPCTSTR lpFilename) const;
+
+    const ANIHEADER& GetHeader() const { return header; }
+    size_t GetFrameCount() const { return frames.size(); }
+
+    IconFile GetFrame(size_t i, bool bIgnoreValidatePng, std::pmr::memory_resource* mr = std::pmr::get_default_resource()) const;
+    void SetFrame(size_t i, const IconFile& IconData, bool bIgnoreValidatePng);
+
+    // Decode every frame, call f(IconFile&) on it and encode it back, frames run in parallel
+    template <class F>
+    void TransformFrames(F f, bool bIgnoreValidatePng)
+    {
+        ParallelFor(frames.size(), [&](size_t i)
+            {
+                std::pmr::monotonic_buffer_resource arena;
+                IconFile IconData = GetFrame(i, bIgnoreValidatePng, &arena);
+                f(IconData);
+                SetFrame(i, IconData, bIgnoreValidatePng);
+            });
+    }
+
+private:
+    struct Chunk
+    {
+        size_t offset;  // of the chunk data within file
+        DWORD size;
+    };
+
+    struct Frame
+    {
+        Chunk chunk;
+        std::vector<BYTE> replaced; // used instead of the original bytes when not empty
+    };
+
+    const BYTE* GetFrameData(size_t i) const { return frames[i].replaced.empty() ? file.data() + frames[i].chunk.offset : frames[i].replaced.data(); }
+    DWORD GetFrameSize(size_t i) const { return frames[i].replaced.empty() ? frames[i].chunk.size : static_cast<DWORD>(frames[i].replaced.size()); }
+
+    bool IsFrameList(const Chunk& chunk) const;
+    DWORD GetFrameListSize(const Chunk& chunk, size_t& frame) const;
+
+    std::vector<BYTE> file;
+    ANIHEADER header;
+    std::vector<Chunk> chunks;  // every chunk in file order, offset is of the chunk header
+    std::vector<Frame> frames;  // the icon chunks of LIST fram in order
+};
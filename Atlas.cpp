@@ -0,0 +1,237 @@
+#include "Atlas.h"
+
+#include "Bitmap.h"
+#include "IconFile.h"
+#include "Parallel.h"
+#include <tchar.h>
+#include <algorithm>
+#include <memory>
+#include <memory_resource>
+#include <numeric>
+#include <optional>
+
+namespace
+{
+    bool Selected(const ICONDIR& dir, const AtlasOptions& options)
+    {
+        const int width = dir.bWidth == 0 ? 256 : dir.bWidth;
+        return (options.size == 0 || width == options.size)
+            && (options.depth == 0 || dir.wBitCount == options.depth);
+    }
+
+    // Each file on the shelf is loaded once with all of its entries there, then the entries decode in parallel.
+    // An entry that fails to load or decode is reported, its slot left transparent and marked in failed
+    void DecodeShelf(Bitmap& atlas, LONG top, const std::vector<std::tstring>& files, const std::vector<AtlasItem>& items, const AtlasShelf& shelf, std::vector<char>& failed, bool bIgnoreValidatePng)
+    {
+        // The shelf's items by file then entry index, so a file's entries load in the order of its items
+        std::vector<size_t> order(shelf.end - shelf.begin);
+        std::iota(order.begin(), order.end(), shelf.begin);
+        std::sort(order.begin(), order.end(), [&items](size_t a, size_t b)
+            {
+                return items[a].file != items[b].file ? items[a].file < items[b].file : items[a].index < items[b].index;
+            });
+
+        // Runs of order sharing a file, as [first, second)
+        std::vector<std::pair<size_t, size_t>> groups;
+        for (size_t k = 0; k < order.size(); ++k)
+        {
+            if (groups.empty() || items[order[k]].file != items[order[groups.back().first]].file)
+                groups.push_back({ k, k + 1 });
+            else
+                groups.back().second = k + 1;
+        }
+
+        // entries[k] is the loaded entry of items[order[k]], null when its file failed to load
+        std::vector<const IconFile::Entry*> entries(order.size());
+        std::unique_ptr<std::pmr::monotonic_buffer_resource[]> arenas(new std::pmr::monotonic_buffer_resource[groups.size()]);
+        std::vector<std::optional<IconFile>> loaded(groups.size());
+        ParallelFor(groups.size(), [&](size_t g)
+            {
+                const size_t begin = groups[g].first;
+                const size_t end = groups[g].second;
+                const std::tstring& file = files[items[order[begin]].file];
+                try
+                {
+                    size_t next = begin;
+                    loaded[g].emplace(IconFile::Load(file.c_str(), [&items, &order, &next, end](int i, const ICONDIR&)
+                        {
+                            if (next == end || items[order[next]].index != i)
+                                return false;
+                            ++next;
+                            return true;
+                        }, bIgnoreValidatePng, &arenas[g]));
+                    for (size_t k = begin; k < end; ++k)
+                        entries[k] = &loaded[g]->entry.at(k - begin);
+                }
+                catch (const WinError& e)
+                {
+                    for (size_t k = begin; k < end; ++k)
+                        failed[order[k]] = true;
+                    _ftprintf(stderr, TEXT("%s: Error: 0x%08x\n"), file.c_str(), e.GetError());
+                }
+                catch (const Error& e)
+                {
+                    for (size_t k = begin; k < end; ++k)
+                        failed[order[k]] = true;
+                    _ftprintf(stderr, TEXT("%s: %s\n"), file.c_str(), e.GetMsg().c_str());
+                }
+            });
+
+        ParallelFor(order.size(), [&](size_t k)
+            {
+                if (entries[k] == nullptr)
+                    return;
+                const AtlasItem& item = items[order[k]];
+                try
+                {
+                    const Bitmap bitmap = Decode(*entries[k]);
+                    atlas.Blit(bitmap, item.x, item.y - top);
+                }
+                catch (const WinError& e)
+                {
+                    failed[order[k]] = true;
+                    _ftprintf(stderr, TEXT("%s: entry %d: Error: 0x%08x\n"), files[item.file].c_str(), item.index, e.GetError());
+                }
+                catch (const Error& e)
+                {
+                    failed[order[k]] = true;
+                    _ftprintf(stderr, TEXT("%s: entry %d: %s\n"), files[item.file].c_str(), item.index, e.GetMsg().c_str());
+                }
+            });
+    }
+
+    void WriteMap(LPCTSTR lpMapFile, const std::vector<std::tstring>& files, const std::vector<AtlasItem>& items, const std::vector<char>& failed)
+    {
+        const bool json = HasExtension(lpMapFile, TEXT(".json"));
+
+        std::string out;
+        out += json ? "[\n" : "file,entry,x,y,width,height\n";
+        bool first = true;
+        for (size_t i = 0; i < items.size(); ++i)
+        {
+            if (failed[i])
+                continue;
+            const AtlasItem& item = items[i];
+            if (json)
+            {
+                out += first ? "  { \"file\": " : ",\n  { \"file\": ";
+                AppendJsonString(out, files[item.file]);
+                out += ", \"entry\": " + std::to_string(item.index);
+                out += ", \"x\": " + std::to_string(item.x);
+                out += ", \"y\": " + std::to_string(item.y);
+                out += ", \"width\": " + std::to_string(item.width);
+                out += ", \"height\": " + std::to_string(item.height);
+                out += " }";
+            }
+            else
+            {
+                AppendCsvString(out, files[item.file]);
+                out += ',' + std::to_string(item.index);
+                out += ',' + std::to_string(item.x);
+                out += ',' + std::to_string(item.y);
+                out += ',' + std::to_string(item.width);
+                out += ',' + std::to_string(item.height);
+                out += '\n';
+            }
+            first = false;
+        }
+        if (json)
+            out += first ? "]\n" : "\n]\n";
+
+        WriteAllBytes(lpMapFile, out.data(), out.size());
+    }
+}
+
+std::vector<AtlasShelf> ShelfPacker::Pack(std::vector<AtlasItem>& items)
+{
+    std::stable_sort(items.begin(), items.end(), [](const AtlasItem& a, const AtlasItem& b)
+        {
+            return a.height > b.height;
+        });
+
+    for (const AtlasItem& item : items)
+    {
+        if (item.width > width)
+            width = item.width;
+    }
+
+    std::vector<AtlasShelf> shelves;
+    height = 0;
+    LONG x = 0;
+    for (size_t i = 0; i < items.size(); ++i)
+    {
+        AtlasItem& item = items[i];
+        if (shelves.empty() || x + item.width > width)
+        {
+            if (!shelves.empty())
+                height += shelves.back().height;
+            shelves.push_back({ height, item.height, i, i });
+            x = 0;
+        }
+        item.x = x;
+        item.y = height;
+        x += item.width;
+        shelves.back().end = i + 1;
+    }
+    if (!shelves.empty())
+        height += shelves.back().height;
+    return shelves;
+}
+
+void BuildAtlas(const std::vector<std::tstring>& files, LPCTSTR lpAtlasFile, LPCTSTR lpMapFile, const AtlasOptions& options, bool bIgnoreValidatePng)
+{
+    // Packing needs only the directories, a filter that takes nothing reads no payloads.
+    // The entries are validated when the shelves decode them.
+    std::vector<std::vector<AtlasItem>> fileitems(files.size());
+    ParallelFor(files.size(), [&](size_t f)
+        {
+            try
+            {
+                IconFile::Load(files[f].c_str(), [&fileitems, &options, f](int i, const ICONDIR& dir)
+                    {
+                        if (Selected(dir, options))
+                            fileitems[f].push_back({ f, i, dir.bWidth == 0 ? 256 : dir.bWidth, dir.bHeight == 0 ? 256 : dir.bHeight, 0, 0 });
+                        return false;
+                    }, bIgnoreValidatePng);
+            }
+            catch (const WinError& e)
+            {
+                _ftprintf(stderr, TEXT("%s: Error: 0x%08x\n"), files[f].c_str(), e.GetError());
+            }
+            catch (const Error& e)
+            {
+                _ftprintf(stderr, TEXT("%s: %s\n"), files[f].c_str(), e.GetMsg().c_str());
+            }
+        });
+
+    std::vector<AtlasItem> items;
+    for (const std::vector<AtlasItem>& fi : fileitems)
+        items.insert(items.end(), fi.begin(), fi.end());
+    fileitems.clear();
+    if (items.empty())
+        throw Error(TEXT("No entries selected"));
+
+    ShelfPacker packer(options.width);
+    const std::vector<AtlasShelf> shelves = packer.Pack(items);
+    std::vector<char> failed(items.size());
+
+    if (HasExtension(lpAtlasFile, TEXT(".png")))
+    {
+        Bitmap atlas(packer.GetWidth(), packer.GetHeight());
+        for (const AtlasShelf& shelf : shelves)
+            DecodeShelf(atlas, 0, files, items, shelf, failed, bIgnoreValidatePng);
+        SavePng(lpAtlasFile, atlas);
+    }
+    else
+    {
+        BmpWriter writer(lpAtlasFile, packer.GetWidth(), packer.GetHeight());
+        for (const AtlasShelf& shelf : shelves)
+        {
+            Bitmap band(packer.GetWidth(), shelf.height);
+            DecodeShelf(band, shelf.y, files, items, shelf, failed, bIgnoreValidatePng);
+            writer.WriteRows(band.GetPixels(), band.GetHeight());
+        }
+    }
+
+    WriteMap(lpMapFile, files, items, failed);
+}
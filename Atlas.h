@@ -0,0 +1,58 @@
+#pragma once
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <string>
+#include <vector>
+
+#include "Utils.h"
+
+struct AtlasItem
+{
+    size_t file;    // index into the file list
+    int index;      // entry index within the file
+    LONG width;
+    LONG height;
+    LONG x;
+    LONG y;
+};
+
+struct AtlasShelf
+{
+    LONG y;
+    LONG height;
+    size_t begin;   // items [begin, end) sit on this shelf
+    size_t end;
+};
+
+// Packs rectangles onto horizontal shelves of a fixed width atlas.
+// Items are sorted tallest first so each shelf is as high as its first item.
+class ShelfPacker
+{
+public:
+    explicit ShelfPacker(LONG width)
+        : width(width), height(0)
+    {
+    }
+
+    std::vector<AtlasShelf> Pack(std::vector<AtlasItem>& items);
+
+    LONG GetWidth() const { return width; }
+    LONG GetHeight() const { return height; }
+
+private:
+    LONG width;
+    LONG height;
+};
+
+struct AtlasOptions
+{
+    LONG width;     // minimum atlas width
+    int size;       // only entries of this width, 0 for all
+    int depth;      // only entries of this bit count, 0 for all
+};
+
+// Decodes the selected entries of every file in parallel, a shelf at a time, into one atlas image (.bmp or .png)
+// and writes a coordinate map (.json or .csv). The layout comes from the icon directories alone, an entry that
+// then fails to load or decode is reported, left transparent and out of the map.
+// A bmp atlas is streamed shelf by shelf so only one shelf of decoded pixels is held in memory.
+void BuildAtlas(const std::vector<std::tstring>& files, LPCTSTR lpAtlasFile, LPCTSTR lpMapFile, const AtlasOptions& options, bool bIgnoreValidatePng);
@@ -0,0 +1,369 @@
+#include "Bitmap.h"
+
+#include "IconImage.h"
+#include "Utils.h"
+#include <objidl.h>
+#include <gdiplus.h>
+#include <shlwapi.h>
+#include <algorithm>
+#include <cmath>
+
+#pragma comment(lib, "Shlwapi.lib")
+
+namespace
+{
+    class GdiPlus
+    {
+    public:
+        GdiPlus()
+            : token()
+        {
+            Gdiplus::GdiplusStartupInput input;
+            if (Gdiplus::GdiplusStartup(&token, &input, nullptr) != Gdiplus::Ok)
+                throw Error(TEXT("GDI+ startup failed"));
+        }
+        ~GdiPlus()
+        {
+            Gdiplus::GdiplusShutdown(token);
+        }
+
+    private:
+        ULONG_PTR token;
+    };
+
+    void InitGdiPlus()
+    {
+        static GdiPlus gdiplus;
+    }
+
+    CLSID GetEncoderClsid(LPCWSTR format)
+    {
+        UINT num = 0;
+        UINT size = 0;
+        Gdiplus::GetImageEncodersSize(&num, &size);
+        std::vector<BYTE> buffer(size);
+        Gdiplus::ImageCodecInfo* pCodecs = reinterpret_cast<Gdiplus::ImageCodecInfo*>(buffer.data());
+        Gdiplus::GetImageEncoders(num, size, pCodecs);
+        for (UINT i = 0; i < num; ++i)
+        {
+            if (wcscmp(pCodecs[i].MimeType, format) == 0)
+                return pCodecs[i].Clsid;
+        }
+        throw Error(TEXT("Encoder not found"));
+    }
+}
+
+void Bitmap::Blit(const Bitmap& src, int x, int y)
+{
+    const int x0 = x < 0 ? -x : 0;
+    const int y0 = y < 0 ? -y : 0;
+    const int x1 = x + src.width > width ? width - x : src.width;
+    const int y1 = y + src.height > height ? height - y : src.height;
+    if (x0 >= x1)
+        return;
+    for (int sy = y0; sy < y1; ++sy)
+    {
+        const RGBQUAD* s = src.GetRow(sy) + x0;
+        std::copy(s, s + (x1 - x0), GetRow(y + sy) + x + x0);
+    }
+}
+
+namespace
+{
+    // Source pixels covering one destination pixel and how much each contributes
+    struct Span
+    {
+        int begin;
+        std::vector<float> weights;
+    };
+
+    std::vector<Span> GetSpans(LONG src, LONG dst)
+    {
+        std::vector<Span> spans(dst);
+        const double scale = double(src) / dst;
+        for (LONG d = 0; d < dst; ++d)
+        {
+            const double s0 = d * scale;
+            const double s1 = (d + 1) * scale;
+            Span& span = spans[d];
+            span.begin = static_cast<int>(s0);
+            const int end = std::min<int>(src, static_cast<int>(std::ceil(s1)));
+            for (int i = span.begin; i < end; ++i)
+            {
+                const double overlap = std::min<double>(s1, i + 1) - std::max<double>(s0, i);
+                span.weights.push_back(static_cast<float>(overlap / (s1 - s0)));
+            }
+        }
+        return spans;
+    }
+
+    struct Premultiplied
+    {
+        float b, g, r, a;
+    };
+}
+
+Bitmap Resize(const Bitmap& src, LONG width, LONG height)
+{
+    const std::vector<Span> xspans = GetSpans(src.GetWidth(), width);
+    const std::vector<Span> yspans = GetSpans(src.GetHeight(), height);
+
+    // Horizontal pass into premultiplied floats
+    JobAllocate(ULONGLONG(width) * src.GetHeight() * sizeof(Premultiplied));
+    std::vector<Premultiplied> tmp(static_cast<size_t>(width) * src.GetHeight());
+    for (int y = 0; y < src.GetHeight(); ++y)
+    {
+        if (y % 64 == 0)
+            JobCheck();
+        const RGBQUAD* row = src.GetRow(y);
+        for (int x = 0; x < width; ++x)
+        {
+            const Span& span = xspans[x];
+            Premultiplied p = {};
+            for (size_t i = 0; i < span.weights.size(); ++i)
+            {
+                const RGBQUAD c = row[span.begin + i];
+                const float wa = span.weights[i] * c.rgbReserved;
+                p.b += wa * c.rgbBlue;
+                p.g += wa * c.rgbGreen;
+                p.r += wa * c.rgbRed;
+                p.a += wa;
+            }
+            tmp[static_cast<size_t>(y) * width + x] = p;
+        }
+    }
+
+    // Vertical pass and unpremultiply
+    Bitmap dst(width, height);
+    for (int y = 0; y < height; ++y)
+    {
+        if (y % 64 == 0)
+            JobCheck();
+        const Span& span = yspans[y];
+        RGBQUAD* row = dst.GetRow(y);
+        for (int x = 0; x < width; ++x)
+        {
+            Premultiplied p = {};
+            for (size_t i = 0; i < span.weights.size(); ++i)
+            {
+                const Premultiplied& s = tmp[static_cast<size_t>(span.begin + i) * width + x];
+                p.b += span.weights[i] * s.b;
+                p.g += span.weights[i] * s.g;
+                p.r += span.weights[i] * s.r;
+                p.a += span.weights[i] * s.a;
+            }
+            RGBQUAD c = {};
+            if (p.a > 0)
+            {
+                c.rgbBlue = static_cast<BYTE>((std::min)(p.b / p.a + 0.5f, 255.0f));
+                c.rgbGreen = static_cast<BYTE>((std::min)(p.g / p.a + 0.5f, 255.0f));
+                c.rgbRed = static_cast<BYTE>((std::min)(p.r / p.a + 0.5f, 255.0f));
+                c.rgbReserved = static_cast<BYTE>((std::min)(p.a + 0.5f, 255.0f));
+            }
+            row[x] = c;
+        }
+    }
+    return dst;
+}
+
+Bitmap Decode(const IconFile::Entry& entry)
+{
+    JobCheck();
+    if (entry.IsPNG())
+    {
+        Bitmap bitmap = DecodePng(entry.GetData(), entry.GetDataSize());
+        JobPixels(ULONGLONG(bitmap.GetWidth()) * bitmap.GetHeight());
+        return bitmap;
+    }
+
+    const IconImage image(entry);
+    Bitmap bitmap(image.GetWidth(), image.GetHeight());
+    for (int y = 0; y < bitmap.GetHeight(); ++y)
+    {
+        if (y % 64 == 0 && y > 0)
+            JobCheck();
+        image.GetRow(y, bitmap.GetRow(y));
+    }
+    JobPixels(ULONGLONG(bitmap.GetWidth()) * bitmap.GetHeight());
+    return bitmap;
+}
+
+IconFile::Entry CreateEntry(LONG width, LONG height, WORD wBitCount, const IconFile::Entry::allocator_type& alloc)
+{
+    if (!PixelFormat::IsSupported(wBitCount, BI_RGB))
+        throw Error(TEXT("Bit count not supported"));
+    if (width < 1 || width > 256 || height < 1 || height > 256)
+        throw Error(TEXT("Icon size not supported"));
+
+    const int iColorCount = wBitCount <= 8 ? 1 << wBitCount : 0;
+
+    IconFile::Entry entry(alloc);
+    entry.dir.bWidth = static_cast<BYTE>(width);   // 256 wraps to 0
+    entry.dir.bHeight = static_cast<BYTE>(height);
+    entry.dir.bColorCount = static_cast<BYTE>(iColorCount < 256 ? iColorCount : 0);
+    entry.dir.wPlanes = 1;
+    entry.dir.wBitCount = wBitCount;
+
+    const DWORD dwBytesInXOR = pad32(width * wBitCount) / 8 * height;
+    const DWORD dwBytesInAND = pad32(width) / 8 * height;
+    entry.SetDataSize(sizeof(BITMAPINFOHEADER) + iColorCount * sizeof(RGBQUAD) + dwBytesInXOR + dwBytesInAND);
+    memset(entry.GetData(), 0, entry.GetDataSize());
+
+    BITMAPINFOHEADER* header = entry.GetBITMAPINFOHEADER();
+    header->biSize = sizeof(BITMAPINFOHEADER);
+    header->biWidth = width;
+    header->biHeight = height * 2;
+    header->biPlanes = 1;
+    header->biBitCount = wBitCount;
+    header->biCompression = BI_RGB;
+    header->biSizeImage = dwBytesInXOR + dwBytesInAND;
+
+    RGBQUAD* pColors = entry.GetColors();
+    if (wBitCount == 1)
+        pColors[1] = { 255, 255, 255, 0 };
+    else if (wBitCount == 4)
+    {
+        static const DWORD vga[16] = {
+            0x000000, 0x800000, 0x008000, 0x808000, 0x000080, 0x800080, 0x008080, 0xC0C0C0,
+            0x808080, 0xFF0000, 0x00FF00, 0xFFFF00, 0x0000FF, 0xFF00FF, 0x00FFFF, 0xFFFFFF,
+        };
+        for (int i = 0; i < 16; ++i)
+            pColors[i] = { BYTE(vga[i]), BYTE(vga[i] >> 8), BYTE(vga[i] >> 16), 0 };
+    }
+    else if (wBitCount == 8)
+    {
+        for (int i = 0; i < 216; ++i)
+            pColors[i] = { BYTE(i % 6 * 51), BYTE(i / 6 % 6 * 51), BYTE(i / 36 * 51), 0 };
+        for (int i = 216; i < 256; ++i)
+        {
+            const BYTE grey = static_cast<BYTE>((i - 216 + 1) * 255 / 41);
+            pColors[i] = { grey, grey, grey, 0 };
+        }
+    }
+    return entry;
+}
+
+IconFile::Entry EncodeEntry(const Bitmap& bitmap, const IconFile::Entry::allocator_type& alloc)
+{
+    IconFile::Entry entry = CreateEntry(bitmap.GetWidth(), bitmap.GetHeight(), 32, alloc);
+    const IconImage image(entry);
+    for (int y = 0; y < bitmap.GetHeight(); ++y)
+        image.PutRow(y, bitmap.GetRow(y));
+    return entry;
+}
+
+IconFile::Entry EncodeEntry(const Bitmap& bitmap, WORD wBitCount, const IconFile::Entry::allocator_type& alloc)
+{
+    if (wBitCount == 32)
+        return EncodeEntry(bitmap, alloc);
+
+    // Masked pixels are black so the XOR leaves the screen as it is
+    IconFile::Entry entry = CreateEntry(bitmap.GetWidth(), bitmap.GetHeight(), wBitCount, alloc);
+    const IconImage image(entry);
+    std::vector<RGBQUAD> row(bitmap.GetWidth());
+    for (int y = 0; y < bitmap.GetHeight(); ++y)
+    {
+        const RGBQUAD* pSrc = bitmap.GetRow(y);
+        for (int x = 0; x < bitmap.GetWidth(); ++x)
+            row[x] = pSrc[x].rgbReserved < 128 ? RGBQUAD() : RGBQUAD{ pSrc[x].rgbBlue, pSrc[x].rgbGreen, pSrc[x].rgbRed, 255 };
+        image.PutRow(y, row.data());
+    }
+    return entry;
+}
+
+Bitmap DecodePng(const BYTE* pData, DWORD dwSize)
+{
+    InitGdiPlus();
+
+    IStream* pStream = SHCreateMemStream(pData, dwSize);
+    CHECK(pStream);
+    Gdiplus::Bitmap png(pStream);
+    pStream->Release();
+    if (png.GetLastStatus() != Gdiplus::Ok)
+        throw Error(TEXT("Invalid PNG"));
+
+    Bitmap bitmap(png.GetWidth(), png.GetHeight());
+
+    const Gdiplus::Rect rect(0, 0, bitmap.GetWidth(), bitmap.GetHeight());
+    Gdiplus::BitmapData data = {};
+    data.Width = bitmap.GetWidth();
+    data.Height = bitmap.GetHeight();
+    data.Stride = bitmap.GetWidth() * sizeof(RGBQUAD);
+    data.PixelFormat = PixelFormat32bppARGB;
+    data.Scan0 = bitmap.GetPixels();
+    if (png.LockBits(&rect, Gdiplus::ImageLockModeRead | Gdiplus::ImageLockModeUserInputBuf, PixelFormat32bppARGB, &data) != Gdiplus::Ok)
+        throw Error(TEXT("Invalid PNG"));
+    png.UnlockBits(&data);
+
+    return bitmap;
+}
+
+void SavePng(LPCTSTR lpFilename, const Bitmap& bitmap)
+{
+    InitGdiPlus();
+
+    Gdiplus::Bitmap png(bitmap.GetWidth(), bitmap.GetHeight(), bitmap.GetWidth() * sizeof(RGBQUAD), PixelFormat32bppARGB,
+        reinterpret_cast<BYTE*>(const_cast<RGBQUAD*>(bitmap.GetPixels())));
+    const CLSID clsid = GetEncoderClsid(L"image/png");
+    if (png.Save(lpFilename, &clsid) != Gdiplus::Ok)
+        throw Error(TEXT("Error saving PNG"));
+}
+
+BmpWriter::BmpWriter(LPCTSTR lpFilename, LONG width, LONG height)
+    : hFile(INVALID_HANDLE_VALUE), width(width), remaining(height)
+{
+    const ULONGLONG size = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPV5HEADER) + ULONGLONG(width) * height * sizeof(RGBQUAD);
+    if (size > MAXDWORD)
+        throw Error(TEXT("Bitmap too large"));
+
+    hFile = CreateFile(lpFilename, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    CHECK(hFile != INVALID_HANDLE_VALUE);
+
+    BITMAPFILEHEADER fileheader = {};
+    fileheader.bfType = 0x4D42; // BM
+    fileheader.bfSize = static_cast<DWORD>(size);
+    fileheader.bfOffBits = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPV5HEADER);
+
+    BITMAPV5HEADER header = {};
+    header.bV5Size = sizeof(BITMAPV5HEADER);
+    header.bV5Width = width;
+    header.bV5Height = -height; // top-down
+    header.bV5Planes = 1;
+    header.bV5BitCount = 32;
+    header.bV5Compression = BI_BITFIELDS;
+    header.bV5SizeImage = width * height * sizeof(RGBQUAD);
+    header.bV5RedMask = 0x00FF0000;
+    header.bV5GreenMask = 0x0000FF00;
+    header.bV5BlueMask = 0x000000FF;
+    header.bV5AlphaMask = 0xFF000000;
+    header.bV5CSType = LCS_sRGB;
+
+    try
+    {
+        CheckWriteFile(hFile, &fileheader, sizeof(fileheader));
+        CheckWriteFile(hFile, &header, sizeof(header));
+    }
+    catch (...)
+    {
+        CloseHandle(hFile);
+        throw;
+    }
+}
+
+BmpWriter::~BmpWriter()
+{
+    CloseHandle(hFile);
+}
+
+void BmpWriter::WriteRows(const RGBQUAD* pRows, LONG rows)
+{
+    _ASSERTE(rows <= remaining);
+    CheckWriteFile(hFile, pRows, rows * width * sizeof(RGBQUAD));
+    remaining -= rows;
+}
+
+void SaveBmp(LPCTSTR lpFilename, const Bitmap& bitmap)
+{
+    BmpWriter writer(lpFilename, bitmap.GetWidth(), bitmap.GetHeight());
+    writer.WriteRows(bitmap.GetPixels(), bitmap.GetHeight());
+}
@@ -0,0 +1,78 @@
+#pragma once
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <vector>
+
+#include "IconFile.h"
+#include "Job.h"
+
+// Top-down 32-bit BGRA image with straight alpha
+class Bitmap
+{
+public:
+    Bitmap()
+        : width(0), height(0)
+    {
+    }
+    Bitmap(LONG width, LONG height)
+        : width(width), height(height), pixels(Count(width, height))
+    {
+    }
+
+    LONG GetWidth() const { return width; }
+    LONG GetHeight() const { return height; }
+
+    RGBQUAD* GetRow(int y) { _ASSERTE(y >= 0 && y < height); return pixels.data() + static_cast<size_t>(y) * width; }
+    const RGBQUAD* GetRow(int y) const { _ASSERTE(y >= 0 && y < height); return pixels.data() + static_cast<size_t>(y) * width; }
+
+    RGBQUAD* GetPixels() { return pixels.data(); }
+    const RGBQUAD* GetPixels() const { return pixels.data(); }
+
+    // Copy src with its top left at (x, y), clipped to this image
+    void Blit(const Bitmap& src, int x, int y);
+
+private:
+    // Charged to the job before the pixels are allocated
+    static size_t Count(LONG width, LONG height)
+    {
+        const size_t count = static_cast<size_t>(width) * height;
+        JobAllocate(ULONGLONG(count) * sizeof(RGBQUAD));
+        return count;
+    }
+
+    LONG width;
+    LONG height;
+    std::vector<RGBQUAD> pixels;
+};
+
+// Area averaging resample in premultiplied alpha
+Bitmap Resize(const Bitmap& src, LONG width, LONG height);
+
+Bitmap Decode(const IconFile::Entry& entry);
+// A blank BI_RGB entry, at most 256 x 256, indexed depths get a fixed palette
+// (black and white, the 16 VGA colours or a 6x6x6 cube and greys)
+IconFile::Entry CreateEntry(LONG width, LONG height, WORD wBitCount, const IconFile::Entry::allocator_type& alloc = {});
+// Build a 32-bit BMP entry, at most 256 x 256
+IconFile::Entry EncodeEntry(const Bitmap& bitmap, const IconFile::Entry::allocator_type& alloc = {});
+// At any BI_RGB depth, alpha under 128 goes to the AND mask and indexed depths take the nearest colour
+IconFile::Entry EncodeEntry(const Bitmap& bitmap, WORD wBitCount, const IconFile::Entry::allocator_type& alloc = {});
+Bitmap DecodePng(const BYTE* pData, DWORD dwSize);
+
+void SavePng(LPCTSTR lpFilename, const Bitmap& bitmap);
+
+// Streams a top-down 32-bit bmp a band of rows at a time
+class BmpWriter
+{
+public:
+    BmpWriter(LPCTSTR lpFilename, LONG width, LONG height);
+    ~BmpWriter();
+
+    void WriteRows(const RGBQUAD* pRows, LONG rows);
+
+private:
+    HANDLE hFile;
+    LONG width;
+    LONG remaining;
+};
+
+void SaveBmp(LPCTSTR lpFilename, const Bitmap& bitmap);
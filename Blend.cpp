@@ -0,0 +1,254 @@
+#include "Blend.h"
+
+#include <tchar.h>
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+    // Fraction of src and of dst in the result, 0 to 255
+    struct Factors
+    {
+        UINT fa;
+        UINT fb;
+    };
+
+    Factors GetFactors(BlendOp op, UINT as, UINT ad)
+    {
+        switch (op)
+        {
+        case BLEND_CLEAR:       return { 0, 0 };
+        case BLEND_SRC:         return { 255, 0 };
+        case BLEND_DST:         return { 0, 255 };
+        default:
+        case BLEND_SRC_OVER:    return { 255, 255 - as };
+        case BLEND_DST_OVER:    return { 255 - ad, 255 };
+        case BLEND_SRC_IN:      return { ad, 0 };
+        case BLEND_DST_IN:      return { 0, as };
+        case BLEND_SRC_OUT:     return { 255 - ad, 0 };
+        case BLEND_DST_OUT:     return { 0, 255 - as };
+        case BLEND_SRC_ATOP:    return { ad, 255 - as };
+        case BLEND_DST_ATOP:    return { 255 - ad, as };
+        case BLEND_XOR:         return { 255 - ad, 255 - as };
+        case BLEND_PLUS:        return { 255, 255 };
+        }
+    }
+
+    // Straight weights can add up past 255
+    BYTE Div255Clamp(UINT x)
+    {
+        return x >= 255 * 255 ? 255 : Div255(x);
+    }
+
+    // sRGB to 16 bit linear, and back from 12 bits of linear
+    struct LinearTables
+    {
+        WORD toLinear[256];
+        BYTE fromLinear[4096];
+        LinearTables()
+        {
+            for (int i = 0; i < 256; ++i)
+            {
+                const double c = i / 255.0;
+                const double l = c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4);
+                toLinear[i] = static_cast<WORD>(l * 65535.0 + 0.5);
+            }
+            for (int i = 0; i < 4096; ++i)
+            {
+                const double l = i / 4095.0;
+                const double c = l <= 0.0031308 ? l * 12.92 : 1.055 * pow(l, 1.0 / 2.4) - 0.055;
+                fromLinear[i] = static_cast<BYTE>((std::min)(c * 255.0 + 0.5, 255.0));
+            }
+        }
+        BYTE FromLinear(UINT l) const
+        {
+            return fromLinear[(std::min)((l + 8) >> 4, 4095u)];
+        }
+    };
+
+    const LinearTables& GetLinearTables()
+    {
+        static const LinearTables tables;
+        return tables;
+    }
+
+    // 2^36 / (255 * a) rounded, x * recip[a] >> 36 divides by 255 * a with a multiply.
+    // Exact to rounding for x below 2^34, which covers the weighted sums below.
+    struct Reciprocals
+    {
+        UINT recip[256];
+        Reciprocals()
+        {
+            recip[0] = 0;
+            for (UINT a = 1; a < 256; ++a)
+                recip[a] = static_cast<UINT>(((1ull << 36) + 255 * a / 2) / (255 * a));
+        }
+        ULONGLONG Divide(ULONGLONG x, BYTE a) const
+        {
+            return (x * recip[a] + (1ull << 35)) >> 36;
+        }
+    };
+
+    const Reciprocals& GetReciprocals()
+    {
+        static const Reciprocals reciprocals;
+        return reciprocals;
+    }
+
+    BYTE BlendAlpha(BlendOp op, const Factors& f, UINT as, UINT ad)
+    {
+        if (op == BLEND_PLUS)
+            return static_cast<BYTE>((std::min)(as + ad, 255u));
+        return Div255(f.fa * as + f.fb * ad);
+    }
+
+    RGBQUAD BlendStraight(const RGBQUAD s, const RGBQUAD d, BlendOp op)
+    {
+        const Factors f = GetFactors(op, s.rgbReserved, d.rgbReserved);
+        const UINT wa = Div255(f.fa * s.rgbReserved);
+        const UINT wb = f.fb;
+
+        RGBQUAD r;
+        r.rgbBlue = Div255Clamp(wa * s.rgbBlue + wb * d.rgbBlue);
+        r.rgbGreen = Div255Clamp(wa * s.rgbGreen + wb * d.rgbGreen);
+        r.rgbRed = Div255Clamp(wa * s.rgbRed + wb * d.rgbRed);
+        r.rgbReserved = BlendAlpha(op, f, s.rgbReserved, d.rgbReserved);
+        return r;
+    }
+
+    // Premultiplying and dividing back out by the result alpha in one step, the colours are
+    // weighted by factor * alpha and nothing is rounded to 8 bits in between.
+    // The divide by 255 * ar comes from a table so the channels only multiply.
+    RGBQUAD BlendPremultiplied(const RGBQUAD s, const RGBQUAD d, BlendOp op)
+    {
+        const UINT as = s.rgbReserved;
+        const UINT ad = d.rgbReserved;
+        const Factors f = GetFactors(op, as, ad);
+        const BYTE ar = BlendAlpha(op, f, as, ad);
+
+        RGBQUAD r = {};
+        if (ar == 0)
+            return r;
+
+        // plus adds the premultiplied colours and clamps, scaled by 255 to share the table
+        const Reciprocals& t = GetReciprocals();
+        const UINT wa = op == BLEND_PLUS ? as : f.fa * as;
+        const UINT wb = op == BLEND_PLUS ? ad : f.fb * ad;
+        auto channel = [&](UINT cs, UINT cd)
+        {
+            const UINT n = op == BLEND_PLUS ? (std::min)(cs * wa + cd * wb, 255u * 255u) * 255 : cs * wa + cd * wb;
+            return static_cast<BYTE>((std::min)(t.Divide(n, ar), 255ull));
+        };
+        r.rgbBlue = channel(s.rgbBlue, d.rgbBlue);
+        r.rgbGreen = channel(s.rgbGreen, d.rgbGreen);
+        r.rgbRed = channel(s.rgbRed, d.rgbRed);
+        r.rgbReserved = ar;
+        return r;
+    }
+
+    RGBQUAD BlendLinear(const RGBQUAD s, const RGBQUAD d, BlendOp op)
+    {
+        const UINT as = s.rgbReserved;
+        const UINT ad = d.rgbReserved;
+        const Factors f = GetFactors(op, as, ad);
+        const BYTE ar = BlendAlpha(op, f, as, ad);
+
+        RGBQUAD r = {};
+        if (ar == 0)
+            return r;
+
+        const LinearTables& t = GetLinearTables();
+        const Reciprocals& rt = GetReciprocals();
+        const ULONGLONG wa = op == BLEND_PLUS ? as : f.fa * as;
+        const ULONGLONG wb = op == BLEND_PLUS ? ad : f.fb * ad;
+        auto channel = [&](BYTE cs, BYTE cd)
+        {
+            const ULONGLONG n = t.toLinear[cs] * wa + t.toLinear[cd] * wb;
+            const ULONGLONG l = rt.Divide(op == BLEND_PLUS ? (std::min)(n, 65535ull * 255) * 255 : n, ar);
+            return t.FromLinear(static_cast<UINT>((std::min)(l, 65535ull)));
+        };
+        r.rgbBlue = channel(s.rgbBlue, d.rgbBlue);
+        r.rgbGreen = channel(s.rgbGreen, d.rgbGreen);
+        r.rgbRed = channel(s.rgbRed, d.rgbRed);
+        r.rgbReserved = ar;
+        return r;
+    }
+}
+
+RGBQUAD Blend(const RGBQUAD src, const RGBQUAD dst, const BlendMode& mode)
+{
+    switch (mode.space)
+    {
+    case SPACE_STRAIGHT:        return BlendStraight(src, dst, mode.op);
+    default:
+    case SPACE_PREMULTIPLIED:   return BlendPremultiplied(src, dst, mode.op);
+    case SPACE_LINEAR:          return BlendLinear(src, dst, mode.op);
+    }
+}
+
+void BlendRow(const RGBQUAD* pSrc, RGBQUAD* pDst, int count, const BlendMode& mode)
+{
+    if (mode.op == BLEND_SRC_OVER)
+    {
+        // Most pixels of an overlay are fully transparent or opaque
+        for (int x = 0; x < count; ++x)
+        {
+            const BYTE a = pSrc[x].rgbReserved;
+            if (a == 255)
+                pDst[x] = pSrc[x];
+            else if (a != 0)
+                pDst[x] = Blend(pSrc[x], pDst[x], mode);
+        }
+    }
+    else
+    {
+        for (int x = 0; x < count; ++x)
+            pDst[x] = Blend(pSrc[x], pDst[x], mode);
+    }
+}
+
+bool ParseBlendOp(LPCTSTR str, BlendOp& op)
+{
+    static const struct { LPCTSTR name; BlendOp op; } ops[] = {
+        { TEXT("clear"), BLEND_CLEAR },
+        { TEXT("src"), BLEND_SRC },
+        { TEXT("dst"), BLEND_DST },
+        { TEXT("srcover"), BLEND_SRC_OVER },
+        { TEXT("dstover"), BLEND_DST_OVER },
+        { TEXT("srcin"), BLEND_SRC_IN },
+        { TEXT("dstin"), BLEND_DST_IN },
+        { TEXT("srcout"), BLEND_SRC_OUT },
+        { TEXT("dstout"), BLEND_DST_OUT },
+        { TEXT("srcatop"), BLEND_SRC_ATOP },
+        { TEXT("dstatop"), BLEND_DST_ATOP },
+        { TEXT("xor"), BLEND_XOR },
+        { TEXT("plus"), BLEND_PLUS },
+    };
+    for (const auto& o : ops)
+    {
+        if (_tcsicmp(str, o.name) == 0)
+        {
+            op = o.op;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ParseBlendSpace(LPCTSTR str, BlendSpace& space)
+{
+    static const struct { LPCTSTR name; BlendSpace space; } spaces[] = {
+        { TEXT("straight"), SPACE_STRAIGHT },
+        { TEXT("premultiplied"), SPACE_PREMULTIPLIED },
+        { TEXT("linear"), SPACE_LINEAR },
+    };
+    for (const auto& s : spaces)
+    {
+        if (_tcsicmp(str, s.name) == 0)
+        {
+            space = s.space;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,47 @@
+#pragma once
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+// Porter-Duff operators, src is drawn onto dst
+enum BlendOp
+{
+    BLEND_CLEAR,
+    BLEND_SRC,
+    BLEND_DST,
+    BLEND_SRC_OVER,
+    BLEND_DST_OVER,
+    BLEND_SRC_IN,
+    BLEND_DST_IN,
+    BLEND_SRC_OUT,
+    BLEND_DST_OUT,
+    BLEND_SRC_ATOP,
+    BLEND_DST_ATOP,
+    BLEND_XOR,
+    BLEND_PLUS,
+};
+
+// SPACE_STRAIGHT weights the colours by the src alpha only, the original blend, exact for an opaque dst.
+// SPACE_PREMULTIPLIED weights both colours by their alpha so transparent pixels don't darken the edges.
+// SPACE_LINEAR is premultiplied in linear light, converting from and to sRGB through tables.
+enum BlendSpace { SPACE_STRAIGHT, SPACE_PREMULTIPLIED, SPACE_LINEAR };
+
+struct BlendMode
+{
+    BlendOp op = BLEND_SRC_OVER;
+    BlendSpace space = SPACE_PREMULTIPLIED;
+};
+
+// x / 255 rounded to nearest without a divide, exact for x up to 255 * 255 (and a little beyond)
+inline BYTE Div255(UINT x)
+{
+    x += 128;
+    return static_cast<BYTE>((x + (x >> 8)) >> 8);
+}
+
+RGBQUAD Blend(const RGBQUAD src, const RGBQUAD dst, const BlendMode& mode);
+// pDst[i] = Blend(pSrc[i], pDst[i], mode), src over skips transparent and copies opaque src pixels unchanged
+void BlendRow(const RGBQUAD* pSrc, RGBQUAD* pDst, int count, const BlendMode& mode);
+
+// Names as used on the command line (eg srcover, premultiplied), false if unknown
+bool ParseBlendOp(LPCTSTR str, BlendOp& op);
+bool ParseBlendSpace(LPCTSTR str, BlendSpace& space);
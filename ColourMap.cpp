@@ -0,0 +1,196 @@
+#include "ColourMap.h"
+
+#include "Bitmap.h"
+#include "IconImage.h"
+#include "PixelFormat.h"
+#include "Png.h"
+#include "Utils.h"
+#include <cstdlib>
+#include <string>
+
+namespace
+{
+    RGBQUAD ToRGBQUAD(unsigned long i)
+    {
+        const RGBQUAD c = {
+            BYTE(i >> 0),
+            BYTE(i >> 8),
+            BYTE(i >> 16),
+            0,
+        };
+        return c;
+    }
+
+    // An icon has few distinct colours, each is looked up once per entry
+    class CachedMap
+    {
+    public:
+        explicit CachedMap(const ColourMap& map)
+            : map(map)
+        {
+        }
+
+        // Replaces the colour of a visible pixel, true if it changed
+        bool operator()(RGBQUAD& c)
+        {
+            if (c.rgbReserved == 0)
+                return false;
+            const DWORD key = c.rgbRed << 16 | c.rgbGreen << 8 | c.rgbBlue;
+            auto it = cache.find(key);
+            if (it == cache.end())
+            {
+                RGBQUAD r = c;
+                const bool bMapped = map.Map(c, r) && (r.rgbRed != c.rgbRed || r.rgbGreen != c.rgbGreen || r.rgbBlue != c.rgbBlue);
+                it = cache.emplace(key, std::make_pair(bMapped, r)).first;
+            }
+            if (!it->second.first)
+                return false;
+            c.rgbRed = it->second.second.rgbRed;
+            c.rgbGreen = it->second.second.rgbGreen;
+            c.rgbBlue = it->second.second.rgbBlue;
+            return true;
+        }
+
+    private:
+        const ColourMap& map;
+        std::unordered_map<DWORD, std::pair<bool, RGBQUAD>> cache;
+    };
+}
+
+ColourMap ColourMap::Load(LPCTSTR lpFilename)
+{
+    const HANDLE hFile = CreateFile(lpFilename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    CHECK(hFile != INVALID_HANDLE_VALUE);
+
+    std::string text;
+    try
+    {
+        LARGE_INTEGER size;
+        CHECK(GetFileSizeEx(hFile, &size));
+        if (size.QuadPart > 16 * 1024 * 1024)
+            throw Error(TEXT("Colour map too large"));
+        text.resize(static_cast<size_t>(size.QuadPart));
+        CheckReadFile(hFile, &text[0], static_cast<DWORD>(text.size()));
+    }
+    catch (...)
+    {
+        CloseHandle(hFile);
+        throw;
+    }
+    CloseHandle(hFile);
+
+    ColourMap map;
+    size_t pos = 0;
+    int line = 0;
+    while (pos < text.size())
+    {
+        size_t end = text.find('\n', pos);
+        if (end == std::string::npos)
+            end = text.size();
+        std::string s = text.substr(pos, end - pos);
+        pos = end + 1;
+        ++line;
+
+        const size_t comment = s.find('#');
+        if (comment != std::string::npos)
+            s.erase(comment);
+        if (s.find_first_not_of(" \t\r") == std::string::npos)
+            continue;
+
+        const char* p = s.c_str();
+        char* e;
+        const unsigned long src = strtoul(p, &e, 0);
+        const bool bSrc = e != p;
+        p = e;
+        const unsigned long dst = strtoul(p, &e, 0);
+        const bool bDst = e != p;
+        p = e;
+        const long tolerance = strtol(p, &e, 0);
+        p = e;
+        if (!bSrc || !bDst || tolerance < 0 || s.find_first_not_of(" \t\r", p - s.c_str()) != std::string::npos)
+            throw Error(TEXT("Invalid colour map line ") + std::to_wstring(line));
+
+        map.Add(ToRGBQUAD(src), ToRGBQUAD(dst), tolerance);
+    }
+    return map;
+}
+
+void ColourMap::Add(const RGBQUAD src, const RGBQUAD dst, long tolerance)
+{
+    if (tolerance == 0)
+        exact.emplace(Key(src), dst);
+    else
+        nearest.push_back({ src, dst, tolerance * tolerance });
+}
+
+bool ColourMap::Map(const RGBQUAD c, RGBQUAD& r) const
+{
+    const auto it = exact.find(Key(c));
+    if (it != exact.end())
+    {
+        r = it->second;
+        return true;
+    }
+
+    // The closest wins, ties go to the earlier mapping
+    const Mapping* best = nullptr;
+    long bestdist = 0;
+    for (const Mapping& m : nearest)
+    {
+        const long dist = ColourDistanceSq(c, m.src);
+        if (dist <= m.tolerancesq && (best == nullptr || dist < bestdist))
+        {
+            best = &m;
+            bestdist = dist;
+        }
+    }
+    if (best == nullptr)
+        return false;
+    r = best->dst;
+    return true;
+}
+
+void ColourMap::Apply(IconFile::Entry& entry) const
+{
+    CachedMap map(*this);
+
+    if (entry.IsPNG())
+    {
+        Bitmap bitmap = Decode(entry);
+        bool bChanged = false;
+        RGBQUAD* p = bitmap.GetPixels();
+        const size_t count = static_cast<size_t>(bitmap.GetWidth()) * bitmap.GetHeight();
+        for (size_t i = 0; i < count; ++i)
+            bChanged |= map(p[i]);
+        if (bChanged)
+        {
+            const std::vector<BYTE> png = EncodePng(bitmap);
+            entry.SetDataSize(static_cast<DWORD>(png.size()));
+            memcpy(entry.GetData(), png.data(), png.size());
+        }
+        return;
+    }
+
+    const IconImage image(entry);
+    if (image.IsIndexed())
+    {
+        // Pixels are palette indices, mostly only the palette needs rewriting
+        image.TransformIndexed([&map](RGBQUAD c)
+            {
+                map(c);
+                return c;
+            });
+        return;
+    }
+
+    std::vector<RGBQUAD> row(image.GetWidth());
+    for (int y = 0; y < image.GetHeight(); ++y)
+    {
+        image.GetRow(y, row.data());
+        bool bChanged = false;
+        for (RGBQUAD& c : row)
+            bChanged |= map(c);
+        if (bChanged)
+            image.PutRow(y, row.data());
+    }
+}
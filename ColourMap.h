@@ -0,0 +1,41 @@
+#pragma once
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <unordered_map>
+#include <vector>
+
+#include "IconFile.h"
+
+// A table of colour replacements applied in one pass, the alpha of each pixel is kept.
+// Exact mappings are a hash lookup, a colour with no exact mapping takes the nearest
+// mapping within its tolerance by ColourDistanceSq.
+class ColourMap
+{
+public:
+    // Text file, one mapping per line: src dst [tolerance], colours as 0xRRGGBB, # starts a comment
+    static ColourMap Load(LPCTSTR lpFilename);
+
+    // tolerance 0 is an exact match, otherwise compared with the square root of ColourDistanceSq
+    void Add(const RGBQUAD src, const RGBQUAD dst, long tolerance);
+    bool IsEmpty() const { return exact.empty() && nearest.empty(); }
+
+    // false when nothing maps c
+    bool Map(const RGBQUAD c, RGBQUAD& r) const;
+
+    // Palette entries rewrite the palette only, PNG entries are decoded and re-encoded.
+    // Safe to call on different entries in parallel.
+    void Apply(IconFile::Entry& entry) const;
+
+private:
+    struct Mapping
+    {
+        RGBQUAD src;
+        RGBQUAD dst;
+        long tolerancesq;
+    };
+
+    static DWORD Key(const RGBQUAD c) { return c.rgbRed << 16 | c.rgbGreen << 8 | c.rgbBlue; }
+
+    std::unordered_map<DWORD, RGBQUAD> exact;
+    std::vector<Mapping> nearest;
+};
@@ -0,0 +1,228 @@
+#include "Dedupe.h"
+
+#include "Parallel.h"
+#include <tchar.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory_resource>
+#include <numeric>
+
+namespace
+{
+    // Nearest width to size, the larger on a tie then the deeper, -1 when there are no entries
+    int SelectEntry(const IconFile& IconData, int size)
+    {
+        int best = -1;
+        for (size_t i = 0; i < IconData.entry.size(); ++i)
+        {
+            const IconFile::Entry& e = IconData.entry[i];
+            if (best < 0)
+            {
+                best = static_cast<int>(i);
+                continue;
+            }
+            const IconFile::Entry& b = IconData.entry[best];
+            const int de = abs(e.GetWidth() - size);
+            const int db = abs(b.GetWidth() - size);
+            const int depthe = e.IsPNG() ? 32 : e.dir.wBitCount;
+            const int depthb = b.IsPNG() ? 32 : b.dir.wBitCount;
+            if (de < db || (de == db && (e.GetWidth() > b.GetWidth() || (e.GetWidth() == b.GetWidth() && depthe > depthb))))
+                best = static_cast<int>(i);
+        }
+        return best;
+    }
+
+    class DisjointSet
+    {
+    public:
+        explicit DisjointSet(size_t count)
+            : parent(count)
+        {
+            std::iota(parent.begin(), parent.end(), size_t(0));
+        }
+
+        size_t Find(size_t i)
+        {
+            while (parent[i] != i)
+            {
+                parent[i] = parent[parent[i]];
+                i = parent[i];
+            }
+            return i;
+        }
+
+        void Union(size_t a, size_t b)
+        {
+            a = Find(a);
+            b = Find(b);
+            if (a != b)
+                parent[(std::max)(a, b)] = (std::min)(a, b);
+        }
+
+    private:
+        std::vector<size_t> parent;
+    };
+
+    struct FileHash
+    {
+        ULONGLONG hash = 0;
+        int index = -1;
+        std::tstring error;
+    };
+}
+
+ULONGLONG DHash(const Bitmap& bitmap)
+{
+    if (bitmap.GetWidth() == 0 || bitmap.GetHeight() == 0)
+        return 0;
+
+    const Bitmap small = Resize(bitmap, 9, 8);
+    ULONGLONG hash = 0;
+    for (int y = 0; y < 8; ++y)
+    {
+        // Luma over a white background, scaled by 255 as only the order matters
+        UINT grey[9];
+        const RGBQUAD* p = small.GetRow(y);
+        for (int x = 0; x < 9; ++x)
+        {
+            const UINT luma = (p[x].rgbRed * 77 + p[x].rgbGreen * 150 + p[x].rgbBlue * 29) >> 8;
+            grey[x] = luma * p[x].rgbReserved + 255 * (255 - p[x].rgbReserved);
+        }
+        for (int x = 0; x < 8; ++x)
+            hash = (hash << 1) | (grey[x] > grey[x + 1] ? 1 : 0);
+    }
+    return hash;
+}
+
+void BkTree::Add(ULONGLONG hash, size_t id)
+{
+    if (nodes.empty())
+    {
+        nodes.push_back({ hash, id, 0, 0, 0 });
+        return;
+    }
+
+    size_t n = 0;
+    for (;;)
+    {
+        const int d = HashDistance(hash, nodes[n].hash);
+        size_t c = nodes[n].child;
+        while (c != 0 && nodes[c].edge != d)
+            c = nodes[c].sibling;
+        if (c == 0)
+        {
+            nodes.push_back({ hash, id, d, 0, nodes[n].child });
+            nodes[n].child = nodes.size() - 1;
+            return;
+        }
+        n = c;
+    }
+}
+
+std::vector<std::vector<size_t>> FindClusters(const std::vector<ULONGLONG>& hashes, int distance)
+{
+    // Identical hashes are the common case for re-saved files, they share one node
+    std::vector<size_t> order(hashes.size());
+    std::iota(order.begin(), order.end(), size_t(0));
+    std::sort(order.begin(), order.end(), [&hashes](size_t a, size_t b) { return hashes[a] < hashes[b] || (hashes[a] == hashes[b] && a < b); });
+
+    std::vector<ULONGLONG> unique;
+    std::vector<size_t> group(hashes.size());
+    for (size_t i : order)
+    {
+        if (unique.empty() || unique.back() != hashes[i])
+            unique.push_back(hashes[i]);
+        group[i] = unique.size() - 1;
+    }
+
+    BkTree tree;
+    for (size_t u = 0; u < unique.size(); ++u)
+        tree.Add(unique[u], u);
+
+    // Searches are read only and run in parallel, the links are joined after
+    std::vector<std::vector<size_t>> links(unique.size());
+    if (distance > 0)
+    {
+        ParallelFor(unique.size(), [&](size_t u)
+            {
+                tree.Find(unique[u], distance, [&links, u](size_t id, int)
+                    {
+                        if (id > u)
+                            links[u].push_back(id);
+                    });
+            });
+    }
+
+    DisjointSet sets(unique.size());
+    for (size_t u = 0; u < unique.size(); ++u)
+    {
+        for (size_t v : links[u])
+            sets.Union(u, v);
+    }
+
+    std::vector<std::vector<size_t>> clusters;
+    std::vector<size_t> cluster(unique.size(), SIZE_MAX);
+    for (size_t i = 0; i < hashes.size(); ++i)
+    {
+        const size_t root = sets.Find(group[i]);
+        if (cluster[root] == SIZE_MAX)
+        {
+            cluster[root] = clusters.size();
+            clusters.emplace_back();
+        }
+        clusters[cluster[root]].push_back(i);
+    }
+
+    clusters.erase(std::remove_if(clusters.begin(), clusters.end(), [](const std::vector<size_t>& c) { return c.size() < 2; }), clusters.end());
+    std::stable_sort(clusters.begin(), clusters.end(), [](const std::vector<size_t>& a, const std::vector<size_t>& b) { return a.size() > b.size(); });
+    return clusters;
+}
+
+size_t DedupeFiles(const std::vector<std::tstring>& files, const DedupeOptions& options, bool bIgnoreValidatePng)
+{
+    std::vector<FileHash> results(files.size());
+    ParallelFor(files.size(), [&](size_t i)
+        {
+            try
+            {
+                std::pmr::monotonic_buffer_resource arena;
+                const IconFile IconData = IconFile::Load(files[i].c_str(), bIgnoreValidatePng, &arena);
+                results[i].index = SelectEntry(IconData, options.size);
+                if (results[i].index < 0)
+                    throw Error(TEXT("No entries"));
+                results[i].hash = DHash(Decode(IconData.entry[results[i].index]));
+            }
+            catch (...)
+            {
+                results[i].error = ErrorMessage();
+            }
+        });
+
+    std::vector<ULONGLONG> hashes;
+    std::vector<size_t> loaded;
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        if (!results[i].error.empty())
+            _ftprintf(stderr, TEXT("%s: %s\n"), files[i].c_str(), results[i].error.c_str());
+        else
+        {
+            hashes.push_back(results[i].hash);
+            loaded.push_back(i);
+        }
+    }
+
+    const std::vector<std::vector<size_t>> clusters = FindClusters(hashes, options.distance);
+    for (const std::vector<size_t>& cluster : clusters)
+    {
+        const ULONGLONG first = hashes[cluster.front()];
+        for (size_t h : cluster)
+        {
+            const size_t i = loaded[h];
+            _tprintf(TEXT("%016llx %2d %s\n"), hashes[h], HashDistance(hashes[h], first), files[i].c_str());
+        }
+        _tprintf(TEXT("\n"));
+    }
+    return clusters.size();
+}
@@ -0,0 +1,82 @@
+#pragma once
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <string>
+#include <vector>
+
+#include "Bitmap.h"
+#include "IconFile.h"
+#include "Utils.h"
+
+// 64-bit difference hash: the image reduced to 9 x 8 grey levels over white, one bit per
+// horizontal neighbour pair set where the left is brighter. Stable across re-saves, formats and sizes.
+ULONGLONG DHash(const Bitmap& bitmap);
+
+// Bits that differ, counted in parallel within the word as popcnt is not on every x64 target
+inline int HashDistance(ULONGLONG a, ULONGLONG b)
+{
+    ULONGLONG x = a ^ b;
+    x -= (x >> 1) & 0x5555555555555555ull;
+    x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+    return static_cast<int>((x * 0x0101010101010101ull) >> 56);
+}
+
+// Metric tree over the Hamming distance of hashes, a search within a small distance visits only a
+// few branches of each node instead of every hash
+class BkTree
+{
+public:
+    void Add(ULONGLONG hash, size_t id);
+
+    // Calls f(id, distance) for every hash within distance of hash
+    template <class F>
+    void Find(ULONGLONG hash, int distance, F f) const
+    {
+        if (nodes.empty())
+            return;
+        std::vector<size_t> stack(1, 0);
+        while (!stack.empty())
+        {
+            const Node& n = nodes[stack.back()];
+            stack.pop_back();
+            const int d = HashDistance(hash, n.hash);
+            if (d <= distance)
+                f(n.id, d);
+            // Only children at an edge distance within the triangle inequality can hold a match
+            for (size_t c = n.child; c != 0; c = nodes[c].sibling)
+            {
+                if (nodes[c].edge >= d - distance && nodes[c].edge <= d + distance)
+                    stack.push_back(c);
+            }
+        }
+    }
+
+    size_t GetSize() const { return nodes.size(); }
+
+private:
+    struct Node
+    {
+        ULONGLONG hash;
+        size_t id;
+        int edge;           // distance to the parent
+        size_t child;       // first child, 0 for none as the root is never a child
+        size_t sibling;
+    };
+
+    std::vector<Node> nodes;
+};
+
+// Groups of indices into hashes linked by chains of hashes within distance, largest first.
+// Identical hashes are indexed once.
+std::vector<std::vector<size_t>> FindClusters(const std::vector<ULONGLONG>& hashes, int distance);
+
+struct DedupeOptions
+{
+    int size = 32;          // hash the entry nearest this width, the larger on a tie
+    int distance = 4;       // most differing hash bits still counted as a duplicate
+};
+
+// Decodes and hashes one entry of every file on all threads then prints each cluster of near-duplicates.
+// Returns the number of clusters, files that fail to load are reported and left out.
+size_t DedupeFiles(const std::vector<std::tstring>& files, const DedupeOptions& options, bool bIgnoreValidatePng);
@@ -0,0 +1,331 @@
+#include "Diff.h"
+
+#include "Parallel.h"
+#include "Png.h"
+#include <tchar.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <memory_resource>
+#if defined(_M_IX86) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+    // Transparent pixels compare as transparent black, whatever colour they hold
+    RGBQUAD Normalise(RGBQUAD c)
+    {
+        return c.rgbReserved == 0 ? RGBQUAD() : c;
+    }
+
+    int Depth(const IconFile::Entry& entry)
+    {
+        if (entry.IsPNG())
+            return 32;
+        return entry.IsInBounds() ? entry.GetBITMAPINFOHEADER()->biBitCount : entry.dir.wBitCount;
+    }
+
+    bool IsDifferent(const EntryDiff& d, int tolerance)
+    {
+        return d.indexA < 0 || d.indexB < 0 || d.stats.maxDelta > tolerance || d.stats.maskMismatches > 0;
+    }
+
+    PixelStats CompareBitmaps(const Bitmap& a, const Bitmap& b, Bitmap* pImage)
+    {
+        PixelStats stats;
+        if (a.GetWidth() != b.GetWidth() || a.GetHeight() != b.GetHeight())
+        {
+            const ULONGLONG count = static_cast<ULONGLONG>(a.GetWidth()) * a.GetHeight();
+            stats.maxDelta = 255;
+            stats.sumSq = count * 4 * 255 * 255;
+            stats.maskMismatches = count;
+            stats.channels = count * 4;
+            return stats;
+        }
+
+        for (int y = 0; y < a.GetHeight(); ++y)
+            CompareRows(a.GetRow(y), b.GetRow(y), a.GetWidth(), stats);
+
+        if (pImage != nullptr)
+        {
+            // Channel differences, mask mismatches in magenta
+            *pImage = Bitmap(a.GetWidth(), a.GetHeight());
+            for (int y = 0; y < a.GetHeight(); ++y)
+            {
+                const RGBQUAD* pA = a.GetRow(y);
+                const RGBQUAD* pB = b.GetRow(y);
+                RGBQUAD* pOut = pImage->GetRow(y);
+                for (int x = 0; x < a.GetWidth(); ++x)
+                {
+                    const RGBQUAD ca = Normalise(pA[x]);
+                    const RGBQUAD cb = Normalise(pB[x]);
+                    if ((ca.rgbReserved == 0) != (cb.rgbReserved == 0))
+                        pOut[x] = { 255, 0, 255, 255 };
+                    else
+                        pOut[x] = { static_cast<BYTE>(abs(ca.rgbBlue - cb.rgbBlue)), static_cast<BYTE>(abs(ca.rgbGreen - cb.rgbGreen)),
+                            static_cast<BYTE>(abs(ca.rgbRed - cb.rgbRed)), 255 };
+                }
+            }
+        }
+        return stats;
+    }
+
+    std::tstring FileName(const std::tstring& path)
+    {
+        const size_t slash = path.find_last_of(TEXT("\\/"));
+        return path.substr(slash == std::tstring::npos ? 0 : slash + 1);
+    }
+
+    struct FileResult
+    {
+        std::vector<EntryDiff> entries;
+        std::tstring error;
+    };
+
+    void WriteReport(LPCTSTR lpReportFile, const std::vector<DiffFile>& files, const std::vector<FileResult>& results)
+    {
+        const bool json = HasExtension(lpReportFile, TEXT(".json"));
+
+        std::string out;
+        out += json ? "[\n" : "a,b,width,height,depth,indexa,indexb,maxdelta,psnr,maskmismatches,error\n";
+        bool bFirst = true;
+        auto row = [&](const DiffFile& file, const EntryDiff* d, const std::tstring& error)
+        {
+            const double psnr = d != nullptr ? d->GetPsnr() : 0;
+            const std::string psnrtext = d == nullptr || d->indexA < 0 || d->indexB < 0 ? (json ? "null" : "")
+                : std::isinf(psnr) ? (json ? "null" : "inf") : std::to_string(psnr);
+            if (json)
+            {
+                out += bFirst ? "  { \"a\": " : ",\n  { \"a\": ";
+                AppendJsonString(out, file.a);
+                out += ", \"b\": ";
+                AppendJsonString(out, file.b);
+                if (d != nullptr)
+                {
+                    out += ", \"width\": " + std::to_string(d->width);
+                    out += ", \"height\": " + std::to_string(d->height);
+                    out += ", \"depth\": " + std::to_string(d->depth);
+                    out += ", \"indexa\": " + std::to_string(d->indexA);
+                    out += ", \"indexb\": " + std::to_string(d->indexB);
+                    out += ", \"maxdelta\": " + std::to_string(d->stats.maxDelta);
+                    out += ", \"psnr\": " + psnrtext;
+                    out += ", \"maskmismatches\": " + std::to_string(d->stats.maskMismatches);
+                }
+                else
+                {
+                    out += ", \"error\": ";
+                    AppendJsonString(out, error);
+                }
+                out += " }";
+            }
+            else
+            {
+                AppendCsvString(out, file.a);
+                out += ',';
+                AppendCsvString(out, file.b);
+                if (d != nullptr)
+                {
+                    out += ',' + std::to_string(d->width);
+                    out += ',' + std::to_string(d->height);
+                    out += ',' + std::to_string(d->depth);
+                    out += ',' + std::to_string(d->indexA);
+                    out += ',' + std::to_string(d->indexB);
+                    out += ',' + std::to_string(d->stats.maxDelta);
+                    out += ',' + psnrtext;
+                    out += ',' + std::to_string(d->stats.maskMismatches);
+                    out += ",\n";
+                }
+                else
+                {
+                    out += ",,,,,,,,,";
+                    AppendCsvString(out, error);
+                    out += '\n';
+                }
+            }
+            bFirst = false;
+        };
+
+        for (size_t i = 0; i < files.size(); ++i)
+        {
+            if (!results[i].error.empty())
+                row(files[i], nullptr, results[i].error);
+            for (const EntryDiff& d : results[i].entries)
+                row(files[i], &d, std::tstring());
+        }
+        if (json)
+            out += bFirst ? "]\n" : "\n]\n";
+
+        WriteAllBytes(lpReportFile, out.data(), out.size());
+    }
+}
+
+void CompareRows(const RGBQUAD* pA, const RGBQUAD* pB, size_t count, PixelStats& stats)
+{
+    size_t i = 0;
+    int maxDelta = stats.maxDelta;
+#if defined(_M_IX86) || defined(_M_X64)
+    // 4 pixels at a time: zero the transparent pixels, |a - b| by saturating subtracts both ways,
+    // squares summed in 32 bit lanes by madd, flushed to 64 bits before they could overflow
+    static const BYTE bitcount[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+    const __m128i zero = _mm_setzero_si128();
+    __m128i vmax = zero;
+    while (i + 4 <= count)
+    {
+        __m128i vsq = zero;
+        const size_t end = i + 4 * (std::min)((count - i) / 4, size_t(8192));
+        for (; i < end; i += 4)
+        {
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pA + i));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pB + i));
+            const __m128i ta = _mm_cmpeq_epi32(_mm_srli_epi32(a, 24), zero);
+            const __m128i tb = _mm_cmpeq_epi32(_mm_srli_epi32(b, 24), zero);
+            a = _mm_andnot_si128(ta, a);
+            b = _mm_andnot_si128(tb, b);
+            stats.maskMismatches += bitcount[_mm_movemask_ps(_mm_castsi128_ps(_mm_xor_si128(ta, tb)))];
+
+            const __m128i d = _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+            vmax = _mm_max_epu8(vmax, d);
+            const __m128i lo = _mm_unpacklo_epi8(d, zero);
+            const __m128i hi = _mm_unpackhi_epi8(d, zero);
+            vsq = _mm_add_epi32(vsq, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+        }
+        alignas(16) UINT lanes[4];
+        _mm_store_si128(reinterpret_cast<__m128i*>(lanes), vsq);
+        stats.sumSq += ULONGLONG(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+    }
+    alignas(16) BYTE m[16];
+    _mm_store_si128(reinterpret_cast<__m128i*>(m), vmax);
+    for (const BYTE v : m)
+        maxDelta = (std::max)(maxDelta, int(v));
+#endif
+    for (; i < count; ++i)
+    {
+        const RGBQUAD a = Normalise(pA[i]);
+        const RGBQUAD b = Normalise(pB[i]);
+        if ((pA[i].rgbReserved == 0) != (pB[i].rgbReserved == 0))
+            ++stats.maskMismatches;
+        const int d[4] = { a.rgbBlue - b.rgbBlue, a.rgbGreen - b.rgbGreen, a.rgbRed - b.rgbRed, a.rgbReserved - b.rgbReserved };
+        for (const int v : d)
+        {
+            maxDelta = (std::max)(maxDelta, abs(v));
+            stats.sumSq += v * v;
+        }
+    }
+    stats.maxDelta = maxDelta;
+    stats.channels += count * 4;
+}
+
+double EntryDiff::GetPsnr() const
+{
+    if (stats.sumSq == 0)
+        return std::numeric_limits<double>::infinity();
+    return 10.0 * log10(255.0 * 255.0 * stats.channels / stats.sumSq);
+}
+
+std::vector<EntryDiff> DiffIcons(const IconFile& a, const IconFile& b, std::vector<Bitmap>* pImages)
+{
+    std::vector<EntryDiff> diffs;
+    std::vector<bool> matched(b.entry.size(), false);
+
+    for (size_t i = 0; i < a.entry.size(); ++i)
+    {
+        const IconFile::Entry& ea = a.entry[i];
+        EntryDiff d = { ea.GetWidth(), ea.GetHeight(), Depth(ea), static_cast<int>(i), -1 };
+        for (size_t j = 0; j < b.entry.size(); ++j)
+        {
+            const IconFile::Entry& eb = b.entry[j];
+            if (!matched[j] && eb.GetWidth() == d.width && eb.GetHeight() == d.height && Depth(eb) == d.depth)
+            {
+                matched[j] = true;
+                d.indexB = static_cast<int>(j);
+                break;
+            }
+        }
+
+        Bitmap image;
+        if (d.indexB >= 0)
+            d.stats = CompareBitmaps(Decode(ea), Decode(b.entry[d.indexB]), pImages != nullptr ? &image : nullptr);
+        diffs.push_back(d);
+        if (pImages != nullptr)
+            pImages->push_back(std::move(image));
+    }
+
+    for (size_t j = 0; j < b.entry.size(); ++j)
+    {
+        if (!matched[j])
+        {
+            const IconFile::Entry& eb = b.entry[j];
+            diffs.push_back({ eb.GetWidth(), eb.GetHeight(), Depth(eb), -1, static_cast<int>(j) });
+            if (pImages != nullptr)
+                pImages->emplace_back();
+        }
+    }
+    return diffs;
+}
+
+size_t DiffFiles(const std::vector<DiffFile>& files, LPCTSTR lpReportFile, const DiffOptions& options, bool bIgnoreValidatePng)
+{
+    std::vector<FileResult> results(files.size());
+    ParallelFor(files.size(), [&](size_t i)
+        {
+            try
+            {
+                std::pmr::monotonic_buffer_resource arena;
+                const IconFile a = IconFile::Load(files[i].a.c_str(), bIgnoreValidatePng, &arena);
+                const IconFile b = IconFile::Load(files[i].b.c_str(), bIgnoreValidatePng, &arena);
+
+                std::vector<Bitmap> images;
+                results[i].entries = DiffIcons(a, b, options.lpImageDir != nullptr ? &images : nullptr);
+
+                if (options.lpImageDir != nullptr)
+                {
+                    for (size_t e = 0; e < images.size(); ++e)
+                    {
+                        const EntryDiff& d = results[i].entries[e];
+                        if (images[e].GetWidth() == 0 || !IsDifferent(d, options.tolerance))
+                            continue;
+                        TCHAR suffix[64];
+                        _stprintf_s(suffix, ARRAYSIZE(suffix), TEXT("_%d_%dx%dx%d.png"), d.indexA, d.width, d.height, d.depth);
+                        const std::tstring out = std::tstring(options.lpImageDir) + TEXT('\\') + FileName(files[i].a) + suffix;
+                        const std::vector<BYTE> png = EncodePng(images[e], 1);
+                        WriteAllBytes(out.c_str(), png.data(), png.size());
+                    }
+                }
+            }
+            catch (...)
+            {
+                results[i].error = ErrorMessage();
+            }
+        });
+
+    size_t different = 0;
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        const FileResult& r = results[i];
+        bool bDifferent = !r.error.empty();
+        if (bDifferent)
+            _ftprintf(stderr, TEXT("%s: %s\n"), files[i].a.c_str(), r.error.c_str());
+
+        for (const EntryDiff& d : r.entries)
+        {
+            if (!IsDifferent(d, options.tolerance))
+                continue;
+            bDifferent = true;
+            if (d.indexB < 0)
+                _tprintf(TEXT("%s: %d x %d x %d only in a\n"), files[i].a.c_str(), d.width, d.height, d.depth);
+            else if (d.indexA < 0)
+                _tprintf(TEXT("%s: %d x %d x %d only in b\n"), files[i].a.c_str(), d.width, d.height, d.depth);
+            else
+                _tprintf(TEXT("%s: %d x %d x %d max delta %d psnr %.2f mask mismatches %llu\n"), files[i].a.c_str(), d.width, d.height, d.depth,
+                    d.stats.maxDelta, d.GetPsnr(), d.stats.maskMismatches);
+        }
+        if (bDifferent)
+            ++different;
+    }
+
+    if (lpReportFile != nullptr)
+        WriteReport(lpReportFile, files, results);
+    return different;
+}
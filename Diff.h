@@ -0,0 +1,54 @@
+#pragma once
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <string>
+#include <vector>
+
+#include "Bitmap.h"
+#include "IconFile.h"
+#include "Utils.h"
+
+// Totals over two equally sized rows of pixels, pixels with alpha 0 compare as transparent black
+struct PixelStats
+{
+    int maxDelta = 0;               // largest difference of any channel
+    ULONGLONG sumSq = 0;            // sum of squared channel differences
+    ULONGLONG maskMismatches = 0;   // transparent on one side only
+    ULONGLONG channels = 0;
+};
+
+void CompareRows(const RGBQUAD* pA, const RGBQUAD* pB, size_t count, PixelStats& stats);
+
+// Entries pair up by width, height and bit depth, in order where a file has several alike.
+// index is -1 on the side missing the entry.
+struct EntryDiff
+{
+    int width;
+    int height;
+    int depth;
+    int indexA;
+    int indexB;
+    PixelStats stats;
+
+    // Infinite when identical
+    double GetPsnr() const;
+};
+
+// pImages, if given, gets an image of the differences for each result, empty where there is nothing to show
+std::vector<EntryDiff> DiffIcons(const IconFile& a, const IconFile& b, std::vector<Bitmap>* pImages = nullptr);
+
+struct DiffOptions
+{
+    int tolerance = 0;              // largest channel difference still counted as the same
+    LPCTSTR lpImageDir = nullptr;   // or where to write a png of each differing entry
+};
+
+struct DiffFile
+{
+    std::tstring a;
+    std::tstring b;
+};
+
+// Decodes and compares every pair on all threads, writes a report (.json or .csv, or nullptr for none) and
+// prints the differing entries. Returns the number of pairs that differ or failed to load.
+size_t DiffFiles(const std::vector<DiffFile>& files, LPCTSTR lpReportFile, const DiffOptions& options, bool bIgnoreValidatePng);
@@ -0,0 +1,202 @@
+#include "Generate.h"
+
+#include "PeFile.h"
+#include "Png.h"
+#include "Utils.h"
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+    DWORD Align(DWORD v, DWORD a)
+    {
+        return (v + a - 1) / a * a;
+    }
+
+    // Fraction of the pixel inside the shape from a 4 x 4 grid of samples, 0 to 16
+    int Coverage(bool bEllipse, double left, double top, double right, double bottom, int x, int y)
+    {
+        const double cx = (left + right) / 2;
+        const double cy = (top + bottom) / 2;
+        const double rx = (right - left) / 2;
+        const double ry = (bottom - top) / 2;
+        int inside = 0;
+        for (int sy = 0; sy < 4; ++sy)
+        {
+            for (int sx = 0; sx < 4; ++sx)
+            {
+                const double px = x + (sx + 0.5) / 4;
+                const double py = y + (sy + 0.5) / 4;
+                if (bEllipse)
+                {
+                    const double dx = (px - cx) / rx;
+                    const double dy = (py - cy) / ry;
+                    inside += dx * dx + dy * dy <= 1 ? 1 : 0;
+                }
+                else
+                    inside += px >= left && px < right && py >= top && py < bottom ? 1 : 0;
+            }
+        }
+        return inside;
+    }
+}
+
+RGBQUAD IconGenerator::Colour()
+{
+    const DWORD v = rng();
+    return { BYTE(v), BYTE(v >> 8), BYTE(v >> 16), 255 };
+}
+
+// Shapes are painted in order with straight alpha source over
+Bitmap IconGenerator::Draw(const std::vector<Shape>& shapes, LONG width, LONG height)
+{
+    Bitmap bitmap(width, height);
+    for (const Shape& s : shapes)
+    {
+        const double left = s.left * width;
+        const double top = s.top * height;
+        const double right = s.right * width;
+        const double bottom = s.bottom * height;
+        const int y0 = (std::max)(0, static_cast<int>(top));
+        const int y1 = (std::min)(static_cast<int>(height), static_cast<int>(std::ceil(bottom)));
+        const int x0 = (std::max)(0, static_cast<int>(left));
+        const int x1 = (std::min)(static_cast<int>(width), static_cast<int>(std::ceil(right)));
+        for (int y = y0; y < y1; ++y)
+        {
+            const double t = bottom > top ? (y + 0.5 - top) / (bottom - top) : 0;
+            const double r = s.from.rgbRed + (s.to.rgbRed - s.from.rgbRed) * t;
+            const double g = s.from.rgbGreen + (s.to.rgbGreen - s.from.rgbGreen) * t;
+            const double b = s.from.rgbBlue + (s.to.rgbBlue - s.from.rgbBlue) * t;
+            RGBQUAD* pRow = bitmap.GetRow(y);
+            for (int x = x0; x < x1; ++x)
+            {
+                const int coverage = Coverage(s.bEllipse, left, top, right, bottom, x, y);
+                if (coverage == 0)
+                    continue;
+                RGBQUAD& d = pRow[x];
+                const double sa = s.from.rgbReserved / 255.0 * coverage / 16;
+                const double da = d.rgbReserved / 255.0 * (1 - sa);
+                const double a = sa + da;
+                d.rgbRed = static_cast<BYTE>(std::lround((r * sa + d.rgbRed * da) / a));
+                d.rgbGreen = static_cast<BYTE>(std::lround((g * sa + d.rgbGreen * da) / a));
+                d.rgbBlue = static_cast<BYTE>(std::lround((b * sa + d.rgbBlue * da) / a));
+                d.rgbReserved = static_cast<BYTE>(std::lround(a * 255));
+            }
+        }
+    }
+    return bitmap;
+}
+
+IconFile IconGenerator::GenerateIcon(const GenerateOptions& options, std::pmr::memory_resource* mr)
+{
+    // A background shape filling most of the icon and a few smaller ones over it, some translucent
+    std::vector<Shape> shapes(Range(2, 4));
+    for (size_t i = 0; i < shapes.size(); ++i)
+    {
+        Shape& s = shapes[i];
+        s.bEllipse = Range(0, 1) == 1;
+        if (i == 0)
+        {
+            s.left = 0.02 + Unit() * 0.1;
+            s.top = 0.02 + Unit() * 0.1;
+            s.right = 0.98 - Unit() * 0.1;
+            s.bottom = 0.98 - Unit() * 0.1;
+        }
+        else
+        {
+            const double w = 0.2 + Unit() * 0.4;
+            const double h = 0.2 + Unit() * 0.4;
+            s.left = 0.1 + Unit() * (0.8 - w);
+            s.top = 0.1 + Unit() * (0.8 - h);
+            s.right = s.left + w;
+            s.bottom = s.top + h;
+        }
+        s.from = Colour();
+        s.to = Colour();
+        if (i > 0 && Range(0, 3) == 0)
+            s.from.rgbReserved = 160;
+    }
+
+    IconFile IconData(mr);
+    IconData.Header.idType = static_cast<WORD>(options.type);
+    for (const int size : options.sizes)
+    {
+        const Bitmap bitmap = Draw(shapes, size, size);
+        for (const int depth : options.depths)
+        {
+            IconFile::Entry entry(IconData.entry.get_allocator());
+            if (depth == 32 && options.pngsize > 0 && size >= options.pngsize)
+            {
+                const std::vector<BYTE> png = EncodePng(bitmap);
+                entry.dir.bWidth = static_cast<BYTE>(size);    // 256 wraps to 0
+                entry.dir.bHeight = static_cast<BYTE>(size);
+                entry.dir.wPlanes = 1;
+                entry.dir.wBitCount = 32;
+                entry.SetDataSize(static_cast<DWORD>(png.size()));
+                memcpy(entry.GetData(), png.data(), png.size());
+            }
+            else
+                entry = EncodeEntry(bitmap, static_cast<WORD>(depth), IconData.entry.get_allocator());
+
+            if (options.type == TYPE_CURSOR)
+                entry.SetHotspot(static_cast<WORD>(size / 2), static_cast<WORD>(size / 2));
+            IconData.entry.push_back(std::move(entry));
+        }
+    }
+    IconData.UpdateOffsets();
+    return IconData;
+}
+
+std::vector<BYTE> IconGenerator::GenerateModule(const GenerateOptions& options, int groups)
+{
+    // Headers in the first file block and an empty .rsrc after them, PeFile lays out the resources
+    const DWORD dwFileAlignment = 0x200;
+    const DWORD dwSectionAlignment = 0x1000;
+    const DWORD dwRsrcRva = dwSectionAlignment;
+    const std::vector<BYTE> rsrc = BuildResourceSection(ResourceTree(), dwRsrcRva);
+    const DWORD dwRawSize = Align(static_cast<DWORD>(rsrc.size()), dwFileAlignment);
+
+    std::vector<BYTE> file(dwFileAlignment + dwRawSize, 0);
+    IMAGE_DOS_HEADER* pDosHeader = reinterpret_cast<IMAGE_DOS_HEADER*>(file.data());
+    pDosHeader->e_magic = IMAGE_DOS_SIGNATURE;
+    pDosHeader->e_lfanew = sizeof(IMAGE_DOS_HEADER);
+
+    IMAGE_NT_HEADERS64* pNtHeaders = reinterpret_cast<IMAGE_NT_HEADERS64*>(file.data() + pDosHeader->e_lfanew);
+    pNtHeaders->Signature = IMAGE_NT_SIGNATURE;
+    pNtHeaders->FileHeader.Machine = IMAGE_FILE_MACHINE_AMD64;
+    pNtHeaders->FileHeader.NumberOfSections = 1;
+    pNtHeaders->FileHeader.SizeOfOptionalHeader = sizeof(IMAGE_OPTIONAL_HEADER64);
+    pNtHeaders->FileHeader.Characteristics = IMAGE_FILE_EXECUTABLE_IMAGE | IMAGE_FILE_DLL;
+
+    IMAGE_OPTIONAL_HEADER64& optional = pNtHeaders->OptionalHeader;
+    optional.Magic = IMAGE_NT_OPTIONAL_HDR64_MAGIC;
+    optional.SizeOfInitializedData = dwRawSize;
+    optional.ImageBase = 0x180000000;
+    optional.SectionAlignment = dwSectionAlignment;
+    optional.FileAlignment = dwFileAlignment;
+    optional.MajorOperatingSystemVersion = 6;
+    optional.MajorSubsystemVersion = 6;
+    optional.SizeOfImage = dwRsrcRva + Align(static_cast<DWORD>(rsrc.size()), dwSectionAlignment);
+    optional.SizeOfHeaders = dwFileAlignment;
+    optional.Subsystem = IMAGE_SUBSYSTEM_WINDOWS_GUI;
+    optional.NumberOfRvaAndSizes = IMAGE_NUMBEROF_DIRECTORY_ENTRIES;
+    optional.DataDirectory[IMAGE_DIRECTORY_ENTRY_RESOURCE].VirtualAddress = dwRsrcRva;
+    optional.DataDirectory[IMAGE_DIRECTORY_ENTRY_RESOURCE].Size = static_cast<DWORD>(rsrc.size());
+
+    IMAGE_SECTION_HEADER* pSection = reinterpret_cast<IMAGE_SECTION_HEADER*>(pNtHeaders + 1);
+    memcpy(pSection->Name, ".rsrc\0\0", IMAGE_SIZEOF_SHORT_NAME);
+    pSection->Misc.VirtualSize = static_cast<DWORD>(rsrc.size());
+    pSection->VirtualAddress = dwRsrcRva;
+    pSection->SizeOfRawData = dwRawSize;
+    pSection->PointerToRawData = dwFileAlignment;
+    pSection->Characteristics = IMAGE_SCN_CNT_INITIALIZED_DATA | IMAGE_SCN_MEM_READ;
+    std::copy(rsrc.begin(), rsrc.end(), file.begin() + dwFileAlignment);
+
+    // Group resources are icons only
+    GenerateOptions icon = options;
+    icon.type = TYPE_ICON;
+    PeFile pe = PeFile::FromMemory(std::move(file));
+    for (int g = 0; g < groups; ++g)
+        pe.ReplaceIconGroup(ResourceId(static_cast<WORD>(g + 1)), MAKELANGID(LANG_NEUTRAL, SUBLANG_NEUTRAL), GenerateIcon(icon));
+    return pe.SaveToMemory();
+}
@@ -0,0 +1,52 @@
+#pragma once
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <random>
+#include <vector>
+
+#include "Bitmap.h"
+#include "IconFile.h"
+
+struct GenerateOptions
+{
+    std::vector<int> sizes = { 16, 24, 32, 48, 256 };
+    std::vector<int> depths = { 4, 8, 32 };     // 1, 4, 8, 16, 24 or 32, one entry per size and depth
+    int pngsize = 256;                          // 32-bit entries this size and up are PNG, 0 for none
+    IconType type = TYPE_ICON;
+};
+
+// Deterministic source of test icons. Only the raw mt19937 output is used, its sequence is fixed by the
+// standard where the distributions are not, so a seed gives the same bytes with every compiler.
+// It still builds only on Windows, it needs windows.h and links Bitmap.cpp which uses GDI+.
+class IconGenerator
+{
+public:
+    explicit IconGenerator(DWORD seed)
+        : rng(seed)
+    {
+    }
+
+    // One icon design drawn at each size and depth, a few shapes with a gradient and antialiased edges.
+    // Entries under 32 bits keep their alpha as the AND mask only.
+    IconFile GenerateIcon(const GenerateOptions& options, std::pmr::memory_resource* mr = std::pmr::get_default_resource());
+
+    // A PE32+ dll holding just a .rsrc section with groups RT_GROUP_ICON resources numbered from 1,
+    // laid out by PeFile so it loads like any other module
+    std::vector<BYTE> GenerateModule(const GenerateOptions& options, int groups);
+
+private:
+    struct Shape
+    {
+        bool bEllipse;
+        double left, top, right, bottom;   // 0 to 1 of the icon size
+        RGBQUAD from, to;                   // vertical gradient
+    };
+
+    int Range(int lo, int hi) { return lo + static_cast<int>(rng() % static_cast<DWORD>(hi - lo + 1)); }
+    double Unit() { return rng() / 4294967296.0; }
+    RGBQUAD Colour();
+
+    static Bitmap Draw(const std::vector<Shape>& shapes, LONG width, LONG height);
+
+    std::mt19937 rng;
+};
@@ -0,0 +1,204 @@
+#include "IcoLib.h"
+
+#include "IconFile.h"
+#include "IconOps.h"
+#include "Utils.h"
+#include <cstdlib>
+#include <memory_resource>
+#include <new>
+#include <string>
+
+namespace
+{
+    thread_local std::string g_error;
+
+    struct InvalidIcon
+    {
+        std::tstring msg;
+    };
+
+    RGBQUAD ToRGBQUAD(unsigned long c)
+    {
+        const RGBQUAD r = {
+            BYTE(c >> 0),
+            BYTE(c >> 8),
+            BYTE(c >> 16),
+            BYTE(c >> 24),
+        };
+        return r;
+    }
+
+    IconFile Parse(const unsigned char* data, size_t size, unsigned int flags, std::pmr::memory_resource* mr)
+    {
+        try
+        {
+            return IconFile::FromMemory(data, size, (flags & ICO_FLAG_IGNORE_VALIDATE_PNG) != 0, mr);
+        }
+        catch (const Error& e)
+        {
+            throw InvalidIcon{ e.GetMsg() };
+        }
+    }
+
+    void Output(const IconFile& IconData, unsigned int flags, unsigned char** out, size_t* outsize)
+    {
+        const std::vector<BYTE> bytes = IconData.SaveToMemory((flags & ICO_FLAG_IGNORE_VALIDATE_PNG) != 0);
+        unsigned char* p = static_cast<unsigned char*>(malloc(bytes.size()));
+        if (p == nullptr)
+            throw std::bad_alloc();
+        memcpy(p, bytes.data(), bytes.size());
+        *out = p;
+        *outsize = bytes.size();
+    }
+
+    // Exceptions never cross the C boundary, they become a result code and a message
+    template <class F>
+    ico_result Call(F f)
+    {
+        g_error.clear();
+        try
+        {
+            return f();
+        }
+        catch (const InvalidIcon& e)
+        {
+            g_error = ToUtf8(e.msg);
+            return ICO_E_INVALIDICON;
+        }
+        catch (const std::bad_alloc&)
+        {
+            g_error = "Out of memory";
+            return ICO_E_OUTOFMEMORY;
+        }
+        catch (const WinError& e)
+        {
+            g_error = "Win32 error " + std::to_string(e.GetError());
+            return ICO_E_WIN32;
+        }
+        catch (const Error& e)
+        {
+            g_error = ToUtf8(e.GetMsg());
+            return ICO_E_FAIL;
+        }
+        catch (...)
+        {
+            g_error = "Unknown error";
+            return ICO_E_FAIL;
+        }
+    }
+}
+
+unsigned int ICO_CALL ico_version(void)
+{
+    return ICO_VERSION;
+}
+
+const char* ICO_CALL ico_last_error(void)
+{
+    return g_error.c_str();
+}
+
+void ICO_CALL ico_free(unsigned char* data)
+{
+    free(data);
+}
+
+ico_result ICO_CALL ico_list(const unsigned char* data, size_t size, unsigned int flags, ico_entry_info* entries, size_t* count)
+{
+    if (data == nullptr || count == nullptr || (entries == nullptr && *count != 0))
+        return ICO_E_INVALIDARG;
+
+    return Call([=]()
+        {
+            std::pmr::monotonic_buffer_resource arena;
+            const IconFile IconData = Parse(data, size, flags, &arena);
+
+            const size_t capacity = *count;
+            for (size_t i = 0; i < IconData.entry.size() && i < capacity; ++i)
+            {
+                const IconFile::Entry& entry = IconData.entry[i];
+                entries[i].width = entry.GetWidth();
+                entries[i].height = entry.GetHeight();
+                entries[i].bitcount = entry.dir.wBitCount;
+                entries[i].is_png = entry.IsPNG();
+                entries[i].size = entry.GetDataSize();
+            }
+            *count = IconData.entry.size();
+            return ICO_OK;
+        });
+}
+
+ico_result ICO_CALL ico_alphablend(const unsigned char* dest, size_t destsize, const unsigned char* src, size_t srcsize, unsigned int flags,
+    unsigned char** out, size_t* outsize)
+{
+    if (dest == nullptr || src == nullptr || out == nullptr || outsize == nullptr)
+        return ICO_E_INVALIDARG;
+
+    return Call([=]()
+        {
+            std::pmr::monotonic_buffer_resource arena;
+            IconFile IconData = Parse(dest, destsize, flags, &arena);
+            const IconFile IconDataSrc = Parse(src, srcsize, flags, &arena);
+            AlphaBlendImages(IconData, IconDataSrc);
+            Output(IconData, flags, out, outsize);
+            return ICO_OK;
+        });
+}
+
+ico_result ICO_CALL ico_grayscale_to_alpha(const unsigned char* data, size_t size, unsigned int flags,
+    unsigned char** out, size_t* outsize)
+{
+    if (data == nullptr || out == nullptr || outsize == nullptr)
+        return ICO_E_INVALIDARG;
+
+    return Call([=]()
+        {
+            std::pmr::monotonic_buffer_resource arena;
+            IconFile IconData = Parse(data, size, flags, &arena);
+            GrayscaleToAlpha(IconData);
+            Output(IconData, flags, out, outsize);
+            return ICO_OK;
+        });
+}
+
+ico_result ICO_CALL ico_recolor(const unsigned char* data, size_t size, unsigned int flags, int index, unsigned long srccolor, unsigned long dstcolor,
+    unsigned char** out, size_t* outsize)
+{
+    if (data == nullptr || out == nullptr || outsize == nullptr)
+        return ICO_E_INVALIDARG;
+
+    return Call([=]()
+        {
+            std::pmr::monotonic_buffer_resource arena;
+            IconFile IconData = Parse(data, size, flags, &arena);
+            if (index < 0 || index >= IconData.entry.size())
+                return ICO_E_INVALIDARG;
+
+            IconFile::Entry& entry = IconData.entry[index];
+            if (entry.IsPNG())
+                throw Error(TEXT("PNG not supported"));
+
+            Recolor(entry, ToRGBQUAD(srccolor), ToRGBQUAD(dstcolor));
+            Output(IconData, flags, out, outsize);
+            return ICO_OK;
+        });
+}
+
+ico_result ICO_CALL ico_resize(const unsigned char* data, size_t size, unsigned int flags, const int* sizes, size_t count,
+    unsigned char** out, size_t* outsize)
+{
+    if (data == nullptr || sizes == nullptr || count == 0 || out == nullptr || outsize == nullptr)
+        return ICO_E_INVALIDARG;
+    for (size_t i = 0; i < count; ++i)
+        if (sizes[i] < 1 || sizes[i] > 256)
+            return ICO_E_INVALIDARG;
+
+    return Call([=]()
+        {
+            std::pmr::monotonic_buffer_resource arena;
+            IconFile IconData = Parse(data, size, flags, &arena);
+            ResizeImages(IconData, std::vector<int>(sizes, sizes + count));
+            Output(IconData, flags, out, outsize);
+            return ICO_OK;
+        });
+}
@@ -0,0 +1,62 @@
+#pragma once
+#include <stddef.h>
+
+// C interface to the icon engine.
+// Icons go in and come out as the bytes of an .ico/.cur file, every call is independent and thread safe.
+// Output buffers are allocated by the library and released with ico_free.
+
+#ifndef ICO_API
+#define ICO_API
+#endif
+#define ICO_CALL __cdecl
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum ico_result
+{
+    ICO_OK = 0,
+    ICO_E_INVALIDARG = 1,
+    ICO_E_INVALIDICON = 2,  // could not be parsed or failed validation
+    ICO_E_OUTOFMEMORY = 3,
+    ICO_E_WIN32 = 4,        // see ico_last_error
+    ICO_E_FAIL = 5,         // see ico_last_error
+} ico_result;
+
+#define ICO_FLAG_IGNORE_VALIDATE_PNG 0x0001
+
+typedef struct ico_entry_info
+{
+    int width;
+    int height;
+    int bitcount;           // cursors store the hotspot y here
+    int is_png;
+    unsigned long size;
+} ico_entry_info;
+
+// Version of this interface, bumped when a function is added
+#define ICO_VERSION 1
+ICO_API unsigned int ICO_CALL ico_version(void);
+
+// UTF-8 message for the last failed call on this thread
+ICO_API const char* ICO_CALL ico_last_error(void);
+
+ICO_API void ICO_CALL ico_free(unsigned char* data);
+
+// On input *count is the capacity of entries, on output the number of entries in the icon
+ICO_API ico_result ICO_CALL ico_list(const unsigned char* data, size_t size, unsigned int flags, ico_entry_info* entries, size_t* count);
+
+ICO_API ico_result ICO_CALL ico_alphablend(const unsigned char* dest, size_t destsize, const unsigned char* src, size_t srcsize, unsigned int flags,
+    unsigned char** out, size_t* outsize);
+ICO_API ico_result ICO_CALL ico_grayscale_to_alpha(const unsigned char* data, size_t size, unsigned int flags,
+    unsigned char** out, size_t* outsize);
+// Colours are 0xAARRGGBB, the alpha of srccolor and dstcolor is ignored
+ICO_API ico_result ICO_CALL ico_recolor(const unsigned char* data, size_t size, unsigned int flags, int index, unsigned long srccolor, unsigned long dstcolor,
+    unsigned char** out, size_t* outsize);
+ICO_API ico_result ICO_CALL ico_resize(const unsigned char* data, size_t size, unsigned int flags, const int* sizes, size_t count,
+    unsigned char** out, size_t* outsize);
+
+#ifdef __cplusplus
+}
+#endif
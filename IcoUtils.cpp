@@ -3,11 +3,28 @@
 #include <cstdio>
 //#include <cmath>
 #include <tchar.h>
+#include <memory_resource>
 //#include <strsafe.h>
 //#include <crtdbg.h>
 
 #include "IconFile.h"
 #include "IconImage.h"
+#include "IconOps.h"
+#include "Terminal.h"
+#include "Atlas.h"
+#include "AniFile.h"
+#include "Bitmap.h"
+#include "Dedupe.h"
+#include "Diff.h"
+#include "Generate.h"
+#include "IconCache.h"
+#include "Job.h"
+#include "Parallel.h"
+#include "PeFile.h"
+#include "Pipeline.h"
+#include "Png.h"
+#include "Raw.h"
+#include "ResourceIndex.h"
 #include "Utils.h"
 #include "arg.h"
 
@@ -37,142 +54,165 @@ void IconList(const IconFile& IconData)
 
 void PrintImage(const IconFile::Entry& entry)
 {
-    IconImage i(entry);
-    for (int y = 0; y < i.GetHeight(); ++y)
+    TerminalSheet sheet;
+    sheet.Add(IconImage(entry));
+    sheet.Flush();
+}
+
+bool IsAni(LPCTSTR filename)
+{
+    const size_t len = _tcslen(filename);
+    return len >= 4 && _tcsicmp(filename + len - 4, TEXT(".ani")) == 0;
+}
+
+void ListResourceName(const ResourceId& name, const std::vector<LANGID>& langs)
+{
+    if (name.IsName())
+        _tprintf(TEXT("%s"), name.GetName().c_str());
+    else
+        _tprintf(TEXT("%u"), name.GetId());
+    for (const LANGID lang : langs)
+        _tprintf(TEXT(" 0x%04x"), lang);
+    _tprintf(TEXT("\n"));
+}
+
+void FindFiles(LPCTSTR pattern, std::vector<std::tstring>& files)
+{
+    if (_tcspbrk(pattern, TEXT("*?")) == nullptr)
     {
-        for (int x = 0; x < i.GetWidth(); ++x)
-        {
-            const RGBQUAD c = i.GetColour(x, y);
-            if (c.rgbReserved == 0)
-                _tprintf(TEXT("\x1b[0m"));
-            else
-                _tprintf(TEXT("\x1b[38;2;%d;%d;%dm"), c.rgbRed, c.rgbGreen, c.rgbBlue);
-            _tprintf(TEXT("\x1b[48;2;%d;%d;%dm"), 128, 128, 128);
-            _tprintf(c.rgbReserved == 0 ? TEXT(" ") : TEXT("X"));
-        }
-        _tprintf(TEXT("\x1b[0m|\n"));
+        files.push_back(pattern);
+        return;
     }
-    _tprintf(TEXT("\x1b[0m\n"));
+
+    LPCTSTR name = _tcsrchr(pattern, TEXT('\\'));
+    const std::tstring dir(pattern, name == nullptr ? 0 : name - pattern + 1);
+
+    WIN32_FIND_DATA fd;
+    const HANDLE hFind = FindFirstFile(pattern, &fd);
+    if (hFind == INVALID_HANDLE_VALUE)
+        return;
+    do
+    {
+        if (!(fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+            files.push_back(dir + fd.cFileName);
+    } while (FindNextFile(hFind, &fd));
+    FindClose(hFind);
 }
 
-auto FindImage(const IconFile& IconData, BYTE bWidth, BYTE bHeight, WORD wBitCount)
+bool ParseIconIndex(LPTSTR arg, int* index)
 {
-    for (auto it = IconData.entry.begin(); it != IconData.entry.end(); ++it)
+    LPTSTR x;
+    if ((x = _tcsstr(arg, TEXT(".exe,"))) || (x = _tcsstr(arg, TEXT(".dll,"))))
     {
-        if (it->dir.bWidth == bWidth && it->dir.bWidth == bHeight && it->dir.wBitCount == wBitCount)
-            return it;
+        x += 4;
+        *index = _tstoi(x + 1);
+        *x = TEXT('\0');
+        return true;
     }
-    return IconData.entry.end();
+    else
+        return false;
 }
 
-RGBQUAD AlphaBlend(const RGBQUAD fg, const RGBQUAD bg)
+IconFile LoadIconArg(LPCTSTR icofilearg, LANGID lang, const IconFile::EntryFilter& filter, bool bIgnoreValidatePng, std::pmr::memory_resource* mr)
 {
-    RGBQUAD r;
-    r.rgbBlue = fg.rgbReserved * fg.rgbBlue / 255 + (255 - fg.rgbReserved) * bg.rgbBlue / 255;
-    r.rgbGreen = fg.rgbReserved * fg.rgbGreen / 255 + (255 - fg.rgbReserved) * bg.rgbGreen / 255;
-    r.rgbRed = fg.rgbReserved * fg.rgbRed / 255 + (255 - fg.rgbReserved) * bg.rgbRed / 255;
-    r.rgbReserved = fg.rgbReserved + (255 - fg.rgbReserved) * bg.rgbReserved / 255;
-    return r;
+    WCHAR icofile[MAX_PATH];
+    ExpandEnvironmentStrings(icofilearg, icofile, ARRAYSIZE(icofile));
+
+    int index = 0;
+    return ParseIconIndex(icofile, &index)
+        ? IconFile::FromResource(icofile, index, lang, filter, bIgnoreValidatePng, mr)
+        : IconFile::Load(icofile, filter, bIgnoreValidatePng, mr);
 }
 
-void AlphaBlendImages(IconFile& IconDataDest, const IconFile& IconDataSrc)
+IconFile LoadIconArg(LPCTSTR icofilearg, LANGID lang, bool bIgnoreValidatePng, std::pmr::memory_resource* mr)
 {
-    for (IconFile::Entry& entry : IconDataDest.entry)
-    {
-        if (!entry.IsPNG())
-        {
-            const auto s = FindImage(IconDataSrc, entry.dir.bWidth, entry.dir.bWidth, entry.dir.wBitCount);
-            if (s != IconDataSrc.entry.end())
-            {
-                const IconImage src(*s);
-                IconImage dest(entry);
-                for (int y = 0; y < dest.GetHeight(); ++y)
-                {
-                    for (int x = 0; x < dest.GetWidth(); ++x)
-                    {
-                        const RGBQUAD c = src.GetColour(x, y);
-                        if (c.rgbReserved != 0)
-                        {
-                            const RGBQUAD r = AlphaBlend(c, dest.GetColour(x, y));
-                            dest.PutColour(x, y, r);
-                        }
-                    }
-                }
-            }
-        }
-    }
+    return LoadIconArg(icofilearg, lang, IconFile::EntryFilter(), bIgnoreValidatePng, mr);
 }
 
-void GrayscaleToAlpha(IconFile& IconData)
+// Loads just entry iconum, as entry 0
+IconFile LoadIconEntryArg(LPCTSTR icofilearg, int iconum, LANGID lang, bool bIgnoreValidatePng, std::pmr::memory_resource* mr)
 {
-    for (IconFile::Entry& entry : IconData.entry)
+    return LoadIconArg(icofilearg, lang, [iconum](int i, const ICONDIR&) { return i == iconum; }, bIgnoreValidatePng, mr);
+}
+
+// A whole non-negative decimal number, so a typo isn't read as entry 0
+bool ParseIndex(LPCTSTR str, size_t* index)
+{
+    LPTSTR end;
+    const long i = _tcstol(str, &end, 10);
+    if (end == str || *end != TEXT('\0') || i < 0)
+        return false;
+    *index = i;
+    return true;
+}
+
+// Comma separated numbers, eg 16,32,48
+std::vector<int> ParseList(LPCTSTR str)
+{
+    std::vector<int> list;
+    for (LPCTSTR s = str; *s != TEXT('\0'); )
     {
-        if (!entry.IsPNG())
-        {
-            IconImage dest(entry);
-            for (int y = 0; y < dest.GetHeight(); ++y)
-            {
-                for (int x = 0; x < dest.GetWidth(); ++x)
-                {
-                    RGBQUAD c = dest.GetColour(x, y);
-                    if (c.rgbRed != c.rgbGreen || c.rgbRed != c.rgbBlue) throw Error(TEXT("Not grayscale"));
-                    c.rgbReserved = 255 - c.rgbRed;
-                    c.rgbRed = 0;
-                    c.rgbGreen = 0;
-                    c.rgbBlue = 0;
-                    dest.PutColour(x, y, c);
-                }
-            }
-        }
+        list.push_back(_tstoi(s));
+        s = _tcschr(s, TEXT(','));
+        if (s == nullptr)
+            break;
+        ++s;
     }
+    return list;
 }
 
-void Recolor(IconFile::Entry& entry, int iconum, const RGBQUAD srccolor, const RGBQUAD dstcolor)
+// /threads=n, every hardware thread when it isn't given, 0 when n is out of range
+unsigned int ParseThreads()
 {
-    IconImage dest(entry);
-    for (int y = 0; y < dest.GetHeight(); ++y)
-    {
-        for (int x = 0; x < dest.GetWidth(); ++x)
-        {
-            RGBQUAD c = dest.GetColour(x, y);
+    LPCTSTR threadsarg = argvalue(TEXT("/threads"));
+    if (threadsarg == nullptr)
+        return GetThreadCount();
+    const int nThreads = _tstoi(threadsarg);
+    return nThreads >= 1 && nThreads <= 1024 ? static_cast<unsigned int>(nThreads) : 0;
+}
 
-            if (c.rgbReserved != 0 && c.rgbRed == srccolor.rgbRed && c.rgbGreen == srccolor.rgbGreen && c.rgbBlue == srccolor.rgbBlue)
-            {
-                c.rgbRed = dstcolor.rgbRed;
-                c.rgbGreen = dstcolor.rgbGreen;
-                c.rgbBlue = dstcolor.rgbBlue;
-                dest.PutColour(x, y, c);
-            }
-        }
+// Each file written to outdir under its own name, or in place when outdir is nullptr
+std::vector<PipelineJob> MakeJobs(const std::vector<std::tstring>& files, LPCTSTR outdir)
+{
+    std::vector<PipelineJob> jobs;
+    jobs.reserve(files.size());
+    for (const std::tstring& file : files)
+    {
+        const size_t slash = file.find_last_of(TEXT("\\/"));
+        if (outdir == nullptr)
+            jobs.push_back({ file, file });
+        else
+            jobs.push_back({ file, std::tstring(outdir) + TEXT('\\') + file.substr(slash == std::tstring::npos ? 0 : slash + 1) });
     }
+    return jobs;
 }
 
-BOOL HandleResourceName(
-    HMODULE hModule,
-    LPCTSTR lpType,
-    LPTSTR lpName,
-    LONG_PTR lParam
-)
+// Progress on stderr, a few times a second and at the end
+void PrintProgress(const JobProgress& progress)
 {
-    if (IS_INTRESOURCE(lpName))
-        _tprintf(TEXT("%u\n"), (USHORT) (INT_PTR) lpName);
-    else
-        _tprintf(TEXT("%s\n"), lpName);
-    return TRUE;
+    static ULONGLONG last = 0;
+    const ULONGLONG now = GetTickCount64();
+    if (progress.files < progress.total && now - last < 250)
+        return;
+    last = now;
+    _ftprintf(stderr, TEXT("\r%zu/%zu files, %zu failed, %llu KB, %llu pixels"), progress.files, progress.total, progress.failed, progress.bytes / 1024, progress.pixels);
 }
 
-bool ParseIconIndex(LPTSTR arg, int* index)
+// The pipeline as a job, Ctrl+C stops it between files, entries and row bands
+int RunJob(const std::vector<PipelineJob>& jobs, const PipelineTransform& transform, PipelineOptions options, const JobLimits& limits, bool bProgress)
 {
-    LPTSTR x;
-    if ((x = _tcsstr(arg, TEXT(".exe,"))) || (x = _tcsstr(arg, TEXT(".dll,"))))
+    JobControl job(jobs.size(), limits, bProgress ? JobProgressCallback(PrintProgress) : nullptr);
+    job.CancelOnCtrlC();
+    options.pJob = &job;
+    const size_t failed = RunPipeline(jobs, transform, options);
+    if (bProgress)
+        _ftprintf(stderr, TEXT("\n"));
+    if (job.IsCancelled())
     {
-        x += 4;
-        *index = _tstoi(x + 1);
-        *x = TEXT('\0');
-        return true;
+        _ftprintf(stderr, TEXT("Cancelled\n"));
+        return EXIT_FAILURE;
     }
-    else
-        return false;
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 void ShowUsage()
@@ -181,17 +221,67 @@ void ShowUsage()
     _tprintf(TEXT("\n"));
     _tprintf(TEXT("Options:\n"));
     _tprintf(TEXT("\t/IgnoreValidatePng\t\t\t\t- do note validate png entries\n"));
+    _tprintf(TEXT("\t/progress\t\t\t\t\t- batch, optimize and recolormap show files done on stderr, Ctrl+C cancels them cleanly\n"));
+    _tprintf(TEXT("\t/maxmem=n /maxtime=n\t\t\t- batch, optimize and recolormap fail a file past n MB or n seconds\n"));
+    _tprintf(TEXT("\t/lang=n\t\t\t\t\t- language id of exe/dll resources (eg 0x0409), falls back to neutral, the UI language then English\n"));
     _tprintf(TEXT("\n"));
     _tprintf(TEXT("Command:\n"));
     _tprintf(TEXT("\tlist [ico file]\t\t\t\t- list icon sizes in file\n"));
     _tprintf(TEXT("\tshow [ico file] [icon num]\t\t- display icon in terminal\n"));
+    _tprintf(TEXT("\tsheet [ico file]...\t\t\t- display all icons in terminal\n"));
+    _tprintf(TEXT("\tatlas [bmp/png file] [json/csv file] [ico file]...\t- pack icons into one image with a coordinate map\n"));
+    _tprintf(TEXT("\t\t/size=n /depth=n\t\t\t- only pack entries of this size or bit count\n"));
+    _tprintf(TEXT("\t\t/width=n\t\t\t\t- atlas width (default 2048)\n"));
     _tprintf(TEXT("\tcopy [dest ico file] [src ico file]\t- copy icon\n"));
+    _tprintf(TEXT("\t\t/canonical\t\t\t\t- sort entries and normalise headers so identical images give identical bytes\n"));
     _tprintf(TEXT("\talphablend [dest ico file] [src ico file] <blend ico file>...\t- alpha blend individual icons in file\n"));
+    _tprintf(TEXT("\t\t/mode=straight|premultiplied|linear\t- blend space, linear converts from sRGB (default premultiplied)\n"));
+    _tprintf(TEXT("\t\t/op=srcover|dstover|srcin|dstin|srcout|dstout|srcatop|dstatop|xor|plus|src|dst|clear\t- Porter-Duff operator (default srcover)\n"));
     _tprintf(TEXT("\tgrayscalealpha [dest ico file] [src ico file]\t- convert grayscale into the alpha channel\n"));
     _tprintf(TEXT("\trecolor [ico file] [ico num] [src color] [dst color]\t- convert grayscale into the alpha channel\n"));
+    _tprintf(TEXT("\tresize [dest ico file] [src ico file] [size]...\t- resample the largest icon to each size (1 to 256), cursor hotspots are scaled\n"));
+    _tprintf(TEXT("\tadd [dest ico file] [src ico file] [from ico file] [icon num]...\t- append entries of another icon\n"));
+    _tprintf(TEXT("\tremove [dest ico file] [src ico file] [icon num]...\t- drop entries\n"));
+    _tprintf(TEXT("\textract [dest ico file] [src ico file] [icon num]...\t- keep only these entries, in this order\n"));
+    _tprintf(TEXT("\treorder [dest ico file] [src ico file] [icon num]...\t- new order, every entry listed once\n"));
+    _tprintf(TEXT("\tmerge [dest ico file] [src ico file] [ico file]...\t- add the sizes missing from src, without re-encoding\n"));
+    _tprintf(TEXT("\t\t/replace\t\t\t\t- take the entry from the later file where both have a size\n"));
+    _tprintf(TEXT("\tbatch [operation] [dest dir] [ico file]...\t- run copy, canonical, grayscalealpha or resize over many files with pipelined I/O\n"));
+    _tprintf(TEXT("\t\t/size=n,n...\t\t\t\t- sizes for resize\n"));
+    _tprintf(TEXT("\t\t/threads=n /depth=n\t\t\t- transform threads, files in flight per stage (default 16)\n"));
+    _tprintf(TEXT("\trecolormap [map file] [ico file]...\t\t- replace colours of every entry in place, map lines are: src dst [tolerance]\n"));
+    _tprintf(TEXT("\t\t/out=dir /threads=n\t\t\t- write to another directory, threads\n"));
+    _tprintf(TEXT("\toptimize [ico file]...\t\t\t- store large entries as PNG where smaller, in place\n"));
+    _tprintf(TEXT("\t\t/minsize=n\t\t\t\t- smallest 32-bit BMP entry width to convert (default 256)\n"));
+    _tprintf(TEXT("\t\t/recompress\t\t\t\t- also re-encode PNG entries\n"));
+    _tprintf(TEXT("\t\t/effort=n\t\t\t\t- deflate effort 1 to 9 (default 9)\n"));
+    _tprintf(TEXT("\t\t/out=dir /threads=n\t\t\t- write to another directory, compression threads\n"));
+    _tprintf(TEXT("\tdiff [ico file/dir] [ico file/dir]\t\t- compare decoded entries matched by size and depth, exits 1 if any differ\n"));
+    _tprintf(TEXT("\t\t/tolerance=n\t\t\t\t- largest channel difference still the same (default 0)\n"));
+    _tprintf(TEXT("\t\t/report=file\t\t\t\t- per entry max delta, psnr and mask mismatches (.json or .csv)\n"));
+    _tprintf(TEXT("\t\t/images=dir\t\t\t\t- write a png of the differences of each differing entry\n"));
+    _tprintf(TEXT("\tdedupe [ico file]...\t\t\t- list groups of visually near identical icons, by a perceptual hash of one entry\n"));
+    _tprintf(TEXT("\t\t/size=n\t\t\t\t\t- hash the entry nearest this size (default 32)\n"));
+    _tprintf(TEXT("\t\t/distance=n\t\t\t\t- most differing hash bits of a duplicate, 0 to 64 (default 4)\n"));
+    _tprintf(TEXT("\tgenerate [dest dir] [count]\t\t\t- write synthetic icons, the same seed always gives the same files\n"));
+    _tprintf(TEXT("\t\t/seed=n\t\t\t\t\t- seed of the first file, the next file uses n + 1 (default 1)\n"));
+    _tprintf(TEXT("\t\t/size=n,n... /depth=n,n...\t\t- an entry per size and depth (default 16,24,32,48,256 and 4,8,32)\n"));
+    _tprintf(TEXT("\t\t/pngsize=n\t\t\t\t- 32-bit entries this size and up are PNG, 0 for none (default 256)\n"));
+    _tprintf(TEXT("\t\t/cursor\t\t\t\t\t- write cursors with the hotspot in the centre\n"));
+    _tprintf(TEXT("\t\t/groups=n\t\t\t\t- write dlls with n icon groups instead\n"));
+    _tprintf(TEXT("\timport [dest ico file] [image file]...\t- build an icon with an entry per .png, .bmp or raw pixel file\n"));
+    _tprintf(TEXT("\t\t/pngsize=n\t\t\t\t- entries this size and up are PNG, 0 for none (default 256)\n"));
+    _tprintf(TEXT("\t\t/raw=bgra|rgba /width=n /height=n /stride=n\t- layout of raw pixel files, straight alpha (default bgra, stride width * 4)\n"));
+    _tprintf(TEXT("\texport [src ico file] [icon num] [image file]\t- write an entry as .png, .bmp or raw top-down pixels\n"));
+    _tprintf(TEXT("\t\t/raw=bgra|rgba\t\t\t\t- raw pixel order (default bgra)\n"));
+    _tprintf(TEXT("\treplace [exe/dll file] [group id]=[ico file]...\t- replace icon groups in the resources, written in one pass\n"));
+    _tprintf(TEXT("\t\t/out=file\t\t\t\t- write to a new file instead of in place\n"));
+    _tprintf(TEXT("\t\t/lang=n\t\t\t\t\t- the language of a group replaced, picked as extract does, others are kept\n"));
     _tprintf(TEXT("\n"));
     _tprintf(TEXT("Where:\n"));
-    _tprintf(TEXT("\t[src ico file]\t- can be an icon file (.ico) or an exe/dll resource (.exe,n) (.dll,n)\n"));
+    _tprintf(TEXT("\t[src ico file]\t- can be an icon file (.ico), a cursor file (.cur) or an exe/dll resource (.exe,n) (.dll,n)\n"));
+    _tprintf(TEXT("\t\t\t  list and resize also accept animated cursors (.ani)\n"));
+    _tprintf(TEXT("\t[ico file]...\t- one or more icon files, wildcards allowed\n"));
 }
 
 int _tmain(const int argc, const TCHAR* argv[])
@@ -199,9 +289,15 @@ int _tmain(const int argc, const TCHAR* argv[])
     try
     {
         arginit(argc, argv);
+        std::pmr::monotonic_buffer_resource arena; // backs all icon data for the command, released on exit
         int arg = 1;
         LPCTSTR cmd = argnum(arg++);
         const bool bIgnoreValidatePng = argswitch(TEXT("/IgnoreValidatePng"));
+        const LANGID lang = static_cast<LANGID>(_tcstoul(argvalue(TEXT("/lang"), TEXT("0")), nullptr, 0));
+        const bool bProgress = argswitch(TEXT("/progress"));
+        JobLimits limits;
+        limits.maxBytes = _tcstoui64(argvalue(TEXT("/maxmem"), TEXT("0")), nullptr, 10) * 1024 * 1024;
+        limits.maxMilliseconds = _tcstoui64(argvalue(TEXT("/maxtime"), TEXT("0")), nullptr, 10) * 1000;
 
         if (cmd == nullptr)
         {
@@ -225,16 +321,28 @@ int _tmain(const int argc, const TCHAR* argv[])
             {
                 HMODULE hModule = LoadLibraryEx(icofile, NULL, LOAD_LIBRARY_AS_IMAGE_RESOURCE);
                 CHECK(hModule);
-                EnumResourceNames(hModule, RT_GROUP_ICON, HandleResourceName, 0);
+                const ResourceIndex resources(hModule, { RT_GROUP_ICON });
+                for (const ResourceId& name : resources.GetNames(ResourceId(RT_GROUP_ICON)))
+                    ListResourceName(name, resources.GetLanguages(ResourceId(RT_GROUP_ICON), name));
                 FreeLibrary(hModule);
                 _tprintf(TEXT("\n"));
             }
+            else if (IsAni(icofile))
+            {
+                const AniFile ani = AniFile::Load(icofile);
+                for (size_t i = 0; i < ani.GetFrameCount(); ++i)
+                {
+                    std::pmr::monotonic_buffer_resource framearena;
+                    _tprintf(TEXT("Frame %zu:\n"), i);
+                    IconList(ani.GetFrame(i, bIgnoreValidatePng, &framearena));
+                }
+            }
             else
             {
                 int index = 0;
                 const IconFile IconData = ParseIconIndex(icofile, &index)
-                    ? IconFile::FromResource(icofile, index, bIgnoreValidatePng)
-                    : IconFile::Load(icofile, bIgnoreValidatePng);
+                    ? IconFile::FromResource(icofile, index, lang, bIgnoreValidatePng, &arena)
+                    : IconFile::Load(icofile, bIgnoreValidatePng, &arena);
                 IconList(IconData);
             }
             return EXIT_SUCCESS;
@@ -249,35 +357,93 @@ int _tmain(const int argc, const TCHAR* argv[])
                 return EXIT_FAILURE;
             }
 
-            WCHAR icofile[MAX_PATH];
-            ExpandEnvironmentStrings(icofilearg, icofile, ARRAYSIZE(icofile));
-
-            int index = 0;
-            const IconFile IconData = ParseIconIndex(icofile, &index)
-                ? IconFile::FromResource(icofile, index, bIgnoreValidatePng)
-                : IconFile::Load(icofile, bIgnoreValidatePng);
-
-            if (iconum < 0 || iconum >= IconData.entry.size())
+            const IconFile IconData = LoadIconEntryArg(icofilearg, iconum, lang, bIgnoreValidatePng, &arena);
+            if (IconData.entry.empty())
             {
                 _tprintf(TEXT("Invalid icon index\n"));
                 return EXIT_FAILURE;
             }
 
-            const IconFile::Entry& entry = IconData.entry[iconum];
+            const IconFile::Entry& entry = IconData.entry[0];
             if (entry.IsPNG())
             {
                 _tprintf(TEXT("PNG not supported\n"));
                 return EXIT_FAILURE;
             }
 
-            PrintImage(IconData.entry[iconum]);
+            PrintImage(entry);
+            return EXIT_SUCCESS;
+        }
+        else if (_tcsicmp(cmd, TEXT("sheet")) == 0)
+        {
+            TerminalSheet sheet;
+            // A file named more than once, or several icons of one module, is parsed once
+            IconCache cache(64 * 1024 * 1024, bIgnoreValidatePng);
+            LPCTSTR icofilearg;
+            while ((icofilearg = argnum(arg++)) != nullptr)
+            {
+                WCHAR icofile[MAX_PATH];
+                ExpandEnvironmentStrings(icofilearg, icofile, ARRAYSIZE(icofile));
+
+                int index = 0;
+                const IconCache::Ptr IconData = ParseIconIndex(icofile, &index)
+                    ? cache.FromResource(icofile, index, lang)
+                    : cache.Load(icofile);
+
+                for (const IconFile::Entry& entry : IconData->entry)
+                {
+                    if (!entry.IsPNG())
+                        sheet.Add(IconImage(entry));
+                }
+            }
+            if (!argcleanup())
+            {
+                ShowUsage();
+                return EXIT_FAILURE;
+            }
+
+            sheet.Flush();
+            return EXIT_SUCCESS;
+        }
+        else if (_tcsicmp(cmd, TEXT("atlas")) == 0)
+        {
+            LPCTSTR atlasfilearg = argnum(arg++);
+            LPCTSTR mapfilearg = argnum(arg++);
+            AtlasOptions options = {};
+            options.width = _tstoi(argvalue(TEXT("/width"), TEXT("2048")));
+            options.size = _tstoi(argvalue(TEXT("/size"), TEXT("0")));
+            options.depth = _tstoi(argvalue(TEXT("/depth"), TEXT("0")));
+
+            std::vector<std::tstring> files;
+            LPCTSTR icofilearg;
+            while ((icofilearg = argnum(arg++)) != nullptr)
+            {
+                WCHAR icofile[MAX_PATH];
+                ExpandEnvironmentStrings(icofilearg, icofile, ARRAYSIZE(icofile));
+                FindFiles(icofile, files);
+            }
+            if (!argcleanup() || atlasfilearg == nullptr || mapfilearg == nullptr || files.empty())
+            {
+                ShowUsage();
+                return EXIT_FAILURE;
+            }
+
+            WCHAR atlasfile[MAX_PATH];
+            WCHAR mapfile[MAX_PATH];
+            ExpandEnvironmentStrings(atlasfilearg, atlasfile, ARRAYSIZE(atlasfile));
+            ExpandEnvironmentStrings(mapfilearg, mapfile, ARRAYSIZE(mapfile));
+
+            BuildAtlas(files, atlasfile, mapfile, options, bIgnoreValidatePng);
             return EXIT_SUCCESS;
         }
         else if (_tcsicmp(cmd, TEXT("alphablend")) == 0)
         {
             LPCTSTR outicofilearg = argnum(arg++);
             LPCTSTR inicofilearg = argnum(arg++);
-            if (outicofilearg == nullptr || inicofilearg == nullptr)
+            BlendMode mode;
+            if (outicofilearg == nullptr || inicofilearg == nullptr
+                || !ParseBlendOp(argvalue(TEXT("/op"), TEXT("srcover")), mode.op)
+                || !ParseBlendSpace(argvalue(TEXT("/mode"), TEXT("premultiplied")), mode.space))
             {
                 ShowUsage();
                 return EXIT_FAILURE;
@@ -290,14 +456,15 @@ int _tmain(const int argc, const TCHAR* argv[])
 
             int index = 0;
             IconFile IconData = ParseIconIndex(inicofile, &index)
-                ? IconFile::FromResource(inicofile, index, bIgnoreValidatePng)
-                : IconFile::Load(inicofile, bIgnoreValidatePng);
+                ? IconFile::FromResource(inicofile, index, lang, bIgnoreValidatePng, &arena)
+                : IconFile::Load(inicofile, bIgnoreValidatePng, &arena);
 
             LPCTSTR blendicofile;
             while ((blendicofile = argnum(arg++)) != nullptr)
             {
-                const IconFile IconDataBlend = IconFile::Load(blendicofile, bIgnoreValidatePng);
-                AlphaBlendImages(IconData, IconDataBlend);
+                std::pmr::monotonic_buffer_resource blendarena;
+                const IconFile IconDataBlend = IconFile::Load(blendicofile, bIgnoreValidatePng, &blendarena);
+                AlphaBlendImages(IconData, IconDataBlend, mode);
             }
             if (!argcleanup())
             {
@@ -324,8 +491,8 @@ int _tmain(const int argc, const TCHAR* argv[])
 
             int index = 0;
             IconFile IconData = ParseIconIndex(inicofile, &index)
-                ? IconFile::FromResource(inicofile, index, bIgnoreValidatePng)
-                : IconFile::Load(inicofile, bIgnoreValidatePng);
+                ? IconFile::FromResource(inicofile, index, lang, bIgnoreValidatePng, &arena)
+                : IconFile::Load(inicofile, bIgnoreValidatePng, &arena);
 
             GrayscaleToAlpha(IconData);
             IconData.Save(outicofile, bIgnoreValidatePng);
@@ -335,6 +502,7 @@ int _tmain(const int argc, const TCHAR* argv[])
         {
             LPCTSTR outicofilearg = argnum(arg++);
             LPCTSTR inicofilearg = argnum(arg++);
+            const bool bCanonical = argswitch(TEXT("/canonical"));
             if (!argcleanup() || outicofilearg == nullptr || inicofilearg == nullptr)
             {
                 ShowUsage();
@@ -347,13 +515,56 @@ int _tmain(const int argc, const TCHAR* argv[])
             ExpandEnvironmentStrings(inicofilearg, inicofile, ARRAYSIZE(inicofile));
 
             int index = 0;
-            const IconFile IconData = ParseIconIndex(inicofile, &index)
-                ? IconFile::FromResource(inicofile, index, bIgnoreValidatePng)
-                : IconFile::Load(inicofile, bIgnoreValidatePng);
+            IconFile IconData = ParseIconIndex(inicofile, &index)
+                ? IconFile::FromResource(inicofile, index, lang, bIgnoreValidatePng, &arena)
+                : IconFile::Load(inicofile, bIgnoreValidatePng, &arena);
+            if (bCanonical)
+                IconData.Canonicalize();
 
             IconData.Save(outicofile, bIgnoreValidatePng);
             return EXIT_SUCCESS;
         }
+        else if (_tcsicmp(cmd, TEXT("resize")) == 0)
+        {
+            LPCTSTR outicofilearg = argnum(arg++);
+            LPCTSTR inicofilearg = argnum(arg++);
+            std::vector<int> sizes;
+            LPCTSTR sizearg;
+            bool bValid = true;
+            while ((sizearg = argnum(arg++)) != nullptr)
+            {
+                sizes.push_back(_tstoi(sizearg));
+                bValid = bValid && sizes.back() >= 1 && sizes.back() <= 256;
+            }
+            if (!argcleanup() || outicofilearg == nullptr || inicofilearg == nullptr || sizes.empty() || !bValid)
+            {
+                ShowUsage();
+                return EXIT_FAILURE;
+            }
+
+            WCHAR outicofile[MAX_PATH];
+            WCHAR inicofile[MAX_PATH];
+            ExpandEnvironmentStrings(outicofilearg, outicofile, ARRAYSIZE(outicofile));
+            ExpandEnvironmentStrings(inicofilearg, inicofile, ARRAYSIZE(inicofile));
+
+            if (IsAni(inicofile))
+            {
+                AniFile ani = AniFile::Load(inicofile);
+                ani.TransformFrames([&sizes](IconFile& IconData) { ResizeImages(IconData, sizes); }, bIgnoreValidatePng);
+                ani.Save(outicofile);
+            }
+            else
+            {
+                int index = 0;
+                IconFile IconData = ParseIconIndex(inicofile, &index)
+                    ? IconFile::FromResource(inicofile, index, lang, bIgnoreValidatePng, &arena)
+                    : IconFile::Load(inicofile, bIgnoreValidatePng, &arena);
+
+                ResizeImages(IconData, sizes);
+                IconData.Save(outicofile, bIgnoreValidatePng);
+            }
+            return EXIT_SUCCESS;
+        }
         else if (_tcsicmp(cmd, TEXT("recolor")) == 0)
         {
             LPCTSTR icofilearg = argnum(arg++);
@@ -370,7 +581,7 @@ int _tmain(const int argc, const TCHAR* argv[])
             ExpandEnvironmentStrings(icofilearg, icofile, ARRAYSIZE(icofile));
 
             int index = 0;
-            IconFile IconData = IconFile::Load(icofile, bIgnoreValidatePng);
+            IconFile IconData = IconFile::Load(icofile, bIgnoreValidatePng, &arena);
 
             if (iconum < 0 || iconum >= IconData.entry.size())
             {
@@ -385,11 +596,485 @@ int _tmain(const int argc, const TCHAR* argv[])
                 return EXIT_FAILURE;
             }
 
-            Recolor(entry, iconum, srccolor, dstcolor);
+            Recolor(entry, srccolor, dstcolor);
 
             IconData.Save(icofile, bIgnoreValidatePng);
             return EXIT_SUCCESS;
             }
+        else if (_tcsicmp(cmd, TEXT("add")) == 0 || _tcsicmp(cmd, TEXT("remove")) == 0 || _tcsicmp(cmd, TEXT("extract")) == 0 || _tcsicmp(cmd, TEXT("reorder")) == 0)
+        {
+            LPCTSTR outicofilearg = argnum(arg++);
+            LPCTSTR inicofilearg = argnum(arg++);
+            LPCTSTR fromicofilearg = _tcsicmp(cmd, TEXT("add")) == 0 ? argnum(arg++) : TEXT("");
+            std::vector<size_t> indices;
+            bool bIndices = true;
+            LPCTSTR indexarg;
+            while ((indexarg = argnum(arg++)) != nullptr)
+            {
+                size_t index;
+                if (ParseIndex(indexarg, &index))
+                    indices.push_back(index);
+                else
+                    bIndices = false;
+            }
+            if (!argcleanup() || outicofilearg == nullptr || inicofilearg == nullptr || fromicofilearg == nullptr || indices.empty() || !bIndices)
+            {
+                ShowUsage();
+                return EXIT_FAILURE;
+            }
+
+            WCHAR outicofile[MAX_PATH];
+            ExpandEnvironmentStrings(outicofilearg, outicofile, ARRAYSIZE(outicofile));
+
+            IconFile IconData = LoadIconArg(inicofilearg, lang, bIgnoreValidatePng, &arena);
+            if (_tcsicmp(cmd, TEXT("add")) == 0)
+            {
+                const IconFile IconDataFrom = LoadIconArg(fromicofilearg, lang, bIgnoreValidatePng, &arena);
+                for (const size_t i : indices)
+                    IconData.AddEntry(IconDataFrom, i);
+            }
+            else if (_tcsicmp(cmd, TEXT("remove")) == 0)
+                IconData.RemoveEntries(indices);
+            else if (_tcsicmp(cmd, TEXT("extract")) == 0)
+                IconData = IconData.ExtractEntries(indices, &arena);
+            else
+                IconData.ReorderEntries(indices);
+
+            IconData.Save(outicofile, bIgnoreValidatePng);
+            return EXIT_SUCCESS;
+        }
+        else if (_tcsicmp(cmd, TEXT("merge")) == 0)
+        {
+            LPCTSTR outicofilearg = argnum(arg++);
+            LPCTSTR inicofilearg = argnum(arg++);
+            const bool bReplace = argswitch(TEXT("/replace"));
+            std::vector<std::tstring> files;
+            LPCTSTR icofilearg;
+            while ((icofilearg = argnum(arg++)) != nullptr)
+                files.push_back(icofilearg);
+            if (!argcleanup() || outicofilearg == nullptr || inicofilearg == nullptr || files.empty())
+            {
+                ShowUsage();
+                return EXIT_FAILURE;
+            }
+
+            WCHAR outicofile[MAX_PATH];
+            ExpandEnvironmentStrings(outicofilearg, outicofile, ARRAYSIZE(outicofile));
+
+            IconFile IconData = LoadIconArg(inicofilearg, lang, bIgnoreValidatePng, &arena);
+            for (const std::tstring& file : files)
+                IconData.MergeEntries(LoadIconArg(file.c_str(), lang, bIgnoreValidatePng, &arena), bReplace);
+
+            IconData.Save(outicofile, bIgnoreValidatePng);
+            return EXIT_SUCCESS;
+        }
+        else if (_tcsicmp(cmd, TEXT("batch")) == 0)
+        {
+            LPCTSTR operation = argnum(arg++);
+            LPCTSTR outdirarg = argnum(arg++);
+            LPCTSTR sizesarg = argvalue(TEXT("/size"), TEXT(""));
+            PipelineOptions options;
+            options.nThreads = ParseThreads();
+            const int depth = _tstoi(argvalue(TEXT("/depth"), TEXT("16")));
+            options.depth = depth >= 1 && depth <= 1024 ? depth : 0;
+
+            std::vector<std::tstring> files;
+            LPCTSTR icofilearg;
+            while ((icofilearg = argnum(arg++)) != nullptr)
+            {
+                WCHAR icofile[MAX_PATH];
+                ExpandEnvironmentStrings(icofilearg, icofile, ARRAYSIZE(icofile));
+                FindFiles(icofile, files);
+            }
+
+            const std::vector<int> sizes = ParseList(sizesarg);
+            bool bValidSizes = !sizes.empty();
+            for (const int size : sizes)
+                bValidSizes = bValidSizes && size >= 1 && size <= 256;
+
+            std::function<void(IconFile&)> op;
+            if (operation != nullptr && _tcsicmp(operation, TEXT("copy")) == 0)
+                op = [](IconFile&) {};
+            else if (operation != nullptr && _tcsicmp(operation, TEXT("canonical")) == 0)
+                op = [](IconFile& IconData) { IconData.Canonicalize(); };
+            else if (operation != nullptr && _tcsicmp(operation, TEXT("grayscalealpha")) == 0)
+                op = [](IconFile& IconData) { GrayscaleToAlpha(IconData); };
+            else if (operation != nullptr && _tcsicmp(operation, TEXT("resize")) == 0 && bValidSizes)
+                op = [&sizes](IconFile& IconData) { ResizeImages(IconData, sizes); };
+
+            if (!argcleanup() || !op || outdirarg == nullptr || files.empty() || options.nThreads == 0 || options.depth == 0)
+            {
+                ShowUsage();
+                return EXIT_FAILURE;
+            }
+
+            WCHAR outdir[MAX_PATH];
+            ExpandEnvironmentStrings(outdirarg, outdir, ARRAYSIZE(outdir));
+
+            return RunJob(MakeJobs(files, outdir), [&op, bIgnoreValidatePng](const std::tstring&, std::vector<BYTE> data)
+                {
+                    std::pmr::monotonic_buffer_resource filearena;
+                    IconFile IconData = IconFile::FromMemory(data.data(), data.size(), bIgnoreValidatePng, &filearena);
+                    op(IconData);
+                    return IconData.SaveToMemory(bIgnoreValidatePng);
+                }, options, limits, bProgress);
+        }
+        else if (_tcsicmp(cmd, TEXT("optimize")) == 0)
+        {
+            LPCTSTR outdirarg = argvalue(TEXT("/out"));
+            OptimizeOptions optimize;
+            optimize.minsize = _tstoi(argvalue(TEXT("/minsize"), TEXT("256")));
+            optimize.bRecompress = argswitch(TEXT("/recompress"));
+            optimize.effort = _tstoi(argvalue(TEXT("/effort"), TEXT("9")));
+            PipelineOptions options;
+            options.nThreads = ParseThreads();
+
+            std::vector<std::tstring> files;
+            LPCTSTR icofilearg;
+            while ((icofilearg = argnum(arg++)) != nullptr)
+            {
+                WCHAR icofile[MAX_PATH];
+                ExpandEnvironmentStrings(icofilearg, icofile, ARRAYSIZE(icofile));
+                FindFiles(icofile, files);
+            }
+            if (!argcleanup() || files.empty() || optimize.effort < 1 || optimize.effort > 9 || options.nThreads == 0)
+            {
+                ShowUsage();
+                return EXIT_FAILURE;
+            }
+
+            WCHAR outdir[MAX_PATH] = TEXT("");
+            if (outdirarg != nullptr)
+                ExpandEnvironmentStrings(outdirarg, outdir, ARRAYSIZE(outdir));
+
+            // A single file gets every thread for its entries, otherwise the threads work on one file each
+            const unsigned int nEntryThreads = files.size() == 1 ? options.nThreads : 1;
+            return RunJob(MakeJobs(files, outdirarg != nullptr ? outdir : nullptr), [&optimize, nEntryThreads, bIgnoreValidatePng](const std::tstring&, std::vector<BYTE> data)
+                {
+                    std::pmr::monotonic_buffer_resource filearena;
+                    IconFile IconData = IconFile::FromMemory(data.data(), data.size(), bIgnoreValidatePng, &filearena);
+                    OptimizeImages(IconData, optimize, nEntryThreads);
+                    return IconData.SaveToMemory(bIgnoreValidatePng);
+                }, options, limits, bProgress);
+        }
+        else if (_tcsicmp(cmd, TEXT("recolormap")) == 0)
+        {
+            LPCTSTR mapfilearg = argnum(arg++);
+            LPCTSTR outdirarg = argvalue(TEXT("/out"));
+            PipelineOptions options;
+            options.nThreads = ParseThreads();
+
+            std::vector<std::tstring> files;
+            LPCTSTR icofilearg;
+            while ((icofilearg = argnum(arg++)) != nullptr)
+            {
+                WCHAR icofile[MAX_PATH];
+                ExpandEnvironmentStrings(icofilearg, icofile, ARRAYSIZE(icofile));
+                FindFiles(icofile, files);
+            }
+            if (!argcleanup() || mapfilearg == nullptr || files.empty() || options.nThreads == 0)
+            {
+                ShowUsage();
+                return EXIT_FAILURE;
+            }
+
+            WCHAR mapfile[MAX_PATH];
+            ExpandEnvironmentStrings(mapfilearg, mapfile, ARRAYSIZE(mapfile));
+            const ColourMap map = ColourMap::Load(mapfile);
+
+            WCHAR outdir[MAX_PATH] = TEXT("");
+            if (outdirarg != nullptr)
+                ExpandEnvironmentStrings(outdirarg, outdir, ARRAYSIZE(outdir));
+
+            const unsigned int nEntryThreads = files.size() == 1 ? options.nThreads : 1;
+            return RunJob(MakeJobs(files, outdirarg != nullptr ? outdir : nullptr), [&map, nEntryThreads, bIgnoreValidatePng](const std::tstring&, std::vector<BYTE> data)
+                {
+                    std::pmr::monotonic_buffer_resource filearena;
+                    IconFile IconData = IconFile::FromMemory(data.data(), data.size(), bIgnoreValidatePng, &filearena);
+                    RecolorImages(IconData, map, nEntryThreads);
+                    return IconData.SaveToMemory(bIgnoreValidatePng);
+                }, options, limits, bProgress);
+        }
+        else if (_tcsicmp(cmd, TEXT("diff")) == 0)
+        {
+            LPCTSTR aarg = argnum(arg++);
+            LPCTSTR barg = argnum(arg++);
+            LPCTSTR reportarg = argvalue(TEXT("/report"));
+            LPCTSTR imagesarg = argvalue(TEXT("/images"));
+            DiffOptions options;
+            options.tolerance = _tstoi(argvalue(TEXT("/tolerance"), TEXT("0")));
+            if (!argcleanup() || aarg == nullptr || barg == nullptr)
+            {
+                ShowUsage();
+                return EXIT_FAILURE;
+            }
+
+            WCHAR a[MAX_PATH];
+            WCHAR b[MAX_PATH];
+            ExpandEnvironmentStrings(aarg, a, ARRAYSIZE(a));
+            ExpandEnvironmentStrings(barg, b, ARRAYSIZE(b));
+
+            // Two directories pair up their files by name, a file on one side only fails to load on the other
+            std::vector<DiffFile> files;
+            const DWORD attributes = GetFileAttributes(a);
+            if (attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY))
+            {
+                std::vector<std::tstring> names;
+                FindFiles((std::tstring(a) + TEXT("\\*")).c_str(), names);
+                for (const std::tstring& name : names)
+                    files.push_back({ name, std::tstring(b) + name.substr(name.find_last_of(TEXT('\\'))) });
+
+                std::vector<std::tstring> bnames;
+                FindFiles((std::tstring(b) + TEXT("\\*")).c_str(), bnames);
+                for (const std::tstring& name : bnames)
+                {
+                    const std::tstring aname = std::tstring(a) + name.substr(name.find_last_of(TEXT('\\')));
+                    if (GetFileAttributes(aname.c_str()) == INVALID_FILE_ATTRIBUTES)
+                        files.push_back({ aname, name });
+                }
+            }
+            else
+                files.push_back({ a, b });
+
+            WCHAR report[MAX_PATH];
+            if (reportarg != nullptr)
+                ExpandEnvironmentStrings(reportarg, report, ARRAYSIZE(report));
+            WCHAR images[MAX_PATH];
+            if (imagesarg != nullptr)
+            {
+                ExpandEnvironmentStrings(imagesarg, images, ARRAYSIZE(images));
+                options.lpImageDir = images;
+            }
+
+            const size_t different = DiffFiles(files, reportarg != nullptr ? report : nullptr, options, bIgnoreValidatePng);
+            _tprintf(TEXT("%zu of %zu files differ\n"), different, files.size());
+            return different == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+        else if (_tcsicmp(cmd, TEXT("dedupe")) == 0)
+        {
+            DedupeOptions options;
+            options.size = _tstoi(argvalue(TEXT("/size"), TEXT("32")));
+            options.distance = _tstoi(argvalue(TEXT("/distance"), TEXT("4")));
+
+            std::vector<std::tstring> files;
+            LPCTSTR icofilearg;
+            while ((icofilearg = argnum(arg++)) != nullptr)
+            {
+                WCHAR icofile[MAX_PATH];
+                ExpandEnvironmentStrings(icofilearg, icofile, ARRAYSIZE(icofile));
+                FindFiles(icofile, files);
+            }
+            if (!argcleanup() || files.empty() || options.distance < 0 || options.distance > 64)
+            {
+                ShowUsage();
+                return EXIT_FAILURE;
+            }
+
+            const size_t clusters = DedupeFiles(files, options, bIgnoreValidatePng);
+            _tprintf(TEXT("%zu groups of duplicates in %zu files\n"), clusters, files.size());
+            return EXIT_SUCCESS;
+        }
+        else if (_tcsicmp(cmd, TEXT("generate")) == 0)
+        {
+            LPCTSTR outdirarg = argnum(arg++);
+            const size_t count = _tcstoul(argnum(arg++, TEXT("1")), nullptr, 0);
+            const DWORD seed = _tcstoul(argvalue(TEXT("/seed"), TEXT("1")), nullptr, 0);
+            const int groups = _tstoi(argvalue(TEXT("/groups"), TEXT("0")));
+            GenerateOptions options;
+            options.sizes = ParseList(argvalue(TEXT("/size"), TEXT("16,24,32,48,256")));
+            options.depths = ParseList(argvalue(TEXT("/depth"), TEXT("4,8,32")));
+            options.pngsize = _tstoi(argvalue(TEXT("/pngsize"), TEXT("256")));
+            options.type = argswitch(TEXT("/cursor")) ? TYPE_CURSOR : TYPE_ICON;
+
+            bool bValid = !options.sizes.empty() && !options.depths.empty() && groups >= 0 && groups <= 0x7FFF;
+            for (const int size : options.sizes)
+                bValid = bValid && size >= 1 && size <= 256;
+            for (const int depth : options.depths)
+                bValid = bValid && PixelFormat::IsSupported(static_cast<WORD>(depth), BI_RGB);
+            if (!argcleanup() || outdirarg == nullptr || count == 0 || !bValid)
+            {
+                ShowUsage();
+                return EXIT_FAILURE;
+            }
+
+            WCHAR outdir[MAX_PATH];
+            ExpandEnvironmentStrings(outdirarg, outdir, ARRAYSIZE(outdir));
+
+            // Each file has its own seed so the output does not depend on the thread count
+            LPCTSTR ext = groups > 0 ? TEXT("dll") : options.type == TYPE_CURSOR ? TEXT("cur") : TEXT("ico");
+            ParallelFor(count, [&](size_t i)
+                {
+                    IconGenerator generator(static_cast<DWORD>(seed + i));
+                    TCHAR name[32];
+                    _stprintf_s(name, ARRAYSIZE(name), TEXT("\\gen%05zu.%s"), i, ext);
+                    const std::tstring outfile = std::tstring(outdir) + name;
+                    if (groups > 0)
+                    {
+                        const std::vector<BYTE> module = generator.GenerateModule(options, groups);
+                        WriteAllBytes(outfile.c_str(), module.data(), module.size());
+                    }
+                    else
+                    {
+                        std::pmr::monotonic_buffer_resource filearena;
+                        generator.GenerateIcon(options, &filearena).Save(outfile.c_str(), bIgnoreValidatePng);
+                    }
+                });
+            _tprintf(TEXT("%zu files written\n"), count);
+            return EXIT_SUCCESS;
+        }
+        else if (_tcsicmp(cmd, TEXT("import")) == 0)
+        {
+            LPCTSTR outicofilearg = argnum(arg++);
+            const int pngsize = _tstoi(argvalue(TEXT("/pngsize"), TEXT("256")));
+            const LONG width = _tstoi(argvalue(TEXT("/width"), TEXT("0")));
+            const LONG height = _tstoi(argvalue(TEXT("/height"), TEXT("0")));
+            const LONG stride = _tstoi(argvalue(TEXT("/stride"), TEXT("0")));
+            RawFormat format = RAW_BGRA;
+            const bool bFormat = ParseRawFormat(argvalue(TEXT("/raw"), TEXT("bgra")), format);
+
+            std::vector<std::tstring> files;
+            LPCTSTR imagefilearg;
+            while ((imagefilearg = argnum(arg++)) != nullptr)
+            {
+                WCHAR imagefile[MAX_PATH];
+                ExpandEnvironmentStrings(imagefilearg, imagefile, ARRAYSIZE(imagefile));
+                files.push_back(imagefile);
+            }
+            if (!argcleanup() || outicofilearg == nullptr || files.empty() || !bFormat || stride < 0)
+            {
+                ShowUsage();
+                return EXIT_FAILURE;
+            }
+
+            WCHAR outicofile[MAX_PATH];
+            ExpandEnvironmentStrings(outicofilearg, outicofile, ARRAYSIZE(outicofile));
+
+            IconFile IconData(&arena);
+            IconData.Header.idType = TYPE_ICON;
+            for (const std::tstring& file : files)
+            {
+                if (HasExtension(file.c_str(), TEXT(".png")) || HasExtension(file.c_str(), TEXT(".bmp")))
+                {
+                    Bitmap bitmap = LoadImageFile(file.c_str());
+                    IconData.entry.push_back(EncodeRaw(View(bitmap), pngsize, IconData.entry.get_allocator()));
+                    continue;
+                }
+
+                // Anything else is raw pixels, used where they are read
+                std::vector<BYTE> data = ReadAllBytes(file.c_str());
+                const RawImage raw = { data.data(), width, height, stride != 0 ? stride : width * LONG(sizeof(RGBQUAD)), format };
+                if (width <= 0 || height <= 0 || raw.stride < width * LONG(sizeof(RGBQUAD))
+                    || ULONGLONG(raw.stride) * (height - 1) + width * sizeof(RGBQUAD) > data.size())
+                {
+                    _ftprintf(stderr, TEXT("%s: raw pixels need /width and /height within the file size\n"), file.c_str());
+                    return EXIT_FAILURE;
+                }
+                IconData.entry.push_back(EncodeRaw(raw, pngsize, IconData.entry.get_allocator()));
+            }
+            IconData.UpdateOffsets();
+
+            IconData.Save(outicofile, bIgnoreValidatePng);
+            return EXIT_SUCCESS;
+        }
+        else if (_tcsicmp(cmd, TEXT("export")) == 0)
+        {
+            LPCTSTR icofilearg = argnum(arg++);
+            const int iconum = _tstoi(argnum(arg++, TEXT("0")));
+            LPCTSTR outfilearg = argnum(arg++);
+            RawFormat format = RAW_BGRA;
+            const bool bFormat = ParseRawFormat(argvalue(TEXT("/raw"), TEXT("bgra")), format);
+            if (!argcleanup() || icofilearg == nullptr || outfilearg == nullptr || !bFormat)
+            {
+                ShowUsage();
+                return EXIT_FAILURE;
+            }
+
+            const IconFile IconData = LoadIconEntryArg(icofilearg, iconum, lang, bIgnoreValidatePng, &arena);
+            if (IconData.entry.empty())
+            {
+                _tprintf(TEXT("Invalid icon index\n"));
+                return EXIT_FAILURE;
+            }
+
+            WCHAR outfile[MAX_PATH];
+            ExpandEnvironmentStrings(outfilearg, outfile, ARRAYSIZE(outfile));
+
+            const IconFile::Entry& entry = IconData.entry[0];
+            if (HasExtension(outfile, TEXT(".png")))
+            {
+                const std::vector<BYTE> png = EncodePng(Decode(entry));
+                WriteAllBytes(outfile, png.data(), png.size());
+            }
+            else if (HasExtension(outfile, TEXT(".bmp")))
+                SaveBmp(outfile, Decode(entry));
+            else
+            {
+                // Tightly packed top-down rows
+                const LONG width = entry.GetWidth();
+                const LONG height = entry.GetHeight();
+                std::vector<BYTE> data(size_t(width) * height * sizeof(RGBQUAD));
+                ExportEntry(entry, { data.data(), width, height, width * LONG(sizeof(RGBQUAD)), format });
+                WriteAllBytes(outfile, data.data(), data.size());
+            }
+            return EXIT_SUCCESS;
+        }
+        else if (_tcsicmp(cmd, TEXT("replace")) == 0)
+        {
+            LPCTSTR pefilearg = argnum(arg++);
+            LPCTSTR outfilearg = argvalue(TEXT("/out"));
+            std::vector<std::pair<ResourceId, std::tstring>> replacements;
+            LPCTSTR replacearg;
+            while ((replacearg = argnum(arg++)) != nullptr)
+            {
+                LPCTSTR eq = _tcschr(replacearg, TEXT('='));
+                if (eq == nullptr || eq == replacearg)
+                {
+                    ShowUsage();
+                    return EXIT_FAILURE;
+                }
+                std::tstring group(replacearg, eq);
+                if (_istdigit(group[0]))
+                    replacements.emplace_back(ResourceId(static_cast<WORD>(_tstoi(group.c_str()))), eq + 1);
+                else
+                {
+                    // Resource names are stored and looked up in upper case
+                    CharUpperBuff(&group[0], static_cast<DWORD>(group.size()));
+                    replacements.emplace_back(ResourceId(group), eq + 1);
+                }
+            }
+            if (!argcleanup() || pefilearg == nullptr || replacements.empty())
+            {
+                ShowUsage();
+                return EXIT_FAILURE;
+            }
+
+            WCHAR pefile[MAX_PATH];
+            ExpandEnvironmentStrings(pefilearg, pefile, ARRAYSIZE(pefile));
+
+            PeFile pe = PeFile::Load(pefile);
+            for (const auto& replacement : replacements)
+            {
+                WCHAR icofile[MAX_PATH];
+                ExpandEnvironmentStrings(replacement.second.c_str(), icofile, ARRAYSIZE(icofile));
+                const IconFile IconData = IconFile::Load(icofile, bIgnoreValidatePng, &arena);
+                pe.ReplaceIconGroup(replacement.first, lang, IconData);
+            }
+
+            if (outfilearg != nullptr)
+            {
+                WCHAR outfile[MAX_PATH];
+                ExpandEnvironmentStrings(outfilearg, outfile, ARRAYSIZE(outfile));
+                pe.Save(outfile);
+            }
+            else
+            {
+                // Write next to the original and swap it in so a failure leaves the file intact
+                const std::tstring tmpfile = std::tstring(pefile) + TEXT(".tmp");
+                pe.Save(tmpfile.c_str());
+                CHECK(MoveFileEx(tmpfile.c_str(), pefile, MOVEFILE_REPLACE_EXISTING));
+            }
+            return EXIT_SUCCESS;
+        }
         else
         {
             _ftprintf(stderr, TEXT("Unknown command: %s\n"), cmd);
@@ -406,4 +1091,10 @@ int _tmain(const int argc, const TCHAR* argv[])
         _ftprintf(stderr, TEXT("%s\n"), e.GetMsg().c_str());
         return EXIT_FAILURE;
     }
+    // eg bad_alloc, rather than ending in abort
+    catch (const std::exception& e)
+    {
+        _ftprintf(stderr, TEXT("%hs\n"), e.what());
+        return EXIT_FAILURE;
+    }
 }
@@ -0,0 +1,197 @@
+#include "IconCache.h"
+
+#include <tchar.h>
+#include <mutex>
+
+namespace
+{
+    // Full path with the last write time and size of the open file, a modified file gets a new key
+    std::tstring FileKey(LPCTSTR lpFilename, HANDLE hFile)
+    {
+        std::tstring path(MAX_PATH, TEXT('\0'));
+        DWORD len = GetFullPathName(lpFilename, static_cast<DWORD>(path.size()), &path[0], nullptr);
+        if (len >= path.size())
+        {
+            path.resize(len);
+            len = GetFullPathName(lpFilename, static_cast<DWORD>(path.size()), &path[0], nullptr);
+        }
+        CHECK(len > 0 && len < path.size());
+        path.resize(len);
+
+        BY_HANDLE_FILE_INFORMATION info;
+        CHECK(GetFileInformationByHandle(hFile, &info));
+
+        TCHAR stamp[64];
+        _stprintf_s(stamp, ARRAYSIZE(stamp), TEXT("|%08x%08x|%08x%08x"),
+            info.ftLastWriteTime.dwHighDateTime, info.ftLastWriteTime.dwLowDateTime, info.nFileSizeHigh, info.nFileSizeLow);
+        return path + stamp;
+    }
+
+    // Writers are shut out while the handle is open, so the key describes the bytes that get read
+    class ReadHandle
+    {
+    public:
+        explicit ReadHandle(LPCTSTR lpFilename)
+            : hFile(CreateFile(lpFilename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, 0, NULL))
+        {
+            CHECK(hFile != INVALID_HANDLE_VALUE);
+        }
+        ~ReadHandle()
+        {
+            CloseHandle(hFile);
+        }
+        ReadHandle(const ReadHandle&) = delete;
+        ReadHandle& operator=(const ReadHandle&) = delete;
+
+        const HANDLE hFile;
+    };
+
+    size_t GetIconSize(const IconFile& IconData)
+    {
+        size_t size = sizeof(IconFile);
+        for (const IconFile::Entry& entry : IconData.entry)
+            size += sizeof(IconFile::Entry) + entry.GetDataSize();
+        return size;
+    }
+}
+
+IconCache::IconCache(size_t maxBytes, bool bIgnoreValidatePng)
+    : clock(0), maxShardBytes(maxBytes / nShards), bIgnoreValidatePng(bIgnoreValidatePng)
+{
+}
+
+IconCache::Ptr IconCache::Load(LPCTSTR lpFilename)
+{
+    const ReadHandle file(lpFilename);
+    return Get(FileKey(lpFilename, file.hFile), [this, &file]()
+        {
+            return IconFile::Load(file.hFile, IconFile::EntryFilter(), bIgnoreValidatePng);
+        });
+}
+
+IconCache::Ptr IconCache::FromResource(LPCTSTR strModule, int index, LANGID lang)
+{
+    TCHAR suffix[32];
+    _stprintf_s(suffix, ARRAYSIZE(suffix), TEXT("#%d|%04x"), index, lang);
+
+    // The module is mapped from its own handle, this one only keeps writers out until the load is done
+    const ReadHandle file(strModule);
+    const std::tstring path(strModule);
+    return Get(FileKey(strModule, file.hFile) + suffix, [this, &path, index, lang]()
+        {
+            return IconFile::FromResource(path.c_str(), index, lang, bIgnoreValidatePng);
+        });
+}
+
+IconCache::Ptr IconCache::Get(const std::tstring& key, const std::function<IconFile()>& load)
+{
+    Shard& shard = shards[std::hash<std::tstring>()(key) % nShards];
+
+    // Hits only take the shared lock, the tick is an atomic so recency is recorded without a write lock
+    {
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        const auto it = shard.items.find(key);
+        if (it != shard.items.end())
+        {
+            it->second.tick = ++clock;
+            const std::shared_future<Ptr> value = it->second.value;
+            lock.unlock();
+            return value.get();
+        }
+    }
+
+    std::promise<Ptr> promise;
+    std::shared_future<Ptr> value;
+    bool bLoader = false;
+    {
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        const auto r = shard.items.try_emplace(key);
+        Item& item = r.first->second;
+        if (r.second)
+        {
+            item.value = promise.get_future().share();
+            item.size = 0;
+            bLoader = true;
+        }
+        item.tick = ++clock;
+        value = item.value;
+    }
+
+    if (bLoader)
+    {
+        try
+        {
+            Ptr p = std::make_shared<const IconFile>(load());
+            const size_t size = GetIconSize(*p);
+            promise.set_value(std::move(p));
+
+            std::unique_lock<std::shared_mutex> lock(shard.mutex);
+            const auto it = shard.items.find(key);
+            if (it != shard.items.end())
+            {
+                it->second.size = size;
+                shard.size += size;
+                Evict(shard, key);
+            }
+        }
+        catch (...)
+        {
+            // Waiters get the error, the key is dropped so a later call retries
+            promise.set_exception(std::current_exception());
+
+            std::unique_lock<std::shared_mutex> lock(shard.mutex);
+            shard.items.erase(key);
+        }
+    }
+
+    return value.get();
+}
+
+// Least recently used first, entries still loading are left alone
+void IconCache::Evict(Shard& shard, const std::tstring& keep)
+{
+    while (shard.size > maxShardBytes)
+    {
+        auto oldest = shard.items.end();
+        for (auto it = shard.items.begin(); it != shard.items.end(); ++it)
+        {
+            if (it->second.size == 0 || it->first == keep)
+                continue;
+            if (oldest == shard.items.end() || it->second.tick < oldest->second.tick)
+                oldest = it;
+        }
+        if (oldest == shard.items.end())
+            break;
+        shard.size -= oldest->second.size;
+        shard.items.erase(oldest);
+    }
+}
+
+void IconCache::Clear()
+{
+    for (Shard& shard : shards)
+    {
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        for (auto it = shard.items.begin(); it != shard.items.end();)
+        {
+            if (it->second.size != 0)
+            {
+                shard.size -= it->second.size;
+                it = shard.items.erase(it);
+            }
+            else
+                ++it;
+        }
+    }
+}
+
+size_t IconCache::GetSize() const
+{
+    size_t size = 0;
+    for (const Shard& shard : shards)
+    {
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        size += shard.size;
+    }
+    return size;
+}
@@ -0,0 +1,55 @@
+#pragma once
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <memory>
+#include <shared_mutex>
+#include <unordered_map>
+
+#include "IconFile.h"
+#include "Utils.h"
+
+// Parsed icons shared between threads.
+// An IconFile is immutable once published and handed out refcounted, so it stays valid after eviction.
+// Files are keyed by full path and the last write time and size of the handle that reads them, so a changed file is simply a new key.
+// Concurrent misses on the same key load it once, the others wait for that load.
+class IconCache
+{
+public:
+    typedef std::shared_ptr<const IconFile> Ptr;
+
+    explicit IconCache(size_t maxBytes = 64 * 1024 * 1024, bool bIgnoreValidatePng = false);
+
+    Ptr Load(LPCTSTR lpFilename);
+    Ptr FromResource(LPCTSTR strModule, int index, LANGID lang = 0);
+
+    void Clear();
+    size_t GetSize() const;
+
+private:
+    static const size_t nShards = 16;
+
+    struct Item
+    {
+        std::shared_future<Ptr> value;
+        std::atomic<ULONGLONG> tick;
+        size_t size; // 0 while loading
+    };
+
+    struct Shard
+    {
+        mutable std::shared_mutex mutex;
+        std::unordered_map<std::tstring, Item> items;
+        size_t size = 0;
+    };
+
+    Ptr Get(const std::tstring& key, const std::function<IconFile()>& load);
+    void Evict(Shard& shard, const std::tstring& keep);
+
+    Shard shards[nShards];
+    std::atomic<ULONGLONG> clock;
+    const size_t maxShardBytes;
+    const bool bIgnoreValidatePng;
+};
@@ -1,50 +1,32 @@
 #include "IconFile.h"
 
+#include "Job.h"
+#include "PixelFormat.h"
+#include "Png.h"
+#include "ResourceIndex.h"
 #include "Utils.h"
 #include <tchar.h>
+#include <algorithm>
 
 #define VALIDATE(x) if (!(x)) { valid = false; _ftprintf(stderr, TEXT("Invalid: %s\n"), TEXT(#x)); }
 #define VALIDATE_OP(x, op, y) if (!((x) op (y))) { valid = false; _ftprintf(stderr, TEXT("Invalid: %s %s %s -> %d %s %d\n"), TEXT(#x), TEXT(#op), TEXT(#y), (int) (x), TEXT(#op), (int) (y)); }
 
-#pragma pack(push, 2)
-struct ICONDIRRES
+IconFile IconFile::Load(LPCTSTR lpFilename, bool bIgnoreValidatePng, std::pmr::memory_resource* mr)
 {
-    BYTE  bWidth;
-    BYTE  bHeight;
-    BYTE  bColorCount;
-    BYTE  bReserved;
-    WORD  wPlanes;
-    WORD  wBitCount;
-    DWORD dwBytesInRes;
-    WORD  nId;
-};
-#pragma pack(pop)
+    return Load(lpFilename, EntryFilter(), bIgnoreValidatePng, mr);
+}
 
-IconFile IconFile::Load(LPCTSTR lpFilename, bool bIgnoreValidatePng)
+IconFile IconFile::Load(LPCTSTR lpFilename, const EntryFilter& filter, bool bIgnoreValidatePng, std::pmr::memory_resource* mr)
 {
     const HANDLE hFile = CreateFile(lpFilename, GENERIC_READ, 0, nullptr, OPEN_EXISTING, 0, NULL);
     CHECK(hFile != INVALID_HANDLE_VALUE);
 
     try
     {
-        IconFile IconData;
-
-        CheckReadFile(hFile, &IconData.Header, sizeof(ICONHEADER));
-
-        IconData.entry.resize(IconData.Header.idCount);
-        for (Entry& entry : IconData.entry)
-        {
-            CheckReadFile(hFile, &entry.dir, sizeof(ICONDIR));
-        }
-
-        for (Entry& entry : IconData.entry)
-        {
-            entry.LoadData(hFile);
-        }
+        IconFile IconData = Load(hFile, filter, bIgnoreValidatePng, mr);
 
         CloseHandle(hFile);
 
-        IconData.Validate(bIgnoreValidatePng);
         return IconData;
     }
     catch (...)
@@ -54,14 +36,66 @@ IconFile IconFile::Load(LPCTSTR lpFilename, bool bIgnoreValidatePng)
     }
 }
 
-IconFile IconFile::FromResource(LPCTSTR strModule, int index, bool bIgnoreValidatePng)
+IconFile IconFile::Load(HANDLE hFile, const EntryFilter& filter, bool bIgnoreValidatePng, std::pmr::memory_resource* mr)
+{
+    IconFile IconData(mr);
+
+    LARGE_INTEGER size;
+    CHECK(GetFileSizeEx(hFile, &size));
+
+    CheckReadFileAt(hFile, 0, &IconData.Header, sizeof(ICONHEADER));
+
+    // Check the directory against the file size before allocating anything it describes
+    if (size.QuadPart < LONGLONG(sizeof(ICONHEADER) + IconData.Header.idCount * sizeof(ICONDIR)))
+        throw Error(TEXT("Invalid icon"));
+    std::vector<ICONDIR> dirs(IconData.Header.idCount);
+    if (!dirs.empty())
+        CheckReadFileAt(hFile, sizeof(ICONHEADER), dirs.data(), static_cast<DWORD>(dirs.size() * sizeof(ICONDIR)));
+
+    if (!filter)
+        IconData.entry.reserve(dirs.size());
+    ULONGLONG total = 0;
+    for (int i = 0; i < static_cast<int>(dirs.size()); ++i)
+    {
+        const ICONDIR& dir = dirs[i];
+        if (filter && !filter(i, dir))
+            continue;
+        if (LONGLONG(dir.dwImageOffset) + dir.dwBytesInRes > size.QuadPart)
+            throw Error(TEXT("Invalid icon"));
+        total += dir.dwBytesInRes;
+        IconData.entry.emplace_back();
+        IconData.entry.back().dir = dir;
+    }
+    // Entries that overlap could each claim the whole file
+    if (total > ULONGLONG(size.QuadPart))
+        throw Error(TEXT("Invalid icon"));
+    JobAllocate(total);
+
+    for (Entry& entry : IconData.entry)
+    {
+        JobCheck();
+        entry.LoadData(hFile);
+    }
+
+    if (filter)
+        IconData.UpdateOffsets();
+    IconData.Validate(bIgnoreValidatePng);
+    return IconData;
+}
+
+IconFile IconFile::FromResource(LPCTSTR strModule, int index, LANGID lang, bool bIgnoreValidatePng, std::pmr::memory_resource* mr)
+{
+    return FromResource(strModule, index, lang, EntryFilter(), bIgnoreValidatePng, mr);
+}
+
+IconFile IconFile::FromResource(LPCTSTR strModule, int index, LANGID lang, const EntryFilter& filter, bool bIgnoreValidatePng, std::pmr::memory_resource* mr)
 {
     HMODULE hModule = LoadLibraryEx(strModule, NULL, LOAD_LIBRARY_AS_IMAGE_RESOURCE);
     CHECK(hModule);
 
     try
     {
-        const IconFile IconData = IconFile::FromResource(hModule, index, bIgnoreValidatePng);
+        IconFile IconData = IconFile::FromResource(ResourceIndex(hModule, { RT_GROUP_ICON, RT_ICON }), index, lang, filter, bIgnoreValidatePng, mr);
 
         FreeLibrary(hModule);
 
@@ -74,39 +108,98 @@ IconFile IconFile::FromResource(LPCTSTR strModule, int index, bool bIgnoreValida
     }
 }
 
-IconFile IconFile::FromResource(HMODULE hModule, int index, bool bIgnoreValidatePng)
+IconFile IconFile::FromResource(HMODULE hModule, int index, LANGID lang, bool bIgnoreValidatePng, std::pmr::memory_resource* mr)
 {
-    HRSRC hResInfo = FindResourceEx(hModule, RT_GROUP_ICON, MAKEINTRESOURCE(index), MAKELANGID(LANG_NEUTRAL, SUBLANG_NEUTRAL)); // TODO Specify lang
-    CHECK(hResInfo);
+    const ResourceIndex resources(hModule, { RT_GROUP_ICON, RT_ICON });
+    return FromResource(resources, index, lang, bIgnoreValidatePng, mr);
+}
 
-    const DWORD sz = SizeofResource(hModule, hResInfo);
+IconFile IconFile::FromResource(const ResourceIndex& resources, int index, LANGID lang, bool bIgnoreValidatePng, std::pmr::memory_resource* mr)
+{
+    return FromResource(resources, index, lang, EntryFilter(), bIgnoreValidatePng, mr);
+}
 
-    HGLOBAL hRes = LoadResource(hModule, hResInfo);
-    CHECK(hRes);
+IconFile IconFile::FromResource(const ResourceIndex& resources, int index, LANGID lang, const EntryFilter& filter, bool bIgnoreValidatePng, std::pmr::memory_resource* mr)
+{
+    LANGID found = lang;
+    const ResourceIndex::Range* pRange = resources.Find(ResourceId(RT_GROUP_ICON), ResourceId(static_cast<WORD>(index)), lang, &found);
+    if (pRange == nullptr)
+        throw WinError(ERROR_RESOURCE_NAME_NOT_FOUND);
+
+    const DWORD sz = pRange->dwSize;
+    if (sz < sizeof(ICONHEADER))
+        throw Error(TEXT("Invalid icon group"));
 
-    IconFile IconData;
+    IconFile IconData(mr);
 
-    const ICONHEADER* pIconHeader = (ICONHEADER*) LockResource(hRes);
+    const ICONHEADER* pIconHeader = (const ICONHEADER*) pRange->pData;
     memcpy(&IconData.Header, pIconHeader, sizeof(ICONHEADER));
-    IconData.entry.resize(IconData.Header.idCount);
 
     bool valid = true;
     VALIDATE_OP(sz, ==, (sizeof(ICONHEADER) + IconData.Header.idCount * sizeof(ICONDIRRES)));
+    if (sz < sizeof(ICONHEADER) + IconData.Header.idCount * sizeof(ICONDIRRES))
+        throw Error(TEXT("Invalid icon group"));
+    if (!filter)
+        IconData.entry.reserve(IconData.Header.idCount);
 
-    const ICONDIRRES* pIconDirResArray = (ICONDIRRES*) (pIconHeader + 1);
-    DWORD dwImageOffset = sizeof(ICONHEADER) + static_cast<DWORD>(IconData.entry.size()) * sizeof(ICONDIR);
+    const ICONDIRRES* pIconDirResArray = (const ICONDIRRES*) (pIconHeader + 1);
+    DWORD dwImageOffset = sizeof(ICONHEADER) + static_cast<DWORD>(IconData.Header.idCount) * sizeof(ICONDIR);
     for (int i = 0; i < IconData.Header.idCount; ++i)
     {
-        Entry& entry = IconData.entry[i];
-
         // Resource ICONDIR is one WORD shorter than file ICONDIR
         const ICONDIRRES* pIconDir = &pIconDirResArray[i];
-        memcpy(&entry.dir, pIconDir, sizeof(ICONDIRRES));
-        entry.dir.dwImageOffset = dwImageOffset;
+        ICONDIR dir;
+        memcpy(&dir, pIconDir, sizeof(ICONDIRRES));
+        dir.dwImageOffset = dwImageOffset;
+        dwImageOffset += dir.dwBytesInRes;
+        if (filter && !filter(i, dir))
+            continue;
+
+        IconData.entry.emplace_back();
+        Entry& entry = IconData.entry.back();
+        entry.dir = dir;
+
+        JobAllocate(entry.dir.dwBytesInRes);
+        entry.DataFromResource(resources, pIconDir->nId, found);
+    }
 
-        entry.DataFromResource(hModule, pIconDir->nId);
+    if (filter)
+        IconData.UpdateOffsets();
+    IconData.Validate(bIgnoreValidatePng);
+    return IconData;
+}
 
-        dwImageOffset += entry.dir.dwBytesInRes;
+IconFile IconFile::FromMemory(const BYTE* pData, size_t size, bool bIgnoreValidatePng, std::pmr::memory_resource* mr)
+{
+    IconFile IconData(mr);
+
+    if (size < sizeof(ICONHEADER))
+        throw Error(TEXT("Invalid icon"));
+    memcpy(&IconData.Header, pData, sizeof(ICONHEADER));
+
+    if (size < sizeof(ICONHEADER) + IconData.Header.idCount * sizeof(ICONDIR))
+        throw Error(TEXT("Invalid icon"));
+    IconData.entry.resize(IconData.Header.idCount);
+    const ICONDIR* pIconDirArray = reinterpret_cast<const ICONDIR*>(pData + sizeof(ICONHEADER));
+    ULONGLONG total = 0;
+    for (int i = 0; i < IconData.Header.idCount; ++i)
+    {
+        Entry& entry = IconData.entry[i];
+        memcpy(&entry.dir, &pIconDirArray[i], sizeof(ICONDIR));
+
+        if (entry.dir.dwImageOffset > size || entry.dir.dwBytesInRes > size - entry.dir.dwImageOffset)
+            throw Error(TEXT("Invalid icon"));
+        total += entry.dir.dwBytesInRes;
+    }
+    // Entries that overlap could each claim the whole buffer
+    if (total > size)
+        throw Error(TEXT("Invalid icon"));
+    JobAllocate(total);
+
+    for (Entry& entry : IconData.entry)
+    {
+        JobCheck();
+        entry.DataFromMemory(pData + entry.dir.dwImageOffset, entry.dir.dwBytesInRes);
     }
 
     IconData.Validate(bIgnoreValidatePng);
@@ -117,6 +210,16 @@ IconFile::~IconFile()
 {
 }
 
+IconFile IconFile::Clone(std::pmr::memory_resource* mr) const
+{
+    IconFile IconData(mr);
+    IconData.Header = Header;
+    IconData.entry.reserve(entry.size());
+    for (const Entry& entry : entry)
+        IconData.entry.push_back(entry.Clone(IconData.entry.get_allocator()));
+    return IconData;
+}
+
 void IconFile::Validate(bool bIgnorePng) const
 {
     bool valid = true;
@@ -126,27 +229,41 @@ void IconFile::Validate(bool bIgnorePng) const
     DWORD dwImageOffset = sizeof(ICONHEADER) + static_cast<DWORD>(entry.size()) * sizeof(ICONDIR);
     for (const Entry& entry : entry)
     {
+        VALIDATE_OP(entry.GetDataSize(), ==, entry.dir.dwBytesInRes);
         if (!entry.IsPNG())
         {
+            VALIDATE(entry.IsInBounds());
+            if (!valid) throw Error(TEXT("Invalid icon"));
+
             const BITMAPINFOHEADER* header = entry.GetBITMAPINFOHEADER();
             VALIDATE_OP(header->biPlanes, ==, 1);
-
-            VALIDATE_OP(header->biWidth, ==, entry.dir.bWidth);
-            VALIDATE_OP(header->biHeight, ==, entry.dir.bHeight * 2);
-            VALIDATE_OP(header->biBitCount, ==, entry.dir.wBitCount);
+            VALIDATE(PixelFormat::IsSupported(header->biBitCount, header->biCompression));
+            if (header->biCompression == BI_BITFIELDS)
+                VALIDATE(PixelFormat::AreBitFieldsValid(header, entry.GetBitFields()));
+
+            VALIDATE_OP(header->biWidth, ==, entry.GetWidth());
+            VALIDATE_OP(header->biHeight, ==, entry.GetHeight() * 2);
+            if (GetType() == TYPE_CURSOR)
+            {
+                VALIDATE_OP(entry.GetHotspotX(), <, entry.GetWidth());
+                VALIDATE_OP(entry.GetHotspotY(), <, entry.GetHeight());
+            }
+            else
+                VALIDATE_OP(header->biBitCount, ==, entry.dir.wBitCount);
 
             VALIDATE_OP(entry.dir.dwImageOffset, ==, dwImageOffset);
 
             const DWORD dwBytesInXOR = entry.GetBytesPerLineXOR() * header->biHeight / 2;
             const DWORD dwBytesInAND = entry.GetBytesPerLineAND() * header->biHeight / 2;
 
-            VALIDATE_OP(sizeof(BITMAPINFOHEADER) + (entry.GetColorSize() * sizeof(RGBQUAD)) + dwBytesInXOR + dwBytesInAND, ==, entry.dir.dwBytesInRes);
+            VALIDATE_OP(entry.GetColorsOffset() + (entry.GetColorSize() * sizeof(RGBQUAD)) + dwBytesInXOR + dwBytesInAND, ==, entry.dir.dwBytesInRes);
         }
         else if (!bIgnorePng)
         {
             VALIDATE_OP(entry.dir.bWidth, ==, 0);
             VALIDATE_OP(entry.dir.bHeight, ==, 0);
-            VALIDATE_OP(entry.dir.wBitCount, ==, 32);
+            if (GetType() != TYPE_CURSOR)
+                VALIDATE_OP(entry.dir.wBitCount, ==, 32);
         }
         dwImageOffset += entry.dir.dwBytesInRes;
     }
@@ -183,15 +300,265 @@ void IconFile::Save(LPCTSTR lpFilename, bool bIgnoreValidatePng) const
     }
 }
 
-void IconFile::Entry::LoadData(const HANDLE hFile)
+std::vector<BYTE> IconFile::SaveToMemory(bool bIgnoreValidatePng) const
 {
-    data.resize(dir.dwBytesInRes);
+    Validate(bIgnoreValidatePng);
 
-    const DWORD offset = SetFilePointer(hFile, 0, nullptr, FILE_CURRENT);
-    if (offset != dir.dwImageOffset)
-        SetFilePointer(hFile, dir.dwImageOffset, nullptr, FILE_BEGIN);
+    size_t size = sizeof(ICONHEADER) + entry.size() * sizeof(ICONDIR);
+    for (const Entry& entry : entry)
+        size += entry.GetDataSize();
 
-    CheckReadFile(hFile, data.data(), static_cast<DWORD>(data.size()));
+    std::vector<BYTE> buffer;
+    buffer.reserve(size);
+    const BYTE* pHeader = reinterpret_cast<const BYTE*>(&Header);
+    buffer.insert(buffer.end(), pHeader, pHeader + sizeof(ICONHEADER));
+    for (const Entry& entry : entry)
+    {
+        const BYTE* pDir = reinterpret_cast<const BYTE*>(&entry.dir);
+        buffer.insert(buffer.end(), pDir, pDir + sizeof(ICONDIR));
+    }
+    for (const Entry& entry : entry)
+    {
+        _ASSERTE(buffer.size() == entry.dir.dwImageOffset);
+        buffer.insert(buffer.end(), entry.GetData(), entry.GetData() + entry.GetDataSize());
+    }
+    return buffer;
+}
+
+void IconFile::UpdateOffsets()
+{
+    Header.idCount = static_cast<WORD>(entry.size());
+    DWORD dwImageOffset = sizeof(ICONHEADER) + static_cast<DWORD>(entry.size()) * sizeof(ICONDIR);
+    for (Entry& entry : entry)
+    {
+        entry.dir.dwBytesInRes = entry.GetDataSize();
+        entry.dir.dwImageOffset = dwImageOffset;
+        dwImageOffset += entry.dir.dwBytesInRes;
+    }
+}
+
+namespace
+{
+    bool SameImage(IconType type, const IconFile::Entry& a, const IconFile::Entry& b)
+    {
+        // Cursors keep the hotspot in wBitCount
+        return a.GetWidth() == b.GetWidth() && a.GetHeight() == b.GetHeight()
+            && (type == TYPE_CURSOR || a.dir.wBitCount == b.dir.wBitCount);
+    }
+}
+
+namespace
+{
+    int CanonicalDepth(const IconFile::Entry& e)
+    {
+        return e.IsPNG() || !e.IsInBounds() ? 32 : e.GetBITMAPINFOHEADER()->biBitCount;
+    }
+
+    // Rebuilds a BI_RGB entry with a plain header, a full palette and zeroed padding bits.
+    // Other headers and compressions only get their unused fields cleared.
+    void CanonicalBmpEntry(IconType type, IconFile::Entry& e)
+    {
+        if (!e.IsInBounds())
+            throw Error(TEXT("Invalid icon"));
+
+        const BITMAPINFOHEADER* header = e.GetBITMAPINFOHEADER();
+        const int width = header->biWidth;
+        const int height = header->biHeight / 2;
+        const WORD bitcount = header->biBitCount;
+        const DWORD dwBytesPerLineXOR = e.GetBytesPerLineXOR();
+        const DWORD dwBytesPerLineAND = e.GetBytesPerLineAND();
+        const DWORD dwBytesInImage = (dwBytesPerLineXOR + dwBytesPerLineAND) * height;
+
+        e.dir.bReserved = 0;
+        if (type != TYPE_CURSOR)
+        {
+            e.dir.wPlanes = 1;
+            e.dir.wBitCount = bitcount;
+        }
+
+        if (header->biSize != sizeof(BITMAPINFOHEADER) || header->biCompression != BI_RGB)
+        {
+            BITMAPINFOHEADER* h = e.GetBITMAPINFOHEADER();
+            h->biSizeImage = dwBytesInImage;
+            h->biXPelsPerMeter = 0;
+            h->biYPelsPerMeter = 0;
+            h->biClrImportant = 0;
+            return;
+        }
+
+        const int oldcolors = e.GetColorSize();
+        const int colors = bitcount <= 8 ? 1 << bitcount : 0;
+
+        std::vector<BYTE> data(sizeof(BITMAPINFOHEADER) + colors * sizeof(RGBQUAD) + dwBytesInImage, 0);
+        BITMAPINFOHEADER* h = reinterpret_cast<BITMAPINFOHEADER*>(data.data());
+        h->biSize = sizeof(BITMAPINFOHEADER);
+        h->biWidth = width;
+        h->biHeight = height * 2;
+        h->biPlanes = 1;
+        h->biBitCount = bitcount;
+        h->biCompression = BI_RGB;
+        h->biSizeImage = dwBytesInImage;
+
+        RGBQUAD* pColors = reinterpret_cast<RGBQUAD*>(data.data() + sizeof(BITMAPINFOHEADER));
+        for (int i = 0; i < (std::min)(oldcolors, colors); ++i)
+        {
+            pColors[i] = e.GetColors()[i];
+            pColors[i].rgbReserved = 0;
+        }
+
+        // Only whole bytes are copied then the bits past the width cleared
+        const BYTE* pSrc = reinterpret_cast<const BYTE*>(e.GetColors() + oldcolors);
+        BYTE* pDst = reinterpret_cast<BYTE*>(pColors + colors);
+        auto copyrows = [&pSrc, &pDst, height](DWORD stride, DWORD bits)
+        {
+            for (int y = 0; y < height; ++y)
+            {
+                memcpy(pDst, pSrc, bits / 8);
+                if (bits % 8 != 0)
+                    pDst[bits / 8] = pSrc[bits / 8] & static_cast<BYTE>(0xFF00 >> (bits % 8));
+                pSrc += stride;
+                pDst += stride;
+            }
+        };
+        copyrows(dwBytesPerLineXOR, static_cast<DWORD>(width) * bitcount);
+        copyrows(dwBytesPerLineAND, static_cast<DWORD>(width));
+
+        e.dir.bColorCount = static_cast<BYTE>(colors < 256 ? colors : 0);
+        e.SetDataSize(static_cast<DWORD>(data.size()));
+        memcpy(e.GetData(), data.data(), data.size());
+    }
+
+    void CanonicalPngEntry(IconType type, IconFile::Entry& e)
+    {
+        const std::vector<BYTE> png = CanonicalPng(e.GetData(), e.GetDataSize());
+        e.SetDataSize(static_cast<DWORD>(png.size()));
+        memcpy(e.GetData(), png.data(), png.size());
+
+        // IHDR is always first, its width and height follow the chunk type
+        const BYTE* ihdr = e.GetData() + 16;
+        const DWORD width = DWORD(ihdr[0]) << 24 | DWORD(ihdr[1]) << 16 | DWORD(ihdr[2]) << 8 | ihdr[3];
+        const DWORD height = DWORD(ihdr[4]) << 24 | DWORD(ihdr[5]) << 16 | DWORD(ihdr[6]) << 8 | ihdr[7];
+        e.dir.bWidth = static_cast<BYTE>(width < 256 ? width : 0);
+        e.dir.bHeight = static_cast<BYTE>(height < 256 ? height : 0);
+        e.dir.bColorCount = 0;
+        e.dir.bReserved = 0;
+        if (type != TYPE_CURSOR)
+        {
+            e.dir.wPlanes = 1;
+            e.dir.wBitCount = 32;
+        }
+    }
+}
+
+void IconFile::Canonicalize()
+{
+    Header.idReserved = 0;
+    for (Entry& e : entry)
+    {
+        if (e.IsPNG())
+            CanonicalPngEntry(GetType(), e);
+        else
+            CanonicalBmpEntry(GetType(), e);
+    }
+
+    // Largest and deepest first, identical sizes fall back to the bytes so the input order never shows
+    std::sort(entry.begin(), entry.end(), [](const Entry& a, const Entry& b)
+        {
+            if (a.GetWidth() != b.GetWidth())
+                return a.GetWidth() > b.GetWidth();
+            if (a.GetHeight() != b.GetHeight())
+                return a.GetHeight() > b.GetHeight();
+            if (CanonicalDepth(a) != CanonicalDepth(b))
+                return CanonicalDepth(a) > CanonicalDepth(b);
+            if (a.IsPNG() != b.IsPNG())
+                return b.IsPNG();
+            const int cmp = memcmp(&a.dir, &b.dir, offsetof(ICONDIR, dwBytesInRes));
+            if (cmp != 0)
+                return cmp < 0;
+            return std::lexicographical_compare(a.GetData(), a.GetData() + a.GetDataSize(), b.GetData(), b.GetData() + b.GetDataSize());
+        });
+    UpdateOffsets();
+}
+
+void IconFile::AddEntry(const IconFile& other, size_t index)
+{
+    if (index >= other.entry.size())
+        throw Error(TEXT("Invalid icon index"));
+    if (other.GetType() != GetType())
+        throw Error(TEXT("Icon and cursor entries can not be mixed"));
+
+    entry.push_back(other.entry[index].Clone(entry.get_allocator()));
+    UpdateOffsets();
+}
+
+void IconFile::RemoveEntries(std::vector<size_t> indices)
+{
+    std::sort(indices.begin(), indices.end());
+    indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+    if (!indices.empty() && indices.back() >= entry.size())
+        throw Error(TEXT("Invalid icon index"));
+
+    for (auto it = indices.rbegin(); it != indices.rend(); ++it)
+        entry.erase(entry.begin() + *it);
+    UpdateOffsets();
+}
+
+void IconFile::ReorderEntries(const std::vector<size_t>& order)
+{
+    std::vector<bool> seen(entry.size());
+    for (const size_t i : order)
+    {
+        if (i >= entry.size() || seen[i])
+            throw Error(TEXT("Invalid icon index"));
+        seen[i] = true;
+    }
+    if (order.size() != entry.size())
+        throw Error(TEXT("Every icon index must be listed once"));
+
+    std::pmr::vector<Entry> reordered(entry.get_allocator());
+    reordered.reserve(entry.size());
+    for (const size_t i : order)
+        reordered.push_back(std::move(entry[i]));
+    entry = std::move(reordered);
+    UpdateOffsets();
+}
+
+void IconFile::MergeEntries(const IconFile& other, bool bReplace)
+{
+    if (other.GetType() != GetType())
+        throw Error(TEXT("Icon and cursor entries can not be mixed"));
+
+    const size_t count = entry.size();
+    for (const Entry& o : other.entry)
+    {
+        const auto it = std::find_if(entry.begin(), entry.begin() + count, [this, &o](const Entry& e) { return SameImage(GetType(), e, o); });
+        if (it == entry.begin() + count)
+            entry.push_back(o.Clone(entry.get_allocator()));
+        else if (bReplace)
+            *it = o.Clone(entry.get_allocator());
+    }
+    UpdateOffsets();
+}
+
+IconFile IconFile::ExtractEntries(const std::vector<size_t>& indices, std::pmr::memory_resource* mr) const
+{
+    IconFile IconData(mr);
+    IconData.Header = Header;
+    IconData.entry.reserve(indices.size());
+    for (const size_t i : indices)
+    {
+        if (i >= entry.size())
+            throw Error(TEXT("Invalid icon index"));
+        IconData.entry.push_back(entry[i].Clone(IconData.entry.get_allocator()));
+    }
+    IconData.UpdateOffsets();
+    return IconData;
+}
+
+void IconFile::Entry::LoadData(const HANDLE hFile)
+{
+    data.resize(dir.dwBytesInRes);
+    CheckReadFileAt(hFile, dir.dwImageOffset, data.data(), static_cast<DWORD>(data.size()));
 }
 
 void IconFile::Entry::SaveData(const HANDLE hFile) const
@@ -203,26 +570,54 @@ void IconFile::Entry::SaveData(const HANDLE hFile) const
     CheckWriteFile(hFile, data.data(), static_cast<DWORD>(data.size()));
 }
 
-void IconFile::Entry::DataFromResource(HMODULE hModule, WORD nId)
+void IconFile::Entry::DataFromResource(const ResourceIndex& resources, WORD nId, LANGID lang)
 {
     bool valid = true;
 
-    HRSRC hResInfoIcon = FindResourceEx(hModule, RT_ICON, MAKEINTRESOURCE(nId), MAKELANGID(LANG_NEUTRAL, SUBLANG_NEUTRAL)); // TODO Specify lang
-    CHECK(hResInfoIcon);
+    const ResourceIndex::Range* pRange = resources.Find(ResourceId(RT_ICON), ResourceId(nId), lang);
+    if (pRange == nullptr)
+        throw WinError(ERROR_RESOURCE_NAME_NOT_FOUND);
 
-    const DWORD sz = SizeofResource(hModule, hResInfoIcon);
-    VALIDATE_OP(sz, ==, dir.dwBytesInRes);
+    VALIDATE_OP(pRange->dwSize, ==, dir.dwBytesInRes);
+    if (pRange->dwSize < dir.dwBytesInRes)
+        throw Error(TEXT("Invalid icon"));
 
-    HGLOBAL hRes = LoadResource(hModule, hResInfoIcon);
-    CHECK(hRes);
+    data.assign(pRange->pData, pRange->pData + dir.dwBytesInRes);
+}
 
-    const BYTE* pIconData = (BYTE*) LockResource(hRes);
+IconFile::Entry IconFile::Entry::Clone(const allocator_type& alloc) const
+{
+    Entry e(alloc);
+    e.dir = dir;
+    e.data.assign(data.begin(), data.end());
+    return e;
+}
 
-    data.resize(dir.dwBytesInRes);
-    memcpy(data.data(), pIconData, data.size());
+void IconFile::Entry::DataFromMemory(const BYTE* pData, size_t size)
+{
+    data.assign(pData, pData + size);
 }
 
 bool IconFile::Entry::IsPNG() const
 {
-    return !data.empty() && ::IsPNG(data.data());
+    return ::IsPNG(data.data(), data.size());
+}
+
+bool IconFile::Entry::IsInBounds() const
+{
+    if (data.size() < sizeof(BITMAPINFOHEADER))
+        return false;
+
+    const BITMAPINFOHEADER* header = GetBITMAPINFOHEADER();
+    if (header->biSize < sizeof(BITMAPINFOHEADER) || header->biSize > data.size())
+        return false;
+    // Limits keep the size calculation below from overflowing
+    if (header->biWidth <= 0 || header->biWidth > 0x10000 || header->biHeight <= 0 || header->biHeight > 0x20000 || header->biBitCount > 32)
+        return false;
+
+    const ULONGLONG height = header->biHeight / 2;
+    const ULONGLONG dwBytesPerLineXOR = (ULONGLONG(header->biWidth) * header->biBitCount + 31) / 32 * 4;
+    const ULONGLONG dwBytesPerLineAND = (ULONGLONG(header->biWidth) + 31) / 32 * 4;
+    const ULONGLONG size = GetColorsOffset() + ULONGLONG(GetColorSize()) * sizeof(RGBQUAD) + (dwBytesPerLineXOR + dwBytesPerLineAND) * height;
+    return size <= data.size();
 }
@@ -1,7 +1,11 @@
 #pragma once
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#include <functional>
 #include <vector>
+#include <memory_resource>
+
+class ResourceIndex;
 
 enum IconType { TYPE_NONE, TYPE_ICON, TYPE_CURSOR };
 
@@ -26,6 +30,19 @@ struct ICONDIR
     DWORD dwBytesInRes;
     DWORD dwImageOffset; // file-offset to the start of ICONIMAGE
 };
+
+// RT_GROUP_ICON entry, the image is the RT_ICON resource nId
+struct ICONDIRRES
+{
+    BYTE  bWidth;
+    BYTE  bHeight;
+    BYTE  bColorCount;
+    BYTE  bReserved;
+    WORD  wPlanes;
+    WORD  wBitCount;
+    DWORD dwBytesInRes;
+    WORD  nId;
+};
 #pragma pack(pop)
 
 #if 0
@@ -38,10 +55,10 @@ struct ICONIMAGE
 };
 #endif
 
-inline bool IsPNG(LPCVOID pImage)
+inline bool IsPNG(LPCVOID pImage, size_t size)
 {
-    const LPCSTR PNG = "\x89PNG\r\n\x1A\n";
-    return strcmp(PNG, reinterpret_cast<LPCSTR>(pImage)) == 0;
+    const BYTE PNG[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    return size >= sizeof(PNG) && memcmp(PNG, pImage, sizeof(PNG)) == 0;
 }
 
 inline DWORD pad32(DWORD b)
@@ -52,31 +69,114 @@ inline DWORD pad32(DWORD b)
 class IconFile
 {
 public:
-    static IconFile Load(LPCTSTR lpFilename, bool bIgnoreValidatePng);
-    static IconFile FromResource(LPCTSTR strModule, int index, bool bIgnoreValidatePng);
-    static IconFile FromResource(HMODULE hModule, int index, bool bIgnoreValidatePng);
-
-    IconFile()
-        : Header()
+    // Picks entries for a selective load by their index in the file and directory entry
+    typedef std::function<bool(int index, const ICONDIR& dir)> EntryFilter;
+
+    // mr backs the entry table and every entry payload, pass an arena (eg std::pmr::monotonic_buffer_resource)
+    // to get O(1) allocations per file and release everything in one go. It must outlive the IconFile.
+    static IconFile Load(LPCTSTR lpFilename, bool bIgnoreValidatePng, std::pmr::memory_resource* mr = std::pmr::get_default_resource());
+    // Reads the directory and then only the payloads filter selects, each with one positional read.
+    // The result holds those entries in file order with idCount and the offsets recomputed, and only
+    // they are validated, so taking one entry costs the size of that entry.
+    static IconFile Load(LPCTSTR lpFilename, const EntryFilter& filter, bool bIgnoreValidatePng, std::pmr::memory_resource* mr = std::pmr::get_default_resource());
+    // Reads through positional reads on a handle the caller keeps open, eg to stat the same handle
+    static IconFile Load(HANDLE hFile, const EntryFilter& filter, bool bIgnoreValidatePng, std::pmr::memory_resource* mr = std::pmr::get_default_resource());
+    // lang picks the language of the RT_GROUP_ICON following GetLanguageFallback, its RT_ICON images use the language found
+    // The module overloads index only RT_GROUP_ICON and RT_ICON, pass a ResourceIndex to share one across calls
+    static IconFile FromResource(LPCTSTR strModule, int index, LANGID lang, bool bIgnoreValidatePng, std::pmr::memory_resource* mr = std::pmr::get_default_resource());
+    static IconFile FromResource(HMODULE hModule, int index, LANGID lang, bool bIgnoreValidatePng, std::pmr::memory_resource* mr = std::pmr::get_default_resource());
+    static IconFile FromResource(const ResourceIndex& resources, int index, LANGID lang, bool bIgnoreValidatePng, std::pmr::memory_resource* mr = std::pmr::get_default_resource());
+    // Only the RT_ICON resources filter selects are copied, as Load with a filter
+    static IconFile FromResource(LPCTSTR strModule, int index, LANGID lang, const EntryFilter& filter, bool bIgnoreValidatePng, std::pmr::memory_resource* mr = std::pmr::get_default_resource());
+    static IconFile FromResource(const ResourceIndex& resources, int index, LANGID lang, const EntryFilter& filter, bool bIgnoreValidatePng, std::pmr::memory_resource* mr = std::pmr::get_default_resource());
+    static IconFile FromMemory(const BYTE* pData, size_t size, bool bIgnoreValidatePng, std::pmr::memory_resource* mr = std::pmr::get_default_resource());
+
+    explicit IconFile(std::pmr::memory_resource* mr = std::pmr::get_default_resource())
+        : Header(), entry(mr)
     {
     }
+    // Move only, payloads are only copied through an explicit Clone
+    IconFile(const IconFile& other) = delete;
+    IconFile(IconFile&& other) noexcept = default;
+    IconFile& operator=(const IconFile& other) = delete;
+    IconFile& operator=(IconFile&& other) = default;
     ~IconFile();
 
+    IconFile Clone(std::pmr::memory_resource* mr = std::pmr::get_default_resource()) const;
+
     IconType GetType() const { return static_cast<IconType>(Header.idType); }
+    std::pmr::memory_resource* GetMemoryResource() const { return entry.get_allocator().resource(); }
 
     void Validate(bool bIgnorePng) const;
     void Save(LPCTSTR lpFilename, bool bIgnoreValidatePng) const;
+    std::vector<BYTE> SaveToMemory(bool bIgnoreValidatePng) const;
+
+    // Recompute idCount and each dwImageOffset after entries are added, removed or resized
+    void UpdateOffsets();
+
+    // Normalise everything that does not change the images so identical images always save to identical bytes:
+    // entries sorted by size then depth, reserved fields zeroed, colour counts, biSizeImage and biClrUsed
+    // recomputed, padding bits cleared and PNG chunks in canonical order (see CanonicalPng)
+    void Canonicalize();
+
+    // Entry level edits, payloads are moved or copied byte for byte and only idCount and the offsets recomputed
+    void AddEntry(const IconFile& other, size_t index);
+    void RemoveEntries(std::vector<size_t> indices);
+    // order lists every index once
+    void ReorderEntries(const std::vector<size_t>& order);
+    // Entries of other with no match here by size (and bit count for icons) are added,
+    // with bReplace a matching entry is replaced by other's
+    void MergeEntries(const IconFile& other, bool bReplace);
+    // A new file of just the listed entries in that order
+    IconFile ExtractEntries(const std::vector<size_t>& indices, std::pmr::memory_resource* mr = std::pmr::get_default_resource()) const;
 
     class Entry
     {
     public:
+        // Allocator aware so the entry vector hands its memory resource down to each payload
+        using allocator_type = std::pmr::polymorphic_allocator<BYTE>;
+
+        explicit Entry(const allocator_type& alloc = {})
+            : dir(), data(alloc)
+        {
+        }
+        Entry(Entry&& other, const allocator_type& alloc)
+            : dir(other.dir), data(std::move(other.data), alloc)
+        {
+        }
+        // Move only, payloads are only copied through an explicit Clone
+        Entry(const Entry& other) = delete;
+        Entry(Entry&& other) noexcept = default;
+        Entry& operator=(const Entry& other) = delete;
+        Entry& operator=(Entry&& other) = default;
+
+        Entry Clone(const allocator_type& alloc = {}) const;
+
         ICONDIR dir;
 
         void LoadData(HANDLE hFile);
         void SaveData(HANDLE hFile) const;
-        void DataFromResource(HMODULE hModule, WORD nId);
+        void DataFromResource(const ResourceIndex& resources, WORD nId, LANGID lang);
+        void DataFromMemory(const BYTE* pData, size_t size);
 
         bool IsPNG() const;
+        // The header, palette, XOR and AND masks of a BMP entry all fit in the data,
+        // checked once so the pixel loops can run unchecked
+        bool IsInBounds() const;
+
+        // Cursor entries store the hotspot in place of wPlanes/wBitCount
+        WORD GetHotspotX() const { return dir.wPlanes; }
+        WORD GetHotspotY() const { return dir.wBitCount; }
+        void SetHotspot(WORD x, WORD y) { dir.wPlanes = x; dir.wBitCount = y; }
+
+        // 0 in the directory means 256
+        int GetWidth() const { return dir.bWidth == 0 ? 256 : dir.bWidth; }
+        int GetHeight() const { return dir.bHeight == 0 ? 256 : dir.bHeight; }
+
+        BYTE* GetData() { return data.data(); }
+        const BYTE* GetData() const { return data.data(); }
+        DWORD GetDataSize() const { return static_cast<DWORD>(data.size()); }
+        void SetDataSize(DWORD dwSize) { data.resize(dwSize); dir.dwBytesInRes = dwSize; }
 
         BITMAPINFOHEADER* GetBITMAPINFOHEADER()
         {
@@ -99,15 +199,31 @@ public:
                 iColorCount = 256; // 2**8
             return iColorCount;
         }
+        // BI_BITFIELDS masks follow the header, or are part of it for the larger headers
+        const DWORD* GetBitFields() const
+        {
+            _ASSERTE(!IsPNG());
+            return reinterpret_cast<const DWORD*>(data.data() + sizeof(BITMAPINFOHEADER));
+        }
+
+        DWORD GetColorsOffset() const
+        {
+            _ASSERTE(!IsPNG());
+            const BITMAPINFOHEADER* header = GetBITMAPINFOHEADER();
+            DWORD offset = header->biSize;
+            if (header->biCompression == BI_BITFIELDS && header->biSize == sizeof(BITMAPINFOHEADER))
+                offset += 3 * sizeof(DWORD);
+            return offset;
+        }
         RGBQUAD* GetColors()
         {
             _ASSERTE(!IsPNG());
-            return reinterpret_cast<RGBQUAD*>(data.data() + sizeof(BITMAPINFOHEADER));
+            return reinterpret_cast<RGBQUAD*>(data.data() + GetColorsOffset());
         }
         const RGBQUAD* GetColors() const
         {
             _ASSERTE(!IsPNG());
-            return reinterpret_cast<const RGBQUAD*>(data.data() + sizeof(BITMAPINFOHEADER));
+            return reinterpret_cast<const RGBQUAD*>(data.data() + GetColorsOffset());
         }
 
         DWORD GetBytesPerLineXOR() const
@@ -125,9 +241,9 @@ public:
         }
 
     private:
-        std::vector<BYTE> data;
+        std::pmr::vector<BYTE> data;
     };
 
     ICONHEADER Header;
-    std::vector<Entry> entry;
+    std::pmr::vector<Entry> entry;
 };
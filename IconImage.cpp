@@ -1,51 +1,29 @@
 #include "IconImage.h"
 
 #include "IconFile.h"
+#include "Mask.h"
 #include "Utils.h"
-#include "Format.h"
 
-inline BYTE getNybble(BYTE b, int i)
+namespace
 {
-    _ASSERTE(i == 0 || i == 1);
-    return (b >> (i * 4)) & 0xF;
-}
-
-inline BYTE setNybble(BYTE b, BYTE n, int i)
-{
-    _ASSERTE(i == 0 || i == 1);
-    _ASSERTE((n & 0xF) == n);
-    return (b & (0xF << ((1 - i) * 4))) | (n << (i * 4));
-}
-
-inline long ColourDistanceSq(RGBQUAD e1, RGBQUAD e2)
-{
-    const long rmean = ((long) e1.rgbRed + (long) e2.rgbRed) / 2;
-    const long r = (long) e1.rgbRed - (long) e2.rgbRed;
-    const long g = (long) e1.rgbGreen - (long) e2.rgbGreen;
-    const long b = (long) e1.rgbBlue - (long) e2.rgbBlue;
-    const long s = 0;// (long) e1.rgbReserved - (long) e2.rgbReserved;
-    return (((512 + rmean) * r * r) >> 8) + 4 * g * g + (((767 - rmean) * b * b) >> 8) + s * s;
-}
-
-int IconImage::GetNearestColour(const RGBQUAD c) const
-{
-    const RGBQUAD* it = std::min_element(pColor, pColor + iColorCount, [c](RGBQUAD x, RGBQUAD y)
-        {
-            return ColourDistanceSq(x, c) < ColourDistanceSq(y, c);
-        });
-    return int(it - pColor);
+    // Everything below indexes into the entry data unchecked. The check is made here, not in the
+    // member initialiser, as the arguments there are evaluated in no set order.
+    PixelFormat CheckedFormat(const IconFile::Entry& entry)
+    {
+        if (entry.IsPNG() || !entry.IsInBounds() || entry.GetBITMAPINFOHEADER()->biPlanes != 1)
+            throw Error(TEXT("Invalid icon image"));
+        return PixelFormat(entry.GetBITMAPINFOHEADER(), entry.GetBitFields(), entry.GetColors(), entry.GetColorSize());
+    }
 }
 
 IconImage::IconImage(const IconFile::Entry& entry)
+    : format(CheckedFormat(entry))
 {
-    _ASSERTE(!entry.IsPNG());
 
     const BITMAPINFOHEADER* header = entry.GetBITMAPINFOHEADER();
-    _ASSERTE(header->biPlanes == 1);
 
     biWidth = header->biWidth;
     biHeight = header->biHeight / 2;
-    biBitCount = header->biBitCount;
     iColorCount = entry.GetColorSize();
 
     dwBytesPerLineXOR = entry.GetBytesPerLineXOR();
@@ -61,66 +39,10 @@ RGBQUAD IconImage::GetColour(int x, int y) const
     _ASSERTE(x >= 0 && x < GetWidth());
     _ASSERTE(y >= 0 && y < GetHeight());
 
-    RGBQUAD c = {};
-    switch (biBitCount)
-    {
-    case 1:
-    {
-        _ASSERTE(iColorCount == 2);
-        const BYTE v = *reinterpret_cast<BYTE*>(GetColourPtr(x, y));
-        const BYTE n = GetBit(v, 8 - 1 - x % 8);
-        c = GetColour(n);
-        c.rgbReserved = GetMask(x, y) ? 0 : 255;
-        break;
-    }
-
-    case 4:
-    {
-        _ASSERTE(iColorCount == 16);
-        const BYTE v = *reinterpret_cast<BYTE*>(GetColourPtr(x, y));
-        const BYTE n = getNybble(v, 2 - 1 - x % 2);
-        c = GetColour(n);
-        c.rgbReserved = GetMask(x, y) ? 0 : 255;
-        break;
-    }
-
-    case 8:
-    {
-        _ASSERTE(iColorCount == 256);
-        const BYTE n = *reinterpret_cast<BYTE*>(GetColourPtr(x, y));
-        c = GetColour(n);
-        c.rgbReserved = GetMask(x, y) ? 0 : 255;
-        break;
-    }
-
-    case 24:
-    {
-        _ASSERTE(iColorCount == 0);
-        const UINT32 v = *reinterpret_cast<UINT32*>(GetColourPtr(x, y)) & 0xFFFFFF;
-        c.rgbRed = (v >> 16) & 0xFF;
-        c.rgbGreen = (v >> 8) & 0xFF;
-        c.rgbBlue = (v >> 0) & 0xFF;
-        c.rgbReserved = GetMask(x, y) ? 0 : 255;
-        break;
-    }
-
-    case 32:
-    {
-        _ASSERTE(iColorCount == 0);
-        const UINT32 v = *reinterpret_cast<UINT32*>(GetColourPtr(x, y));
-        c.rgbReserved = (v >> 24) & 0xFF;
-        c.rgbRed = (v >> 16) & 0xFF;
-        c.rgbGreen = (v >> 8) & 0xFF;
-        c.rgbBlue = (v >> 0) & 0xFF;
-        if (GetMask(x, y))
-            c.rgbReserved = 0;
-        break;
-    }
-
-    default:
-        throw Error(Format(TEXT("biBitCount %d not supported"), biBitCount));
-        break;
-    }
+    RGBQUAD c;
+    format.DecodeRow(GetRowXOR(y), x, 1, &c);
+    if (GetMask(x, y))
+        c.rgbReserved = 0;
     return c;
 }
 
@@ -129,55 +51,61 @@ void IconImage::PutColour(int x, int y, const RGBQUAD c) const
     _ASSERTE(x >= 0 && x < GetWidth());
     _ASSERTE(y >= 0 && y < GetHeight());
 
-    switch (biBitCount)
-    {
-    case 1:
-    {
-        _ASSERTE(iColorCount == 2);
-        const BYTE n = GetNearestColour(c);
-        BYTE* p = reinterpret_cast<BYTE*>(GetColourPtr(x, y));
-        *p = SetBit(*p, 8 - 1 - x % 8, n);
-        break;
-    }
+    format.EncodeRow(GetRowXOR(y), x, 1, &c);
+    SetMask(x, y, c.rgbReserved == 0);
+}
 
-    case 4:
-    {
-        _ASSERTE(iColorCount == 16);
-        const BYTE n = GetNearestColour(c);
-        BYTE* p = reinterpret_cast<BYTE*>(GetColourPtr(x, y));
-        *p = setNybble(*p, n, 2 - 1 - x % 2);
-        break;
-    }
+void IconImage::GetRow(int y, RGBQUAD* pDst) const
+{
+    format.DecodeRow(GetRowXOR(y), 0, biWidth, pDst);
+    ApplyMaskRow(GetRowAND(y), biWidth, pDst);
+}
 
-    case 8:
-    {
-        _ASSERTE(iColorCount == 256);
-        const BYTE n = GetNearestColour(c);
-        BYTE* p = reinterpret_cast<BYTE*>(GetColourPtr(x, y));
-        *p = n;
-        break;
-    }
+void IconImage::PutRow(int y, const RGBQUAD* pSrc) const
+{
+    format.EncodeRow(GetRowXOR(y), 0, biWidth, pSrc);
+    AlphaToMaskRow(pSrc, biWidth, GetRowAND(y));
+}
 
-    case 24:
+void IconImage::GetIndexRow(int y, BYTE* pDst) const
+{
+    _ASSERTE(IsIndexed());
+    const BYTE* pRow = GetRowXOR(y);
+    const int bits = format.GetBitCount();
+    const int max = (1 << bits) - 1;
+    for (int x = 0; x < biWidth; ++x)
     {
-        _ASSERTE(iColorCount == 0);
-        const UINT32 v = (c.rgbRed << 16) | (c.rgbGreen << 8) | (c.rgbBlue << 0);
-        UINT32* p = reinterpret_cast<UINT32*>(GetColourPtr(x, y));
-        *p = (*p & 0xFF000000) | v;
-        break;
+        const int bit = x * bits;
+        pDst[x] = static_cast<BYTE>((pRow[bit / 8] >> (8 - bits - bit % 8)) & max);
     }
+}
 
-    case 32:
+void IconImage::PutIndexRow(int y, const BYTE* pSrc) const
+{
+    _ASSERTE(IsIndexed());
+    BYTE* pRow = GetRowXOR(y);
+    const int bits = format.GetBitCount();
+    const int max = (1 << bits) - 1;
+    for (int x = 0; x < biWidth; ++x)
     {
-        _ASSERTE(iColorCount == 0);
-        const UINT32 v = (c.rgbReserved << 24) | (c.rgbRed << 16) | (c.rgbGreen << 8) | (c.rgbBlue << 0);
-        *reinterpret_cast<UINT32*>(GetColourPtr(x, y)) = v;
-        break;
+        const int bit = x * bits;
+        const int shift = 8 - bits - bit % 8;
+        pRow[bit / 8] = static_cast<BYTE>((pRow[bit / 8] & ~(max << shift)) | ((pSrc[x] & max) << shift));
     }
+}
 
-    default:
-        throw Error(Format(TEXT("biBitCount %d not supported"), biBitCount));
-        break;
-    }
-    SetMask(x, y, c.rgbReserved == 0);
+Mask IconImage::GetMask() const
+{
+    Mask mask(biWidth, biHeight);
+    for (int y = 0; y < biHeight; ++y)
+        memcpy(mask.GetRow(y), GetRowAND(y), dwBytesPerLineAND);
+    mask.ClearPadding();
+    return mask;
+}
+
+void IconImage::PutMask(const Mask& mask) const
+{
+    _ASSERTE(mask.GetWidth() == biWidth && mask.GetHeight() == biHeight);
+    for (int y = 0; y < biHeight; ++y)
+        memcpy(GetRowAND(y), mask.GetRow(y), dwBytesPerLineAND);
 }
@@ -2,8 +2,12 @@
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #include <crtdbg.h>
+#include <algorithm>
+#include <vector>
 
 #include "IconFile.h"
+#include "Mask.h"
+#include "PixelFormat.h"
 
 inline bool GetBit(BYTE b, int i)
 {
@@ -24,7 +28,7 @@ public:
     LONG GetHeight() const { return biHeight; }
 
     RGBQUAD GetColour(int i) const { _ASSERTE(i >= 0 && i < iColorCount); return pColor[i]; }
-    int GetNearestColour(const RGBQUAD c) const;
+    int GetNearestColour(const RGBQUAD c) const { return format.GetNearestColour(c); }
 
     bool GetMask(int x, int y) const
     {
@@ -48,20 +52,141 @@ public:
 
     void PutColour(int x, int y, const RGBQUAD c) const;
 
+    // Decode a whole row with the mask applied, the bulk equivalent of GetColour
+    void GetRow(int y, RGBQUAD* pDst) const;
+    // Encode a whole row and its mask, the bulk equivalent of PutColour
+    void PutRow(int y, const RGBQUAD* pSrc) const;
+
+    // The whole AND mask, rows are copied as is
+    Mask GetMask() const;
+    void PutMask(const Mask& mask) const;
+
+    // 1, 4 and 8-bit entries store palette indices
+    bool IsIndexed() const { return format.GetBitCount() <= 8; }
+    void GetIndexRow(int y, BYTE* pDst) const;
+    void PutIndexRow(int y, const BYTE* pSrc) const;
+
+    // Runs f, a colour to colour transform as seen through GetColour/PutColour, once per palette index
+    // and mask state in use rather than once per pixel. Each index in use has its palette entry rewritten
+    // to its result, pixels whose result then differs (eg masked pixels sharing an index with visible ones)
+    // move to the nearest colour of the final palette. The AND mask follows the alpha of the result.
+    template <class F>
+    void TransformIndexed(F f) const
+    {
+        _ASSERTE(IsIndexed());
+        const int n = 1 << format.GetBitCount();
+        Mask mask = GetMask();
+        std::vector<BYTE> row(biWidth);
+
+        std::vector<BYTE> used(n, 0); // 1 visible, 2 masked
+        for (int y = 0; y < biHeight; ++y)
+        {
+            GetIndexRow(y, row.data());
+            for (int x = 0; x < biWidth; ++x)
+                used[row[x]] |= mask.Get(x, y) ? 2 : 1;
+        }
+
+        // [index * 2 + masked]
+        std::vector<RGBQUAD> result(2 * n);
+        std::vector<BYTE> remap(2 * n);
+        for (int i = 0; i < n; ++i)
+        {
+            for (int m = 0; m < 2; ++m)
+            {
+                if (used[i] & (1 << m))
+                {
+                    RGBQUAD c = i < iColorCount ? pColor[i] : RGBQUAD();
+                    c.rgbReserved = m ? 0 : 255;
+                    result[2 * i + m] = f(c);
+                    remap[2 * i + m] = static_cast<BYTE>(i);
+                }
+            }
+        }
+
+        // The final palette first: an index in use takes its visible result (or its masked one when
+        // only masked pixels use it), unused entries stay as they are
+        std::vector<RGBQUAD> palette(pColor, pColor + iColorCount);
+        bool bRemap = false;
+        for (int i = 0; i < n; ++i)
+        {
+            if (used[i] == 0)
+                continue;
+            if (i >= iColorCount)
+            {
+                bRemap = true;
+                continue;
+            }
+            const RGBQUAD& r = result[2 * i + (used[i] & 1 ? 0 : 1)];
+            palette[i].rgbRed = r.rgbRed;
+            palette[i].rgbGreen = r.rgbGreen;
+            palette[i].rgbBlue = r.rgbBlue;
+        }
+
+        // Then pixels whose result differs from their entry move to the nearest final colour,
+        // eg the masked ones of an index shared with visible pixels
+        auto same = [](const RGBQUAD& a, const RGBQUAD& b) { return a.rgbRed == b.rgbRed && a.rgbGreen == b.rgbGreen && a.rgbBlue == b.rgbBlue; };
+        for (int k = 0; k < 2 * n; ++k)
+        {
+            const int i = k / 2;
+            if (!(used[i] & (1 << (k % 2))) || (i < iColorCount && same(result[k], palette[i])))
+                continue;
+            bRemap = true;
+            int nearest = 0;
+            for (int j = 1; j < iColorCount; ++j)
+                if (ColourDistanceSq(palette[j], result[k]) < ColourDistanceSq(palette[nearest], result[k]))
+                    nearest = j;
+            remap[k] = static_cast<BYTE>(nearest);
+        }
+
+        std::copy(palette.begin(), palette.end(), pColor);
+
+        bool bMaskChanges = false;
+        for (int k = 0; k < 2 * n; ++k)
+            if (used[k / 2] & (1 << (k % 2)))
+                bMaskChanges |= (result[k].rgbReserved == 0) != (k % 2 == 1);
+        if (!bRemap && !bMaskChanges)
+            return;
+
+        bool bMaskChanged = false;
+        for (int y = 0; y < biHeight; ++y)
+        {
+            GetIndexRow(y, row.data());
+            for (int x = 0; x < biWidth; ++x)
+            {
+                const bool m = mask.Get(x, y);
+                const int k = 2 * row[x] + (m ? 1 : 0);
+                const bool bMask = result[k].rgbReserved == 0;
+                if (bMask != m)
+                {
+                    mask.Set(x, y, bMask);
+                    bMaskChanged = true;
+                }
+                row[x] = remap[k];
+            }
+            if (bRemap)
+                PutIndexRow(y, row.data());
+        }
+        if (bMaskChanged)
+            PutMask(mask);
+    }
+
 private:
-    LPVOID GetColourPtr(int x, int y) const
+    BYTE* GetRowXOR(int y) const
     {
-        _ASSERTE(x >= 0 && x < GetWidth());
         _ASSERTE(y >= 0 && y < GetHeight());
+        return pXOR + (biHeight - y - 1) * dwBytesPerLineXOR;
+    }
 
-        const int o = (biHeight - y - 1) * dwBytesPerLineXOR + x * biBitCount / 8;
-        return pXOR + o;
+    BYTE* GetRowAND(int y) const
+    {
+        _ASSERTE(y >= 0 && y < GetHeight());
+        return pAND + (biHeight - y - 1) * dwBytesPerLineAND;
     }
 
     LONG biWidth;
     LONG biHeight;
-    WORD biBitCount;
     int iColorCount;
+    PixelFormat format;
 
     DWORD dwBytesPerLineXOR;
     DWORD dwBytesPerLineAND;
@@ -0,0 +1,197 @@
+#include "IconOps.h"
+
+#include "Bitmap.h"
+#include "Blend.h"
+#include "IconImage.h"
+#include "Job.h"
+#include "Parallel.h"
+#include "Png.h"
+#include "Utils.h"
+#include <algorithm>
+
+std::pmr::vector<IconFile::Entry>::const_iterator FindImage(const IconFile& IconData, BYTE bWidth, BYTE bHeight, WORD wBitCount)
+{
+    for (auto it = IconData.entry.begin(); it != IconData.entry.end(); ++it)
+    {
+        if (it->dir.bWidth == bWidth && it->dir.bWidth == bHeight && it->dir.wBitCount == wBitCount)
+            return it;
+    }
+    return IconData.entry.end();
+}
+
+RGBQUAD AlphaBlend(const RGBQUAD fg, const RGBQUAD bg)
+{
+    BlendMode mode;
+    mode.space = SPACE_STRAIGHT;
+    return Blend(fg, bg, mode);
+}
+
+void AlphaBlendImages(IconFile& IconDataDest, const IconFile& IconDataSrc, const BlendMode& mode)
+{
+    for (IconFile::Entry& entry : IconDataDest.entry)
+    {
+        if (!entry.IsPNG())
+        {
+            const auto s = FindImage(IconDataSrc, entry.dir.bWidth, entry.dir.bWidth, entry.dir.wBitCount);
+            if (s != IconDataSrc.entry.end())
+            {
+                const IconImage src(*s);
+                const IconImage dest(entry);
+                if (src.GetWidth() != dest.GetWidth() || src.GetHeight() != dest.GetHeight())
+                    continue;
+
+                std::vector<RGBQUAD> srcrow(dest.GetWidth());
+                std::vector<RGBQUAD> destrow(dest.GetWidth());
+                for (int y = 0; y < dest.GetHeight(); ++y)
+                {
+                    src.GetRow(y, srcrow.data());
+                    dest.GetRow(y, destrow.data());
+                    BlendRow(srcrow.data(), destrow.data(), dest.GetWidth(), mode);
+                    dest.PutRow(y, destrow.data());
+                }
+            }
+        }
+    }
+}
+
+void GrayscaleToAlpha(IconFile& IconData)
+{
+    auto toalpha = [](RGBQUAD c)
+    {
+        if (c.rgbRed != c.rgbGreen || c.rgbRed != c.rgbBlue) throw Error(TEXT("Not grayscale"));
+        c.rgbReserved = 255 - c.rgbRed;
+        c.rgbRed = 0;
+        c.rgbGreen = 0;
+        c.rgbBlue = 0;
+        return c;
+    };
+
+    for (IconFile::Entry& entry : IconData.entry)
+    {
+        JobCheck();
+        if (!entry.IsPNG())
+        {
+            IconImage dest(entry);
+            if (dest.IsIndexed())
+            {
+                dest.TransformIndexed(toalpha);
+                continue;
+            }
+            for (int y = 0; y < dest.GetHeight(); ++y)
+            {
+                for (int x = 0; x < dest.GetWidth(); ++x)
+                    dest.PutColour(x, y, toalpha(dest.GetColour(x, y)));
+            }
+        }
+    }
+}
+
+void Recolor(IconFile::Entry& entry, const RGBQUAD srccolor, const RGBQUAD dstcolor)
+{
+    auto matches = [srccolor](const RGBQUAD c)
+    {
+        return c.rgbReserved != 0 && c.rgbRed == srccolor.rgbRed && c.rgbGreen == srccolor.rgbGreen && c.rgbBlue == srccolor.rgbBlue;
+    };
+    auto recolor = [dstcolor](RGBQUAD c)
+    {
+        c.rgbRed = dstcolor.rgbRed;
+        c.rgbGreen = dstcolor.rgbGreen;
+        c.rgbBlue = dstcolor.rgbBlue;
+        return c;
+    };
+
+    IconImage dest(entry);
+    if (dest.IsIndexed())
+    {
+        dest.TransformIndexed([&](const RGBQUAD c) { return matches(c) ? recolor(c) : c; });
+        return;
+    }
+    for (int y = 0; y < dest.GetHeight(); ++y)
+    {
+        for (int x = 0; x < dest.GetWidth(); ++x)
+        {
+            const RGBQUAD c = dest.GetColour(x, y);
+            if (matches(c))
+                dest.PutColour(x, y, recolor(c));
+        }
+    }
+}
+
+void RecolorImages(IconFile& IconData, const ColourMap& map, unsigned int nThreads)
+{
+    ParallelFor(IconData.entry.size(), [&IconData, &map](size_t i)
+        {
+            JobCheck();
+            map.Apply(IconData.entry[i]);
+        }, nThreads);
+    IconData.UpdateOffsets();
+}
+
+void ResizeImages(IconFile& IconData, const std::vector<int>& sizes)
+{
+    // Resample from the largest entry
+    const auto src = std::max_element(IconData.entry.begin(), IconData.entry.end(), [](const IconFile::Entry& a, const IconFile::Entry& b)
+        {
+            return a.GetWidth() * a.GetHeight() < b.GetWidth() * b.GetHeight();
+        });
+    if (src == IconData.entry.end())
+        return;
+
+    const Bitmap bitmap = Decode(*src);
+    const int hotspotx = src->GetHotspotX();
+    const int hotspoty = src->GetHotspotY();
+
+    std::pmr::vector<IconFile::Entry> entry(IconData.entry.get_allocator());
+    for (const int size : sizes)
+    {
+        entry.push_back(EncodeEntry(Resize(bitmap, size, size), entry.get_allocator()));
+        if (IconData.GetType() == TYPE_CURSOR)
+        {
+            const int x = (hotspotx * size + bitmap.GetWidth() / 2) / bitmap.GetWidth();
+            const int y = (hotspoty * size + bitmap.GetHeight() / 2) / bitmap.GetHeight();
+            entry.back().SetHotspot(static_cast<WORD>((std::min)(x, size - 1)), static_cast<WORD>((std::min)(y, size - 1)));
+        }
+    }
+    IconData.entry = std::move(entry);
+    IconData.UpdateOffsets();
+}
+
+void OptimizeImages(IconFile& IconData, const OptimizeOptions& options, unsigned int nThreads)
+{
+    ParallelFor(IconData.entry.size(), [&IconData, &options](size_t i)
+        {
+            JobCheck();
+            IconFile::Entry& entry = IconData.entry[i];
+            std::vector<BYTE> png;
+            if (!entry.IsPNG())
+            {
+                // Lower depths stay BMP, as PNG they would become 32-bit entries and change which one Windows picks
+                if (entry.GetWidth() < options.minsize || !entry.IsInBounds() || entry.GetBITMAPINFOHEADER()->biBitCount != 32)
+                    return;
+                png = EncodePng(Decode(entry), options.effort);
+            }
+            else
+            {
+                // IHDR bit depth, 16-bit PNGs would lose precision through the 8-bit Bitmap
+                if (!options.bRecompress || entry.GetDataSize() < 33 || entry.GetData()[24] > 8)
+                    return;
+                png = EncodePng(DecodePng(entry.GetData(), entry.GetDataSize()), options.effort);
+            }
+
+            if (png.size() >= entry.GetDataSize())
+                return;
+
+            if (!entry.IsPNG())
+            {
+                entry.dir.bColorCount = 0;
+                if (IconData.GetType() != TYPE_CURSOR)
+                {
+                    entry.dir.wPlanes = 1;
+                    entry.dir.wBitCount = 32;
+                }
+            }
+            entry.SetDataSize(static_cast<DWORD>(png.size()));
+            memcpy(entry.GetData(), png.data(), png.size());
+        }, nThreads);
+    IconData.UpdateOffsets();
+}
@@ -0,0 +1,35 @@
+#pragma once
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <vector>
+
+#include "Blend.h"
+#include "ColourMap.h"
+#include "IconFile.h"
+
+// Image operations on an IconFile, no global state so they are safe to run on different icons in parallel
+
+std::pmr::vector<IconFile::Entry>::const_iterator FindImage(const IconFile& IconData, BYTE bWidth, BYTE bHeight, WORD wBitCount);
+// Straight src over, see Blend for the other modes
+RGBQUAD AlphaBlend(const RGBQUAD fg, const RGBQUAD bg);
+
+// Blend each src entry onto the dest entry of the same size and bit count
+void AlphaBlendImages(IconFile& IconDataDest, const IconFile& IconDataSrc, const BlendMode& mode = {});
+void GrayscaleToAlpha(IconFile& IconData);
+// Replace srccolor with dstcolor on the visible pixels
+void Recolor(IconFile::Entry& entry, const RGBQUAD srccolor, const RGBQUAD dstcolor);
+// Apply the map to every entry on nThreads threads
+void RecolorImages(IconFile& IconData, const ColourMap& map, unsigned int nThreads);
+// Resample the largest entry to each size, cursor hotspots are scaled
+void ResizeImages(IconFile& IconData, const std::vector<int>& sizes);
+
+struct OptimizeOptions
+{
+    int minsize = 256;          // 32-bit BMP entries at least this wide are stored as PNG
+    bool bRecompress = false;   // re-encode existing PNG entries too
+    int effort = 9;             // deflate effort, see EncodePng
+};
+
+// Store entries as PNG where that is smaller, each entry is only replaced if the result is smaller.
+// Entries are compressed on nThreads threads, the output depends only on the input and options.
+void OptimizeImages(IconFile& IconData, const OptimizeOptions& options, unsigned int nThreads);
@@ -0,0 +1,120 @@
+#include "Job.h"
+
+#include "Utils.h"
+
+namespace
+{
+    thread_local JobFile* g_pCurrent = nullptr;
+    std::atomic<JobControl*> g_pCtrlC(nullptr);
+
+    BOOL WINAPI CtrlHandler(DWORD dwCtrlType)
+    {
+        if (dwCtrlType != CTRL_C_EVENT && dwCtrlType != CTRL_BREAK_EVENT)
+            return FALSE;
+        JobControl* pJob = g_pCtrlC;
+        if (pJob == nullptr || pJob->IsCancelled())
+            return FALSE;
+        pJob->Cancel();
+        return TRUE;
+    }
+}
+
+JobControl::JobControl(size_t total, const JobLimits& limits, JobProgressCallback progress)
+    : limits(limits), progress(std::move(progress)), bCancelled(false), bCtrlC(false)
+{
+    state.total = total;
+}
+
+JobControl::~JobControl()
+{
+    if (bCtrlC)
+    {
+        SetConsoleCtrlHandler(CtrlHandler, FALSE);
+        g_pCtrlC = nullptr;
+    }
+}
+
+void JobControl::CancelOnCtrlC()
+{
+    JobControl* pExpected = nullptr;
+    if (!g_pCtrlC.compare_exchange_strong(pExpected, this))
+        throw Error(TEXT("Ctrl+C already taken by another job"));
+    bCtrlC = true;
+    CHECK(SetConsoleCtrlHandler(CtrlHandler, TRUE));
+}
+
+JobProgress JobControl::GetProgress() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return state;
+}
+
+void JobControl::FileDone(ULONGLONG bytes, ULONGLONG pixels, bool bFailed)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    ++state.files;
+    if (bFailed)
+        ++state.failed;
+    state.bytes += bytes;
+    state.pixels += pixels;
+    if (progress)
+        progress(state);
+}
+
+void JobControl::WriteFailed()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    ++state.failed;
+    if (progress)
+        progress(state);
+}
+
+JobFile::JobFile(JobControl* pJob, ULONGLONG bytes)
+    : pJob(pJob), pPrevious(g_pCurrent), start(GetTickCount64()), bytes(bytes), allocated(0), pixels(0), bDone(false)
+{
+    g_pCurrent = this;
+}
+
+JobFile::~JobFile()
+{
+    g_pCurrent = pPrevious;
+    if (pJob != nullptr)
+        pJob->FileDone(bytes, pixels, !bDone);
+}
+
+void JobFile::Check() const
+{
+    if (pJob == nullptr)
+        return;
+    if (pJob->IsCancelled())
+        throw Error(TEXT("Cancelled"));
+    const ULONGLONG maxMilliseconds = pJob->GetLimits().maxMilliseconds;
+    if (maxMilliseconds > 0 && GetTickCount64() - start > maxMilliseconds)
+        throw Error(TEXT("Time limit exceeded"));
+}
+
+void JobFile::Allocate(ULONGLONG bytes)
+{
+    const ULONGLONG total = allocated += bytes;
+    if (pJob == nullptr)
+        return;
+    const ULONGLONG maxBytes = pJob->GetLimits().maxBytes;
+    if (maxBytes > 0 && (total > maxBytes || bytes > maxBytes))
+        throw Error(TEXT("Memory limit exceeded"));
+}
+
+JobFile* JobFile::Current()
+{
+    return g_pCurrent;
+}
+
+JobFile::Attach::Attach(JobFile* pFile)
+    : pPrevious(g_pCurrent)
+{
+    g_pCurrent = pFile;
+}
+
+JobFile::Attach::~Attach()
+{
+    g_pCurrent = pPrevious;
+}
@@ -0,0 +1,127 @@
+#pragma once
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <atomic>
+#include <functional>
+#include <mutex>
+
+struct JobLimits
+{
+    ULONGLONG maxBytes = 0;         // per file: entry data and decoded images, 0 for no limit
+    ULONGLONG maxMilliseconds = 0;  // per file, 0 for no limit
+};
+
+struct JobProgress
+{
+    size_t total = 0;
+    size_t files = 0;       // finished, including the failed ones
+    size_t failed = 0;
+    ULONGLONG bytes = 0;    // input size of the finished files
+    ULONGLONG pixels = 0;   // decoded
+};
+
+typedef std::function<void(const JobProgress&)> JobProgressCallback;
+
+// Progress, cancellation and per file budgets of a job over many files.
+// The work on each file runs in a JobFile scope, the code under it calls JobCheck between entries
+// and row bands and JobAllocate before large allocations. Both do nothing outside a job.
+class JobControl
+{
+public:
+    explicit JobControl(size_t total, const JobLimits& limits = {}, JobProgressCallback progress = nullptr);
+    ~JobControl();
+
+    JobControl(const JobControl&) = delete;
+    JobControl& operator=(const JobControl&) = delete;
+
+    // Ctrl+C and Ctrl+Break cancel this job instead of ending the process, pressing again ends it.
+    // One job at a time, until it is destroyed.
+    void CancelOnCtrlC();
+
+    void Cancel() { bCancelled = true; }
+    bool IsCancelled() const { return bCancelled; }
+
+    const JobLimits& GetLimits() const { return limits; }
+    JobProgress GetProgress() const;
+
+    // A file ended without a JobFile, eg it could not be read
+    void FileFailed() { FileDone(0, 0, true); }
+    // A file already counted as done whose output then could not be written
+    void WriteFailed();
+
+private:
+    friend class JobFile;
+    void FileDone(ULONGLONG bytes, ULONGLONG pixels, bool bFailed);
+
+    const JobLimits limits;
+    const JobProgressCallback progress;
+    std::atomic<bool> bCancelled;
+    mutable std::mutex mutex;       // progress is reported in order
+    JobProgress state;
+    bool bCtrlC;
+};
+
+// The budget of the file being worked on by this thread, ParallelFor hands it on to its workers
+class JobFile
+{
+public:
+    // No job is allowed, the scope then only counts
+    JobFile(JobControl* pJob, ULONGLONG bytes);
+    // Reported as failed unless Done was called
+    ~JobFile();
+
+    JobFile(const JobFile&) = delete;
+    JobFile& operator=(const JobFile&) = delete;
+
+    void Done() { bDone = true; }
+
+    // Throws once the job is cancelled or the file is out of time
+    void Check() const;
+    // Throws when bytes more would go over the memory budget. Allocations are never given back,
+    // so this bounds the peak of the file from above.
+    void Allocate(ULONGLONG bytes);
+    void AddPixels(ULONGLONG count) { pixels += count; }
+
+    static JobFile* Current();
+
+    // Runs the current thread under another thread's file
+    class Attach
+    {
+    public:
+        explicit Attach(JobFile* pFile);
+        ~Attach();
+
+        Attach(const Attach&) = delete;
+        Attach& operator=(const Attach&) = delete;
+
+    private:
+        JobFile* const pPrevious;
+    };
+
+private:
+    JobControl* const pJob;
+    JobFile* const pPrevious;
+    const ULONGLONG start;
+    const ULONGLONG bytes;
+    std::atomic<ULONGLONG> allocated;
+    std::atomic<ULONGLONG> pixels;
+    bool bDone;
+};
+
+inline void JobCheck()
+{
+    if (const JobFile* pFile = JobFile::Current())
+        pFile->Check();
+}
+
+inline void JobAllocate(ULONGLONG bytes)
+{
+    if (JobFile* pFile = JobFile::Current())
+        pFile->Allocate(bytes);
+}
+
+inline void JobPixels(ULONGLONG count)
+{
+    if (JobFile* pFile = JobFile::Current())
+        pFile->AddPixels(count);
+}
@@ -0,0 +1,187 @@
+#include "Mask.h"
+
+#include "Bitmap.h"
+#include "Utils.h"
+#include <stdlib.h>
+#include <algorithm>
+#if defined(_M_IX86) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+    // Mask words are loaded little endian, swapping the bytes puts pixel 0 in the top bit and
+    // the next pixel always in the next bit down so whole rows shift. Swapping back undoes it.
+    DWORD ToPixelOrder(DWORD w) { return _byteswap_ulong(w); }
+    DWORD FromPixelOrder(DWORD w) { return _byteswap_ulong(w); }
+
+    BYTE PackByte(const RGBQUAD* p, int n)
+    {
+        BYTE b = 0;
+        for (int i = 0; i < n; ++i)
+            b |= (p[i].rgbReserved == 0 ? 0x80 : 0) >> i;
+        return b;
+    }
+
+#if defined(_M_IX86) || defined(_M_X64)
+    // movemask gives pixel 0 in the lowest bit, the mask wants it in the highest
+    struct ReverseBits
+    {
+        BYTE v[256];
+        ReverseBits()
+        {
+            for (int i = 0; i < 256; ++i)
+            {
+                BYTE r = 0;
+                for (int b = 0; b < 8; ++b)
+                    r |= ((i >> b) & 1) << (7 - b);
+                v[i] = r;
+            }
+        }
+    };
+#endif
+}
+
+void AlphaToMaskRow(const RGBQUAD* pSrc, int count, BYTE* pMask)
+{
+    int x = 0;
+#if defined(_M_IX86) || defined(_M_X64)
+    // 16 pixels at a time: isolate alpha, compare to 0, narrow to bytes and take the sign bits
+    static const ReverseBits reverse;
+    const __m128i zero = _mm_setzero_si128();
+    for (; x + 16 <= count; x += 16)
+    {
+        const __m128i* p = reinterpret_cast<const __m128i*>(pSrc + x);
+        const __m128i a0 = _mm_cmpeq_epi32(_mm_srli_epi32(_mm_loadu_si128(p + 0), 24), zero);
+        const __m128i a1 = _mm_cmpeq_epi32(_mm_srli_epi32(_mm_loadu_si128(p + 1), 24), zero);
+        const __m128i a2 = _mm_cmpeq_epi32(_mm_srli_epi32(_mm_loadu_si128(p + 2), 24), zero);
+        const __m128i a3 = _mm_cmpeq_epi32(_mm_srli_epi32(_mm_loadu_si128(p + 3), 24), zero);
+        const int bits = _mm_movemask_epi8(_mm_packs_epi16(_mm_packs_epi32(a0, a1), _mm_packs_epi32(a2, a3)));
+        pMask[x / 8] = reverse.v[bits & 0xFF];
+        pMask[x / 8 + 1] = reverse.v[bits >> 8];
+    }
+#endif
+    for (; x < count; x += 8)
+        pMask[x / 8] = PackByte(pSrc + x, (std::min)(count - x, 8));
+}
+
+void ApplyMaskRow(const BYTE* pMask, int count, RGBQUAD* pDst)
+{
+    for (int x = 0; x < count; x += 8)
+    {
+        // Mostly opaque, skip 8 pixels on a clear byte
+        const BYTE b = pMask[x / 8];
+        if (b == 0)
+            continue;
+        const int n = (std::min)(count - x, 8);
+        for (int i = 0; i < n; ++i)
+        {
+            if (b & (0x80 >> i))
+                pDst[x + i].rgbReserved = 0;
+        }
+    }
+}
+
+Mask::Mask(LONG width, LONG height)
+    : width(width), height(height), stride((width + 31) / 32),
+    last(FromPixelOrder(width % 32 == 0 ? ~0u : ~0u << (32 - width % 32))),
+    words(static_cast<size_t>(stride) * height, 0)
+{
+}
+
+Mask Mask::FromAlpha(const Bitmap& bitmap)
+{
+    Mask mask(bitmap.GetWidth(), bitmap.GetHeight());
+    for (int y = 0; y < mask.height; ++y)
+        AlphaToMaskRow(bitmap.GetRow(y), mask.width, mask.GetRow(y));
+    mask.ClearPadding();
+    return mask;
+}
+
+void Mask::ApplyToAlpha(Bitmap& bitmap) const
+{
+    _ASSERTE(bitmap.GetWidth() == width && bitmap.GetHeight() == height);
+    for (int y = 0; y < height; ++y)
+        ApplyMaskRow(GetRow(y), width, bitmap.GetRow(y));
+}
+
+void Mask::ClearPadding()
+{
+    if (stride == 0)
+        return;
+    for (int y = 0; y < height; ++y)
+        words[static_cast<size_t>(y) * stride + stride - 1] &= last;
+}
+
+void Mask::Invert()
+{
+    for (DWORD& w : words)
+        w = ~w;
+    ClearPadding();
+}
+
+void Mask::Union(const Mask& other)
+{
+    if (other.width != width || other.height != height)
+        throw Error(TEXT("Mask size mismatch"));
+    for (size_t i = 0; i < words.size(); ++i)
+        words[i] |= other.words[i];
+}
+
+void Mask::Intersect(const Mask& other)
+{
+    if (other.width != width || other.height != height)
+        throw Error(TEXT("Mask size mismatch"));
+    for (size_t i = 0; i < words.size(); ++i)
+        words[i] &= other.words[i];
+}
+
+void Mask::Dilate()
+{
+    Morph(true);
+}
+
+void Mask::Erode()
+{
+    Morph(false);
+}
+
+// Horizontal then vertical 3 pixel OR (dilate) or AND (erode), outside the mask is the identity for the op
+void Mask::Morph(bool bDilate)
+{
+    const DWORD fill = bDilate ? 0 : ~0u;
+    const DWORD padding = ~ToPixelOrder(last);
+    auto op = [bDilate](DWORD a, DWORD b, DWORD c) { return bDilate ? a | b | c : a & b & c; };
+
+    std::vector<DWORD> h(words.size());
+    std::vector<DWORD> row(stride);
+    for (int y = 0; y < height; ++y)
+    {
+        const DWORD* pIn = words.data() + static_cast<size_t>(y) * stride;
+        DWORD* pOut = h.data() + static_cast<size_t>(y) * stride;
+        for (DWORD i = 0; i < stride; ++i)
+            row[i] = ToPixelOrder(pIn[i]);
+        if (stride > 0)
+            row[stride - 1] = (row[stride - 1] & ~padding) | (fill & padding);
+
+        for (DWORD i = 0; i < stride; ++i)
+        {
+            const DWORD prev = i > 0 ? row[i - 1] : fill;
+            const DWORD next = i + 1 < stride ? row[i + 1] : fill;
+            const DWORD left = (row[i] >> 1) | (prev << 31);
+            const DWORD right = (row[i] << 1) | (next >> 31);
+            pOut[i] = FromPixelOrder(op(row[i], left, right));
+        }
+    }
+
+    for (int y = 0; y < height; ++y)
+    {
+        const DWORD* pAbove = y > 0 ? h.data() + static_cast<size_t>(y - 1) * stride : nullptr;
+        const DWORD* pBelow = y + 1 < height ? h.data() + static_cast<size_t>(y + 1) * stride : nullptr;
+        const DWORD* pIn = h.data() + static_cast<size_t>(y) * stride;
+        DWORD* pOut = words.data() + static_cast<size_t>(y) * stride;
+        for (DWORD i = 0; i < stride; ++i)
+            pOut[i] = op(pIn[i], pAbove != nullptr ? pAbove[i] : fill, pBelow != nullptr ? pBelow[i] : fill);
+    }
+    ClearPadding();
+}
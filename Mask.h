@@ -0,0 +1,60 @@
+#pragma once
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <vector>
+
+class Bitmap;
+
+// AND mask rows are 1 bit per pixel, most significant bit first, a set bit is transparent.
+
+// Sets the bit of each pixel with alpha 0, whole bytes are written so pMask holds at least (count + 7) / 8
+void AlphaToMaskRow(const RGBQUAD* pSrc, int count, BYTE* pMask);
+// Zeroes the alpha of each pixel with its bit set
+void ApplyMaskRow(const BYTE* pMask, int count, RGBQUAD* pDst);
+
+// A top-down AND mask, each row is whole DWORDs laid out byte for byte as the icon AND mask
+// so rows copy straight across. Operations work a word (32 pixels) at a time, padding bits stay clear.
+class Mask
+{
+public:
+    Mask(LONG width, LONG height);
+
+    static Mask FromAlpha(const Bitmap& bitmap);
+    void ApplyToAlpha(Bitmap& bitmap) const;
+
+    LONG GetWidth() const { return width; }
+    LONG GetHeight() const { return height; }
+    DWORD GetBytesPerLine() const { return stride * sizeof(DWORD); }
+
+    BYTE* GetRow(int y) { return reinterpret_cast<BYTE*>(words.data() + static_cast<size_t>(y) * stride); }
+    const BYTE* GetRow(int y) const { return reinterpret_cast<const BYTE*>(words.data() + static_cast<size_t>(y) * stride); }
+
+    bool Get(int x, int y) const { return (GetRow(y)[x / 8] >> (7 - x % 8)) & 1; }
+    void Set(int x, int y, bool s)
+    {
+        BYTE& b = GetRow(y)[x / 8];
+        b = static_cast<BYTE>((b & ~(0x80 >> (x % 8))) | ((s ? 0x80 : 0) >> (x % 8)));
+    }
+
+    void Invert();
+    // Set where either is set
+    void Union(const Mask& other);
+    // Set where both are set
+    void Intersect(const Mask& other);
+    // Grow or shrink the set pixels by one in all 8 directions, pixels outside the mask don't affect the edges.
+    // On the inverted mask these grow or shrink the opaque area, eg for an outline.
+    void Dilate();
+    void Erode();
+
+    // After the rows are written directly
+    void ClearPadding();
+
+private:
+    void Morph(bool bDilate);
+
+    LONG width;
+    LONG height;
+    DWORD stride;   // DWORDs per row
+    DWORD last;     // valid bits of the last word in each row
+    std::vector<DWORD> words;
+};
@@ -0,0 +1,67 @@
+#pragma once
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Job.h"
+
+inline unsigned int GetThreadCount()
+{
+    const unsigned int n = std::thread::hardware_concurrency();
+    return n > 0 ? n : 1;
+}
+
+// Calls f(i) for every i in [0, count) spread over nThreads threads.
+// The first exception thrown stops the remaining work and is rethrown on the calling thread.
+// The workers run under the caller's JobFile, so its budget and cancellation reach them.
+template <class F>
+void ParallelFor(size_t count, F f, unsigned int nThreads = GetThreadCount())
+{
+    if (nThreads > count)
+        nThreads = static_cast<unsigned int>(count);
+
+    if (nThreads <= 1)
+    {
+        for (size_t i = 0; i < count; ++i)
+            f(i);
+        return;
+    }
+
+    JobFile* const pFile = JobFile::Current();
+    std::atomic<size_t> next(0);
+    std::exception_ptr error;
+    std::mutex errorlock;
+
+    auto worker = [&]()
+    {
+        const JobFile::Attach attach(pFile);
+        size_t i;
+        while ((i = next++) < count)
+        {
+            try
+            {
+                f(i);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(errorlock);
+                if (!error)
+                    error = std::current_exception();
+                next = count;
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(nThreads - 1);
+    for (unsigned int t = 1; t < nThreads; ++t)
+        threads.emplace_back(worker);
+    worker();
+    for (std::thread& t : threads)
+        t.join();
+
+    if (error)
+        std::rethrow_exception(error);
+}
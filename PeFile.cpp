@@ -0,0 +1,557 @@
+#include "PeFile.h"
+
+#include "ResourceIndex.h"
+#include "Utils.h"
+#include <algorithm>
+#include <cstddef>
+#include <set>
+
+namespace
+{
+    DWORD Align(DWORD v, DWORD a)
+    {
+        return a == 0 ? v : (v + a - 1) / a * a;
+    }
+
+    // Fields up to SizeOfStackReserve sit at the same offsets in PE32 and PE32+
+    IMAGE_OPTIONAL_HEADER32* GetOptionalHeader(BYTE* pNtHeaders)
+    {
+        return reinterpret_cast<IMAGE_OPTIONAL_HEADER32*>(pNtHeaders + sizeof(DWORD) + sizeof(IMAGE_FILE_HEADER));
+    }
+
+    size_t RvaToOffset(const IMAGE_SECTION_HEADER* sections, WORD nSections, DWORD rva)
+    {
+        for (WORD i = 0; i < nSections; ++i)
+        {
+            const IMAGE_SECTION_HEADER& s = sections[i];
+            const DWORD size = (std::max)(s.Misc.VirtualSize, s.SizeOfRawData);
+            if (rva >= s.VirtualAddress && rva - s.VirtualAddress < size)
+                return rva - s.VirtualAddress + s.PointerToRawData;
+        }
+        throw Error(TEXT("Invalid PE"));
+    }
+
+    DWORD PeChecksum(const std::vector<BYTE>& file, size_t dwChecksumOffset)
+    {
+        DWORD sum = 0;
+        for (size_t i = 0; i < file.size(); i += 2)
+        {
+            if (i == dwChecksumOffset || i == dwChecksumOffset + 2)
+                continue;
+            sum += file[i] | (i + 1 < file.size() ? file[i + 1] << 8 : 0);
+            sum = (sum & 0xFFFF) + (sum >> 16);
+        }
+        sum = (sum & 0xFFFF) + (sum >> 16);
+        return sum + static_cast<DWORD>(file.size());
+    }
+
+    std::vector<WORD> GetGroupIconIds(const std::vector<BYTE>& data)
+    {
+        std::vector<WORD> ids;
+        if (data.size() < sizeof(ICONHEADER))
+            return ids;
+        const ICONHEADER* pIconHeader = reinterpret_cast<const ICONHEADER*>(data.data());
+        const size_t count = (std::min)(size_t(pIconHeader->idCount), (data.size() - sizeof(ICONHEADER)) / sizeof(ICONDIRRES));
+        const ICONDIRRES* pIconDirResArray = reinterpret_cast<const ICONDIRRES*>(pIconHeader + 1);
+        for (size_t i = 0; i < count; ++i)
+            ids.push_back(pIconDirResArray[i].nId);
+        return ids;
+    }
+
+    class ResourceWriter
+    {
+    public:
+        ResourceWriter(const ResourceTree& resources, DWORD dwRva)
+            : dwRva(dwRva), nextdir(0), nextstring(0), nextentry(0), nextdata(0)
+        {
+            DWORD dirsize = DirSize(resources.size());
+            DWORD stringsize = StringSize(resources);
+            DWORD leaves = 0;
+            for (const auto& type : resources)
+            {
+                dirsize += DirSize(type.second.size());
+                stringsize += StringSize(type.second);
+                for (const auto& name : type.second)
+                {
+                    dirsize += DirSize(name.second.size());
+                    leaves += static_cast<DWORD>(name.second.size());
+                }
+            }
+
+            nextstring = dirsize;
+            nextentry = Align(dirsize + stringsize, 4);
+            nextdata = Align(nextentry + leaves * sizeof(IMAGE_RESOURCE_DATA_ENTRY), 8);
+
+            DWORD size = nextdata;
+            for (const auto& type : resources)
+                for (const auto& name : type.second)
+                    for (const auto& lang : name.second)
+                        size += Align(static_cast<DWORD>(lang.second.data.size()), 8);
+            out.resize(size);
+
+            const DWORD root = AllocDir(resources.size());
+            WriteDir(root, resources, [this](const ResourceNames& names)
+                {
+                    const DWORD namedir = AllocDir(names.size());
+                    WriteDir(namedir, names, [this](const ResourceLangs& langs)
+                        {
+                            const DWORD langdir = AllocDir(langs.size());
+                            WriteLangs(langdir, langs);
+                            return langdir | IMAGE_RESOURCE_DATA_IS_DIRECTORY;
+                        });
+                    return namedir | IMAGE_RESOURCE_DATA_IS_DIRECTORY;
+                });
+        }
+
+        std::vector<BYTE>& GetData() { return out; }
+
+    private:
+        static DWORD DirSize(size_t entries)
+        {
+            return static_cast<DWORD>(sizeof(IMAGE_RESOURCE_DIRECTORY) + entries * sizeof(IMAGE_RESOURCE_DIRECTORY_ENTRY));
+        }
+
+        template <class Map>
+        static DWORD StringSize(const Map& map)
+        {
+            DWORD size = 0;
+            for (const auto& it : map)
+                if (it.first.IsName())
+                    size += static_cast<DWORD>(sizeof(WORD) + it.first.GetName().size() * sizeof(WCHAR));
+            return size;
+        }
+
+        DWORD AllocDir(size_t entries)
+        {
+            const DWORD offset = nextdir;
+            nextdir += DirSize(entries);
+            return offset;
+        }
+
+        DWORD WriteName(const ResourceId& id)
+        {
+            if (!id.IsName())
+                return id.GetId();
+
+            const DWORD offset = nextstring;
+            const WORD len = static_cast<WORD>(id.GetName().size());
+            memcpy(out.data() + offset, &len, sizeof(WORD));
+            memcpy(out.data() + offset + sizeof(WORD), id.GetName().data(), len * sizeof(WCHAR));
+            nextstring += sizeof(WORD) + len * sizeof(WCHAR);
+            return offset | IMAGE_RESOURCE_NAME_IS_STRING;
+        }
+
+        IMAGE_RESOURCE_DIRECTORY_ENTRY* WriteDirHeader(DWORD offset, WORD named, WORD ids)
+        {
+            IMAGE_RESOURCE_DIRECTORY* dir = reinterpret_cast<IMAGE_RESOURCE_DIRECTORY*>(out.data() + offset);
+            dir->NumberOfNamedEntries = named;
+            dir->NumberOfIdEntries = ids;
+            return reinterpret_cast<IMAGE_RESOURCE_DIRECTORY_ENTRY*>(dir + 1);
+        }
+
+        template <class Map, class F>
+        void WriteDir(DWORD offset, const Map& map, F child)
+        {
+            const WORD named = static_cast<WORD>(std::count_if(map.begin(), map.end(), [](const auto& it) { return it.first.IsName(); }));
+            IMAGE_RESOURCE_DIRECTORY_ENTRY* entry = WriteDirHeader(offset, named, static_cast<WORD>(map.size() - named));
+            for (const auto& it : map)
+            {
+                const DWORD name = WriteName(it.first);
+                const DWORD data = child(it.second);
+                // out doesn't reallocate so entry stays valid
+                entry->Name = name;
+                entry->OffsetToData = data;
+                ++entry;
+            }
+        }
+
+        void WriteLangs(DWORD offset, const ResourceLangs& langs)
+        {
+            IMAGE_RESOURCE_DIRECTORY_ENTRY* entry = WriteDirHeader(offset, 0, static_cast<WORD>(langs.size()));
+            for (const auto& it : langs)
+            {
+                const ResourceData& data = it.second;
+
+                IMAGE_RESOURCE_DATA_ENTRY* pDataEntry = reinterpret_cast<IMAGE_RESOURCE_DATA_ENTRY*>(out.data() + nextentry);
+                pDataEntry->OffsetToData = dwRva + nextdata;
+                pDataEntry->Size = static_cast<DWORD>(data.data.size());
+                pDataEntry->CodePage = data.dwCodePage;
+
+                memcpy(out.data() + nextdata, data.data.data(), data.data.size());
+
+                entry->Name = it.first;
+                entry->OffsetToData = nextentry;
+                ++entry;
+
+                nextentry += sizeof(IMAGE_RESOURCE_DATA_ENTRY);
+                nextdata += Align(static_cast<DWORD>(data.data.size()), 8);
+            }
+        }
+
+        const DWORD dwRva;
+        DWORD nextdir;
+        DWORD nextstring;
+        DWORD nextentry;
+        DWORD nextdata;
+        std::vector<BYTE> out;
+    };
+}
+
+std::vector<BYTE> BuildResourceSection(const ResourceTree& resources, DWORD dwRva)
+{
+    ResourceWriter writer(resources, dwRva);
+    return std::move(writer.GetData());
+}
+
+PeFile PeFile::Load(LPCTSTR lpFilename)
+{
+    const HANDLE hFile = CreateFile(lpFilename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    CHECK(hFile != INVALID_HANDLE_VALUE);
+
+    try
+    {
+        LARGE_INTEGER size;
+        CHECK(GetFileSizeEx(hFile, &size));
+        if (size.QuadPart > MAXDWORD)
+            throw Error(TEXT("Invalid PE"));
+
+        std::vector<BYTE> data(static_cast<size_t>(size.QuadPart));
+        CheckReadFile(hFile, data.data(), static_cast<DWORD>(data.size()));
+        CloseHandle(hFile);
+
+        return FromMemory(std::move(data));
+    }
+    catch (...)
+    {
+        CloseHandle(hFile);
+        throw;
+    }
+}
+
+PeFile PeFile::FromMemory(std::vector<BYTE> data)
+{
+    PeFile pe;
+    pe.file = std::move(data);
+
+    const IMAGE_DOS_HEADER* pDosHeader = pe.At<IMAGE_DOS_HEADER>(0);
+    if (pDosHeader->e_magic != IMAGE_DOS_SIGNATURE)
+        throw Error(TEXT("Invalid PE"));
+    pe.dwNtHeaders = pDosHeader->e_lfanew;
+    if (*pe.At<DWORD>(pe.dwNtHeaders) != IMAGE_NT_SIGNATURE)
+        throw Error(TEXT("Invalid PE"));
+
+    const IMAGE_FILE_HEADER* pFileHeader = pe.At<IMAGE_FILE_HEADER>(pe.dwNtHeaders + sizeof(DWORD));
+    const DWORD dwOptionalHeader = pe.dwNtHeaders + sizeof(DWORD) + sizeof(IMAGE_FILE_HEADER);
+    const WORD wMagic = *pe.At<WORD>(dwOptionalHeader);
+    if (wMagic == IMAGE_NT_OPTIONAL_HDR64_MAGIC)
+    {
+        pe.b64 = true;
+        if (pe.At<IMAGE_OPTIONAL_HEADER64>(dwOptionalHeader)->NumberOfRvaAndSizes < IMAGE_NUMBEROF_DIRECTORY_ENTRIES)
+            throw Error(TEXT("PE data directory too short"));
+        pe.dwDataDirectory = dwOptionalHeader + offsetof(IMAGE_OPTIONAL_HEADER64, DataDirectory);
+    }
+    else if (wMagic == IMAGE_NT_OPTIONAL_HDR32_MAGIC)
+    {
+        pe.b64 = false;
+        if (pe.At<IMAGE_OPTIONAL_HEADER32>(dwOptionalHeader)->NumberOfRvaAndSizes < IMAGE_NUMBEROF_DIRECTORY_ENTRIES)
+            throw Error(TEXT("PE data directory too short"));
+        pe.dwDataDirectory = dwOptionalHeader + offsetof(IMAGE_OPTIONAL_HEADER32, DataDirectory);
+    }
+    else
+        throw Error(TEXT("Invalid PE"));
+
+    pe.dwSections = dwOptionalHeader + pFileHeader->SizeOfOptionalHeader;
+    pe.nSections = pFileHeader->NumberOfSections;
+    pe.GetSections();
+
+    pe.ParseResources();
+    return pe;
+}
+
+size_t PeFile::RvaToOffset(DWORD rva) const
+{
+    return ::RvaToOffset(GetSections(), nSections, rva);
+}
+
+void PeFile::ParseResources()
+{
+    iRsrcSection = -1;
+
+    const IMAGE_DATA_DIRECTORY* pDataDirectory = At<IMAGE_DATA_DIRECTORY>(dwDataDirectory, IMAGE_NUMBEROF_DIRECTORY_ENTRIES);
+    const DWORD dwRsrcRva = pDataDirectory[IMAGE_DIRECTORY_ENTRY_RESOURCE].VirtualAddress;
+    if (dwRsrcRva == 0)
+        return;
+
+    const IMAGE_SECTION_HEADER* sections = GetSections();
+    for (WORD i = 0; i < nSections; ++i)
+    {
+        if (sections[i].VirtualAddress == dwRsrcRva)
+            iRsrcSection = i;
+    }
+    if (iRsrcSection < 0)
+        throw Error(TEXT("Resource directory is not at the start of a section"));
+
+    const size_t base = RvaToOffset(dwRsrcRva);
+
+    auto ReadDir = [this, base](DWORD offset, DWORD& count)
+    {
+        if (!(offset & IMAGE_RESOURCE_DATA_IS_DIRECTORY))
+            throw Error(TEXT("Invalid resource directory"));
+        offset &= ~IMAGE_RESOURCE_DATA_IS_DIRECTORY;
+        const IMAGE_RESOURCE_DIRECTORY* pDir = At<IMAGE_RESOURCE_DIRECTORY>(base + offset);
+        count = pDir->NumberOfNamedEntries + pDir->NumberOfIdEntries;
+        return At<IMAGE_RESOURCE_DIRECTORY_ENTRY>(base + offset + sizeof(IMAGE_RESOURCE_DIRECTORY), count);
+    };
+
+    auto ReadName = [this, base](DWORD name)
+    {
+        if (!(name & IMAGE_RESOURCE_NAME_IS_STRING))
+            return ResourceId(static_cast<WORD>(name));
+        const size_t offset = base + (name & ~IMAGE_RESOURCE_NAME_IS_STRING);
+        const WORD len = *At<WORD>(offset);
+        const WCHAR* str = At<WCHAR>(offset + sizeof(WORD), len);
+        return ResourceId(std::wstring(str, len));
+    };
+
+    DWORD nTypes = 0;
+    const IMAGE_RESOURCE_DIRECTORY_ENTRY* pTypes = ReadDir(IMAGE_RESOURCE_DATA_IS_DIRECTORY, nTypes);
+    for (DWORD t = 0; t < nTypes; ++t)
+    {
+        ResourceNames& names = resources[ReadName(pTypes[t].Name)];
+
+        DWORD nNames = 0;
+        const IMAGE_RESOURCE_DIRECTORY_ENTRY* pNames = ReadDir(pTypes[t].OffsetToData, nNames);
+        for (DWORD n = 0; n < nNames; ++n)
+        {
+            ResourceLangs& langs = names[ReadName(pNames[n].Name)];
+
+            DWORD nLangs = 0;
+            const IMAGE_RESOURCE_DIRECTORY_ENTRY* pLangs = ReadDir(pNames[n].OffsetToData, nLangs);
+            for (DWORD l = 0; l < nLangs; ++l)
+            {
+                if (pLangs[l].OffsetToData & IMAGE_RESOURCE_DATA_IS_DIRECTORY)
+                    throw Error(TEXT("Invalid resource directory"));
+                const IMAGE_RESOURCE_DATA_ENTRY* pDataEntry = At<IMAGE_RESOURCE_DATA_ENTRY>(base + pLangs[l].OffsetToData);
+                const BYTE* pData = At<BYTE>(RvaToOffset(pDataEntry->OffsetToData), pDataEntry->Size);
+
+                ResourceData& data = langs[static_cast<WORD>(pLangs[l].Name)];
+                data.data.assign(pData, pData + pDataEntry->Size);
+                data.dwCodePage = pDataEntry->CodePage;
+            }
+        }
+    }
+}
+
+void PeFile::ReplaceIconGroup(const ResourceId& group, LANGID lang, const IconFile& IconData)
+{
+    // A cursor's hotspot would land in wPlanes and wBitCount of the group
+    if (IconData.GetType() != TYPE_ICON)
+        throw Error(TEXT("Only icons can replace an icon group"));
+
+    ResourceNames& groups = resources[ResourceId(RT_GROUP_ICON)];
+    ResourceNames& icons = resources[ResourceId(RT_ICON)];
+
+    std::vector<WORD> freeids;
+
+    const auto itGroup = groups.find(group);
+    if (itGroup != groups.end() && !itGroup->second.empty())
+    {
+        std::vector<LANGID> available;
+        for (const auto& l : itGroup->second)
+            available.push_back(l.first);
+        lang = PickLanguage(available, lang);
+
+        std::set<WORD> shared;
+        for (const auto& other : groups)
+            for (const auto& l : other.second)
+                if (!(other.first == group && l.first == lang))
+                    for (const WORD id : GetGroupIconIds(l.second.data))
+                        shared.insert(id);
+
+        for (const WORD id : GetGroupIconIds(itGroup->second[lang].data))
+        {
+            if (shared.count(id) > 0)
+                continue;
+            const auto itIcon = icons.find(ResourceId(id));
+            if (itIcon != icons.end())
+            {
+                itIcon->second.erase(lang);
+                if (itIcon->second.empty())
+                    icons.erase(itIcon);
+            }
+            if (std::find(freeids.begin(), freeids.end(), id) == freeids.end())
+                freeids.push_back(id);
+        }
+        itGroup->second.erase(lang);
+    }
+
+    WORD nextid = 1;
+    for (const auto& icon : icons)
+        if (!icon.first.IsName() && icon.first.GetId() >= nextid)
+            nextid = icon.first.GetId() + 1;
+    std::reverse(freeids.begin(), freeids.end());
+
+    ResourceData& groupdata = groups[group][lang];
+    groupdata.dwCodePage = 0;
+    groupdata.data.resize(sizeof(ICONHEADER) + IconData.entry.size() * sizeof(ICONDIRRES));
+
+    ICONHEADER* pIconHeader = reinterpret_cast<ICONHEADER*>(groupdata.data.data());
+    pIconHeader->idReserved = 0;
+    pIconHeader->idType = TYPE_ICON;
+    pIconHeader->idCount = static_cast<WORD>(IconData.entry.size());
+
+    ICONDIRRES* pIconDirRes = reinterpret_cast<ICONDIRRES*>(pIconHeader + 1);
+    for (const IconFile::Entry& entry : IconData.entry)
+    {
+        WORD id;
+        if (!freeids.empty())
+        {
+            id = freeids.back();
+            freeids.pop_back();
+        }
+        else
+            id = nextid++;
+
+        // Resource ICONDIR is one WORD shorter than file ICONDIR
+        memcpy(pIconDirRes, &entry.dir, sizeof(ICONDIRRES) - sizeof(WORD));
+        pIconDirRes->nId = id;
+        ++pIconDirRes;
+
+        ResourceData& icondata = icons[ResourceId(id)][lang];
+        icondata.dwCodePage = 0;
+        icondata.data.assign(entry.GetData(), entry.GetData() + entry.GetDataSize());
+    }
+}
+
+std::vector<BYTE> PeFile::SaveToMemory() const
+{
+    if (iRsrcSection < 0)
+        throw Error(TEXT("No resource section"));
+
+    const IMAGE_SECTION_HEADER* sections = GetSections();
+    const IMAGE_SECTION_HEADER& rsrc = sections[iRsrcSection];
+    const IMAGE_OPTIONAL_HEADER32* pOptionalHeader = GetOptionalHeader(const_cast<BYTE*>(At<BYTE>(dwNtHeaders, sizeof(IMAGE_NT_HEADERS32))));
+    const DWORD dwFileAlignment = pOptionalHeader->FileAlignment;
+    const DWORD dwSectionAlignment = pOptionalHeader->SectionAlignment;
+
+    const std::vector<BYTE> rsrcdata = BuildResourceSection(resources, rsrc.VirtualAddress);
+    const DWORD dwRsrcSize = static_cast<DWORD>(rsrcdata.size());
+    const DWORD dwRawSize = Align(dwRsrcSize, dwFileAlignment);
+    const DWORD dwOldRawEnd = rsrc.PointerToRawData + rsrc.SizeOfRawData;
+    const DWORD dwRawDelta = dwRawSize - rsrc.SizeOfRawData; // may wrap, used modulo 2^32
+
+    // If .rsrc outgrows the gap before the next section that section has to move up.
+    // Only .reloc can move, nothing refers to addresses inside it.
+    DWORD dwVirtualDelta = 0;
+    {
+        DWORD dwNextVA = MAXDWORD;
+        for (WORD i = 0; i < nSections; ++i)
+            if (sections[i].VirtualAddress > rsrc.VirtualAddress)
+                dwNextVA = (std::min)(dwNextVA, sections[i].VirtualAddress);
+
+        const DWORD dwNewVirtualEnd = rsrc.VirtualAddress + Align(dwRsrcSize, dwSectionAlignment);
+        if (dwNextVA != MAXDWORD && dwNewVirtualEnd > dwNextVA)
+        {
+            for (WORD i = 0; i < nSections; ++i)
+                if (sections[i].VirtualAddress > rsrc.VirtualAddress && memcmp(sections[i].Name, ".reloc\0", 8) != 0)
+                    throw Error(TEXT("Resources do not fit and the sections after .rsrc can not be moved"));
+            dwVirtualDelta = dwNewVirtualEnd - dwNextVA;
+        }
+    }
+
+    const IMAGE_DATA_DIRECTORY& security = At<IMAGE_DATA_DIRECTORY>(dwDataDirectory, IMAGE_NUMBEROF_DIRECTORY_ENTRIES)[IMAGE_DIRECTORY_ENTRY_SECURITY];
+    const size_t dwCertBegin = security.VirtualAddress != 0 ? (std::max)(size_t(security.VirtualAddress), size_t(dwOldRawEnd)) : file.size();
+    const size_t dwCertEnd = security.VirtualAddress != 0 ? (std::max)(size_t(security.VirtualAddress) + security.Size, dwCertBegin) : file.size();
+    At<BYTE>(0, (std::max)(size_t(dwOldRawEnd), dwCertEnd));
+
+    std::vector<BYTE> out;
+    out.reserve(file.size() + dwRawSize);
+    out.insert(out.end(), file.begin(), file.begin() + rsrc.PointerToRawData);
+    out.insert(out.end(), rsrcdata.begin(), rsrcdata.end());
+    out.resize(rsrc.PointerToRawData + dwRawSize, 0);
+    out.insert(out.end(), file.begin() + dwOldRawEnd, file.begin() + dwCertBegin);
+    out.insert(out.end(), file.begin() + dwCertEnd, file.end());
+
+    BYTE* pNtHeaders = out.data() + dwNtHeaders;
+    IMAGE_FILE_HEADER* pFileHeader = reinterpret_cast<IMAGE_FILE_HEADER*>(pNtHeaders + sizeof(DWORD));
+    IMAGE_OPTIONAL_HEADER32* pNewOptionalHeader = GetOptionalHeader(pNtHeaders);
+    IMAGE_DATA_DIRECTORY* pDataDirectory = reinterpret_cast<IMAGE_DATA_DIRECTORY*>(out.data() + dwDataDirectory);
+    IMAGE_SECTION_HEADER* newsections = reinterpret_cast<IMAGE_SECTION_HEADER*>(out.data() + dwSections);
+
+    DWORD dwImageEnd = 0;
+    for (WORD i = 0; i < nSections; ++i)
+    {
+        IMAGE_SECTION_HEADER& s = newsections[i];
+        if (i == iRsrcSection)
+        {
+            s.Misc.VirtualSize = dwRsrcSize;
+            s.SizeOfRawData = dwRawSize;
+        }
+        else
+        {
+            if (s.PointerToRawData != 0 && s.PointerToRawData >= dwOldRawEnd)
+                s.PointerToRawData += dwRawDelta;
+            if (s.VirtualAddress > rsrc.VirtualAddress)
+                s.VirtualAddress += dwVirtualDelta;
+        }
+        dwImageEnd = (std::max)(dwImageEnd, s.VirtualAddress + (s.Misc.VirtualSize != 0 ? s.Misc.VirtualSize : s.SizeOfRawData));
+    }
+
+    if (pFileHeader->PointerToSymbolTable != 0 && pFileHeader->PointerToSymbolTable >= dwOldRawEnd)
+        pFileHeader->PointerToSymbolTable += dwRawDelta;
+
+    pNewOptionalHeader->SizeOfInitializedData += dwRawDelta;
+    pNewOptionalHeader->SizeOfImage = Align(dwImageEnd, dwSectionAlignment);
+
+    for (int d = 0; d < IMAGE_NUMBEROF_DIRECTORY_ENTRIES; ++d)
+    {
+        if (d != IMAGE_DIRECTORY_ENTRY_SECURITY && pDataDirectory[d].VirtualAddress > rsrc.VirtualAddress)
+            pDataDirectory[d].VirtualAddress += dwVirtualDelta;
+    }
+    pDataDirectory[IMAGE_DIRECTORY_ENTRY_RESOURCE].Size = dwRsrcSize;
+    pDataDirectory[IMAGE_DIRECTORY_ENTRY_SECURITY].VirtualAddress = 0;
+    pDataDirectory[IMAGE_DIRECTORY_ENTRY_SECURITY].Size = 0;
+
+    // Debug data is located by file offset as well as by address
+    const IMAGE_DATA_DIRECTORY& debug = pDataDirectory[IMAGE_DIRECTORY_ENTRY_DEBUG];
+    if (debug.VirtualAddress != 0)
+    {
+        const size_t offset = ::RvaToOffset(newsections, nSections, debug.VirtualAddress);
+        const size_t count = debug.Size / sizeof(IMAGE_DEBUG_DIRECTORY);
+        if (offset > out.size() || count * sizeof(IMAGE_DEBUG_DIRECTORY) > out.size() - offset)
+            throw Error(TEXT("Invalid PE"));
+        IMAGE_DEBUG_DIRECTORY* pDebug = reinterpret_cast<IMAGE_DEBUG_DIRECTORY*>(out.data() + offset);
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (pDebug[i].PointerToRawData != 0 && pDebug[i].PointerToRawData >= dwOldRawEnd)
+                pDebug[i].PointerToRawData += dwRawDelta;
+            if (pDebug[i].AddressOfRawData > rsrc.VirtualAddress)
+                pDebug[i].AddressOfRawData += dwVirtualDelta;
+        }
+    }
+
+    const size_t dwChecksum = dwNtHeaders + sizeof(DWORD) + sizeof(IMAGE_FILE_HEADER) + offsetof(IMAGE_OPTIONAL_HEADER32, CheckSum);
+    pNewOptionalHeader->CheckSum = 0;
+    pNewOptionalHeader->CheckSum = PeChecksum(out, dwChecksum);
+
+    return out;
+}
+
+void PeFile::Save(LPCTSTR lpFilename) const
+{
+    const std::vector<BYTE> out = SaveToMemory();
+
+    const HANDLE hFile = CreateFile(lpFilename, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    CHECK(hFile != INVALID_HANDLE_VALUE);
+
+    try
+    {
+        CheckWriteFile(hFile, out.data(), static_cast<DWORD>(out.size()));
+        CloseHandle(hFile);
+    }
+    catch (...)
+    {
+        CloseHandle(hFile);
+        throw;
+    }
+}
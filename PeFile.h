@@ -0,0 +1,106 @@
+#pragma once
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "IconFile.h"
+#include "Utils.h"
+
+// A resource type, name or language.
+// Named ids sort before numeric ones, the order the PE format requires.
+class ResourceId
+{
+public:
+    ResourceId(WORD id = 0)
+        : id(id)
+    {
+    }
+    ResourceId(std::wstring name)
+        : id(0), name(std::move(name))
+    {
+    }
+    ResourceId(LPCWSTR r)
+        : id(IS_INTRESOURCE(r) ? LOWORD(r) : 0), name(IS_INTRESOURCE(r) ? L"" : r)
+    {
+    }
+
+    bool IsName() const { return !name.empty(); }
+    WORD GetId() const { return id; }
+    const std::wstring& GetName() const { return name; }
+
+    bool operator<(const ResourceId& other) const
+    {
+        if (IsName() != other.IsName())
+            return IsName();
+        return IsName() ? name < other.name : id < other.id;
+    }
+    bool operator==(const ResourceId& other) const
+    {
+        return id == other.id && name == other.name;
+    }
+
+private:
+    WORD id;
+    std::wstring name;
+};
+
+struct ResourceData
+{
+    std::vector<BYTE> data;
+    DWORD dwCodePage;
+};
+
+// type -> name -> language -> data
+typedef std::map<WORD, ResourceData> ResourceLangs;
+typedef std::map<ResourceId, ResourceLangs> ResourceNames;
+typedef std::map<ResourceId, ResourceNames> ResourceTree;
+
+// A PE image (exe/dll) read as a file, not loaded, so it works on any machine type.
+// Resources are parsed into a ResourceTree that can be edited freely,
+// Save then rebuilds the .rsrc section once and copies the rest of the file through.
+class PeFile
+{
+public:
+    static PeFile Load(LPCTSTR lpFilename);
+    static PeFile FromMemory(std::vector<BYTE> data);
+
+    ResourceTree& GetResources() { return resources; }
+    const ResourceTree& GetResources() const { return resources; }
+
+    // Replace or add an RT_GROUP_ICON and its RT_ICON images, icons only.
+    // Of an existing group only the language lang picks (as PickLanguage) is replaced, the other languages are kept,
+    // a new group gets lang. RT_ICON ids of the old group are reused unless another group or language shares them.
+    void ReplaceIconGroup(const ResourceId& group, LANGID lang, const IconFile& IconData);
+
+    // Section sizes, SizeOfImage, the resource directory and the checksum are fixed up.
+    // The certificate table is dropped as the signature no longer matches.
+    void Save(LPCTSTR lpFilename) const;
+    std::vector<BYTE> SaveToMemory() const;
+
+private:
+    template <class T>
+    const T* At(size_t offset, size_t count = 1) const
+    {
+        if (offset > file.size() || count * sizeof(T) > file.size() - offset)
+            throw Error(TEXT("Invalid PE"));
+        return reinterpret_cast<const T*>(file.data() + offset);
+    }
+
+    const IMAGE_SECTION_HEADER* GetSections() const { return At<IMAGE_SECTION_HEADER>(dwSections, nSections); }
+    size_t RvaToOffset(DWORD rva) const;
+    void ParseResources();
+
+    std::vector<BYTE> file;
+    bool b64;
+    DWORD dwNtHeaders;
+    DWORD dwDataDirectory;
+    DWORD dwSections;
+    WORD nSections;
+    int iRsrcSection;
+    ResourceTree resources;
+};
+
+// Lays out a resource tree as a .rsrc section starting at dwRva
+std::vector<BYTE> BuildResourceSection(const ResourceTree& resources, DWORD dwRva);
@@ -0,0 +1,301 @@
+#include "Pipeline.h"
+
+#include <tchar.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+
+namespace
+{
+    struct Item
+    {
+        size_t index;
+        std::vector<BYTE> data;
+    };
+
+    // One overlapped read or write of a whole file
+    class AsyncIo
+    {
+    public:
+        AsyncIo(HANDLE hFile, Item item)
+            : hFile(hFile), item(std::move(item)), bPending(false), ov()
+        {
+            ov.hEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+            if (ov.hEvent == NULL)
+            {
+                const DWORD error = GetLastError();
+                CloseHandle(hFile);
+                throw WinError(error);
+            }
+        }
+
+        ~AsyncIo()
+        {
+            // The buffer has to outlive the I/O
+            if (bPending)
+            {
+                CancelIoEx(hFile, &ov);
+                DWORD dw;
+                GetOverlappedResult(hFile, &ov, &dw, TRUE);
+            }
+            CloseHandle(ov.hEvent);
+            CloseHandle(hFile);
+        }
+
+        AsyncIo(const AsyncIo&) = delete;
+        AsyncIo& operator=(const AsyncIo&) = delete;
+
+        void StartRead()
+        {
+            CHECK(ReadFile(hFile, item.data.data(), static_cast<DWORD>(item.data.size()), nullptr, &ov) || GetLastError() == ERROR_IO_PENDING);
+            bPending = true;
+        }
+
+        void StartWrite()
+        {
+            CHECK(WriteFile(hFile, item.data.data(), static_cast<DWORD>(item.data.size()), nullptr, &ov) || GetLastError() == ERROR_IO_PENDING);
+            bPending = true;
+        }
+
+        void Wait()
+        {
+            DWORD dw = 0;
+            const BOOL bOk = GetOverlappedResult(hFile, &ov, &dw, TRUE);
+            bPending = false;
+            CHECK(bOk && dw == item.data.size());
+        }
+
+        Item& GetItem() { return item; }
+
+    private:
+        const HANDLE hFile;
+        Item item;
+        bool bPending;
+        OVERLAPPED ov;
+    };
+
+    std::unique_ptr<AsyncIo> StartRead(size_t index, LPCTSTR lpFilename)
+    {
+        const HANDLE hFile = CreateFile(lpFilename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        CHECK(hFile != INVALID_HANDLE_VALUE);
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(hFile, &size))
+        {
+            const DWORD error = GetLastError();
+            CloseHandle(hFile);
+            throw WinError(error);
+        }
+        if (size.QuadPart > MAXDWORD)
+        {
+            CloseHandle(hFile);
+            throw Error(TEXT("File too large"));
+        }
+
+        std::unique_ptr<AsyncIo> io = std::make_unique<AsyncIo>(hFile, Item{ index, std::vector<BYTE>(static_cast<size_t>(size.QuadPart)) });
+        io->StartRead();
+        return io;
+    }
+
+    std::unique_ptr<AsyncIo> StartWrite(LPCTSTR lpFilename, Item item)
+    {
+        const HANDLE hFile = CreateFile(lpFilename, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        CHECK(hFile != INVALID_HANDLE_VALUE);
+
+        std::unique_ptr<AsyncIo> io = std::make_unique<AsyncIo>(hFile, std::move(item));
+        io->StartWrite();
+        return io;
+    }
+
+    class Reporter
+    {
+    public:
+        Reporter()
+            : failed(0)
+        {
+        }
+
+        // Call from a catch block
+        void Report(const std::tstring& file)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ++failed;
+            try
+            {
+                throw;
+            }
+            catch (const WinError& e)
+            {
+                _ftprintf(stderr, TEXT("%s: Error: 0x%08x\n"), file.c_str(), e.GetError());
+            }
+            catch (const Error& e)
+            {
+                _ftprintf(stderr, TEXT("%s: %s\n"), file.c_str(), e.GetMsg().c_str());
+            }
+            catch (const std::exception& e)
+            {
+                _ftprintf(stderr, TEXT("%s: %hs\n"), file.c_str(), e.what());
+            }
+            catch (...)
+            {
+                _ftprintf(stderr, TEXT("%s: Unknown error\n"), file.c_str());
+            }
+        }
+
+        size_t GetFailed() const { return failed; }
+
+    private:
+        std::mutex mutex;
+        size_t failed;
+    };
+}
+
+size_t RunPipeline(const std::vector<PipelineJob>& jobs, const PipelineTransform& transform, const PipelineOptions& options)
+{
+    // Two jobs writing one file would race, eg the same name from two directories or a file matched twice
+    std::vector<const std::tstring*> outputs;
+    outputs.reserve(jobs.size());
+    for (const PipelineJob& job : jobs)
+        outputs.push_back(&job.output);
+    std::sort(outputs.begin(), outputs.end(), [](const std::tstring* a, const std::tstring* b) { return _tcsicmp(a->c_str(), b->c_str()) < 0; });
+    for (size_t i = 1; i < outputs.size(); ++i)
+        if (_tcsicmp(outputs[i - 1]->c_str(), outputs[i]->c_str()) == 0)
+            throw Error(TEXT("Written twice: ") + *outputs[i]);
+
+    const size_t depth = options.depth > 0 ? options.depth : 1;
+    const unsigned int nThreads = options.nThreads > 0 ? options.nThreads : 1;
+
+    BoundedQueue<Item> read(depth);
+    BoundedQueue<Item> transformed(depth);
+    Reporter reporter;
+
+    // Completing the oldest read before issuing the next keeps depth reads in flight,
+    // Push blocks when the transform workers fall behind
+    std::thread reader([&]()
+        {
+            std::deque<std::unique_ptr<AsyncIo>> inflight;
+            auto complete = [&]()
+            {
+                std::unique_ptr<AsyncIo> io = std::move(inflight.front());
+                inflight.pop_front();
+                const size_t index = io->GetItem().index;
+                try
+                {
+                    io->Wait();
+                    read.Push(std::move(io->GetItem()));
+                }
+                catch (...)
+                {
+                    reporter.Report(jobs[index].input);
+                    if (options.pJob != nullptr)
+                        options.pJob->FileFailed();
+                }
+            };
+
+            for (size_t i = 0; i < jobs.size(); ++i)
+            {
+                if (options.pJob != nullptr && options.pJob->IsCancelled())
+                    break;
+                try
+                {
+                    inflight.push_back(StartRead(i, jobs[i].input.c_str()));
+                }
+                catch (...)
+                {
+                    reporter.Report(jobs[i].input);
+                    if (options.pJob != nullptr)
+                        options.pJob->FileFailed();
+                }
+                if (inflight.size() >= depth)
+                    complete();
+            }
+            while (!inflight.empty())
+                complete();
+            read.Close();
+        });
+
+    std::atomic<unsigned int> running(nThreads);
+    std::vector<std::thread> workers;
+    workers.reserve(nThreads);
+    for (unsigned int t = 0; t < nThreads; ++t)
+    {
+        workers.emplace_back([&]()
+            {
+                Item item;
+                while (read.Pop(item))
+                {
+                    if (options.pJob != nullptr && options.pJob->IsCancelled())
+                        continue;
+                    try
+                    {
+                        JobFile file(options.pJob, item.data.size());
+                        item.data = transform(jobs[item.index].input, std::move(item.data));
+                        file.Done();
+                        transformed.Push(std::move(item));
+                    }
+                    catch (...)
+                    {
+                        reporter.Report(jobs[item.index].input);
+                    }
+                }
+                if (--running == 0)
+                    transformed.Close();
+            });
+    }
+
+    // Writes run on this thread, also depth deep. Each goes to a .tmp file that replaces the output once
+    // complete, so a failed or interrupted write never truncates the output, which may be the input.
+    {
+        std::deque<std::unique_ptr<AsyncIo>> inflight;
+        auto complete = [&]()
+        {
+            std::unique_ptr<AsyncIo> io = std::move(inflight.front());
+            inflight.pop_front();
+            const size_t index = io->GetItem().index;
+            const std::tstring tmpfile = jobs[index].output + TEXT(".tmp");
+            try
+            {
+                io->Wait();
+                io.reset();
+                CHECK(MoveFileEx(tmpfile.c_str(), jobs[index].output.c_str(), MOVEFILE_REPLACE_EXISTING));
+            }
+            catch (...)
+            {
+                io.reset();
+                DeleteFile(tmpfile.c_str());
+                reporter.Report(jobs[index].output);
+                if (options.pJob != nullptr)
+                    options.pJob->WriteFailed();
+            }
+        };
+
+        Item item;
+        while (transformed.Pop(item))
+        {
+            const size_t index = item.index;
+            const std::tstring tmpfile = jobs[index].output + TEXT(".tmp");
+            try
+            {
+                inflight.push_back(StartWrite(tmpfile.c_str(), std::move(item)));
+            }
+            catch (...)
+            {
+                DeleteFile(tmpfile.c_str());
+                reporter.Report(jobs[index].output);
+                if (options.pJob != nullptr)
+                    options.pJob->WriteFailed();
+            }
+            if (inflight.size() >= depth)
+                complete();
+        }
+        while (!inflight.empty())
+            complete();
+    }
+
+    reader.join();
+    for (std::thread& t : workers)
+        t.join();
+
+    return reporter.GetFailed();
+}
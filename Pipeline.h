@@ -0,0 +1,83 @@
+#pragma once
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Job.h"
+#include "Parallel.h"
+#include "Utils.h"
+
+// Fixed capacity queue between pipeline stages, Push blocks while it is full
+template <class T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity)
+        : capacity(capacity), closed(false)
+    {
+    }
+
+    void Push(T item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        notfull.wait(lock, [this]() { return items.size() < capacity; });
+        items.push_back(std::move(item));
+        notempty.notify_one();
+    }
+
+    // false once the queue is closed and empty
+    bool Pop(T& item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        notempty.wait(lock, [this]() { return !items.empty() || closed; });
+        if (items.empty())
+            return false;
+        item = std::move(items.front());
+        items.pop_front();
+        notfull.notify_one();
+        return true;
+    }
+
+    void Close()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notempty.notify_all();
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable notfull;
+    std::condition_variable notempty;
+    std::deque<T> items;
+    const size_t capacity;
+    bool closed;
+};
+
+struct PipelineJob
+{
+    std::tstring input;
+    std::tstring output;
+};
+
+struct PipelineOptions
+{
+    unsigned int nThreads = GetThreadCount();   // transform workers
+    size_t depth = 16;                          // reads and writes in flight, and items queued between stages
+    JobControl* pJob = nullptr;                 // progress, limits and cancellation, each transform runs in a JobFile
+};
+
+typedef std::function<std::vector<BYTE>(const std::tstring& input, std::vector<BYTE> data)> PipelineTransform;
+
+// Reads every input, transforms the bytes and writes them to the output.
+// Reads and writes are overlapped I/O kept depth deep, a slow stage fills its queue and holds back the one before.
+// Errors are reported per file on stderr and that file skipped, returns the number of files that failed.
+// An output is written to output.tmp and moved over output once complete, so it may be its own input.
+// Throws before starting when two jobs have the same output.
+// Once the job is cancelled no more files are read and those already read are dropped, they are not counted.
+size_t RunPipeline(const std::vector<PipelineJob>& jobs, const PipelineTransform& transform, const PipelineOptions& options = {});
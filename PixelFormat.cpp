@@ -0,0 +1,246 @@
+#include "PixelFormat.h"
+
+#include "Utils.h"
+#include "Format.h"
+#include <algorithm>
+
+BitField::BitField(DWORD mask)
+    : mask(mask), shift(0), bits(0), lut()
+{
+    if (!IsContiguous(mask))
+        throw Error(TEXT("Invalid bit field mask"));
+    if (mask != 0)
+    {
+        while (!(mask & (1u << shift)))
+            ++shift;
+        while (shift + bits < 32 && (mask & (1u << (shift + bits))))
+            ++bits;
+    }
+    if (bits > 0 && bits <= 8)
+    {
+        const DWORD max = (1u << bits) - 1;
+        for (DWORD n = 0; n <= max; ++n)
+            lut[n] = static_cast<BYTE>((n * 255 + max / 2) / max);
+    }
+}
+
+bool BitField::IsContiguous(DWORD mask)
+{
+    if (mask == 0)
+        return true;
+    while (!(mask & 1))
+        mask >>= 1;
+    return (mask & (mask + 1)) == 0;
+}
+
+DWORD BitField::Insert(BYTE c) const
+{
+    if (bits == 0)
+        return 0;
+    const DWORD max = (1u << bits) - 1;
+    const DWORD n = bits >= 8 ? DWORD(c) << (bits - 8) : (c * max + 127) / 255;
+    return (n << shift) & mask;
+}
+
+struct PixelConverters
+{
+    static RGBQUAD Lookup(const PixelFormat& f, BYTE n)
+    {
+        RGBQUAD c = n < f.iColorCount ? f.pColor[n] : RGBQUAD();
+        c.rgbReserved = 255;
+        return c;
+    }
+
+    static void Decode1(const PixelFormat& f, const BYTE* pRow, int x, int count, RGBQUAD* pDst)
+    {
+        for (int i = 0; i < count; ++i, ++x)
+            pDst[i] = Lookup(f, (pRow[x / 8] >> (7 - x % 8)) & 0x1);
+    }
+
+    static void Encode1(const PixelFormat& f, BYTE* pRow, int x, int count, const RGBQUAD* pSrc)
+    {
+        for (int i = 0; i < count; ++i, ++x)
+        {
+            const int s = 7 - x % 8;
+            BYTE& b = pRow[x / 8];
+            b = static_cast<BYTE>((b & ~(0x1 << s)) | ((f.GetNearestColour(pSrc[i]) & 0x1) << s));
+        }
+    }
+
+    static void Decode4(const PixelFormat& f, const BYTE* pRow, int x, int count, RGBQUAD* pDst)
+    {
+        for (int i = 0; i < count; ++i, ++x)
+            pDst[i] = Lookup(f, (pRow[x / 2] >> ((1 - x % 2) * 4)) & 0xF);
+    }
+
+    static void Encode4(const PixelFormat& f, BYTE* pRow, int x, int count, const RGBQUAD* pSrc)
+    {
+        for (int i = 0; i < count; ++i, ++x)
+        {
+            const int s = (1 - x % 2) * 4;
+            BYTE& b = pRow[x / 2];
+            b = static_cast<BYTE>((b & ~(0xF << s)) | ((f.GetNearestColour(pSrc[i]) & 0xF) << s));
+        }
+    }
+
+    static void Decode8(const PixelFormat& f, const BYTE* pRow, int x, int count, RGBQUAD* pDst)
+    {
+        pRow += x;
+        for (int i = 0; i < count; ++i)
+            pDst[i] = Lookup(f, pRow[i]);
+    }
+
+    static void Encode8(const PixelFormat& f, BYTE* pRow, int x, int count, const RGBQUAD* pSrc)
+    {
+        pRow += x;
+        for (int i = 0; i < count; ++i)
+            pRow[i] = static_cast<BYTE>(f.GetNearestColour(pSrc[i]));
+    }
+
+    template <class T>
+    static void DecodeBitFields(const PixelFormat& f, const BYTE* pRow, int x, int count, RGBQUAD* pDst)
+    {
+        const BYTE* p = pRow + x * sizeof(T);
+        for (int i = 0; i < count; ++i, p += sizeof(T))
+        {
+            T v;
+            memcpy(&v, p, sizeof(T));
+            pDst[i].rgbRed = f.red.Extract(v);
+            pDst[i].rgbGreen = f.green.Extract(v);
+            pDst[i].rgbBlue = f.blue.Extract(v);
+            pDst[i].rgbReserved = f.alpha.mask != 0 ? f.alpha.Extract(v) : 255;
+        }
+    }
+
+    template <class T>
+    static void EncodeBitFields(const PixelFormat& f, BYTE* pRow, int x, int count, const RGBQUAD* pSrc)
+    {
+        BYTE* p = pRow + x * sizeof(T);
+        for (int i = 0; i < count; ++i, p += sizeof(T))
+        {
+            const T v = static_cast<T>(f.red.Insert(pSrc[i].rgbRed) | f.green.Insert(pSrc[i].rgbGreen) | f.blue.Insert(pSrc[i].rgbBlue) | f.alpha.Insert(pSrc[i].rgbReserved));
+            memcpy(p, &v, sizeof(T));
+        }
+    }
+
+    static void Decode24(const PixelFormat& f, const BYTE* pRow, int x, int count, RGBQUAD* pDst)
+    {
+        const BYTE* p = pRow + x * 3;
+        for (int i = 0; i < count; ++i, p += 3)
+        {
+            pDst[i].rgbBlue = p[0];
+            pDst[i].rgbGreen = p[1];
+            pDst[i].rgbRed = p[2];
+            pDst[i].rgbReserved = 255;
+        }
+    }
+
+    static void Encode24(const PixelFormat& f, BYTE* pRow, int x, int count, const RGBQUAD* pSrc)
+    {
+        BYTE* p = pRow + x * 3;
+        for (int i = 0; i < count; ++i, p += 3)
+        {
+            p[0] = pSrc[i].rgbBlue;
+            p[1] = pSrc[i].rgbGreen;
+            p[2] = pSrc[i].rgbRed;
+        }
+    }
+
+    // BI_RGB 32 bit is already BGRA
+    static void Decode32(const PixelFormat& f, const BYTE* pRow, int x, int count, RGBQUAD* pDst)
+    {
+        memcpy(pDst, pRow + x * sizeof(RGBQUAD), count * sizeof(RGBQUAD));
+    }
+
+    static void Encode32(const PixelFormat& f, BYTE* pRow, int x, int count, const RGBQUAD* pSrc)
+    {
+        memcpy(pRow + x * sizeof(RGBQUAD), pSrc, count * sizeof(RGBQUAD));
+    }
+};
+
+const PixelFormat::Converter* PixelFormat::FindConverter(WORD biBitCount, DWORD biCompression)
+{
+    static const Converter converters[] = {
+        { 1, BI_RGB, PixelConverters::Decode1, PixelConverters::Encode1 },
+        { 4, BI_RGB, PixelConverters::Decode4, PixelConverters::Encode4 },
+        { 8, BI_RGB, PixelConverters::Decode8, PixelConverters::Encode8 },
+        { 16, BI_RGB, PixelConverters::DecodeBitFields<WORD>, PixelConverters::EncodeBitFields<WORD> },
+        { 16, BI_BITFIELDS, PixelConverters::DecodeBitFields<WORD>, PixelConverters::EncodeBitFields<WORD> },
+        { 24, BI_RGB, PixelConverters::Decode24, PixelConverters::Encode24 },
+        { 32, BI_RGB, PixelConverters::Decode32, PixelConverters::Encode32 },
+        { 32, BI_BITFIELDS, PixelConverters::DecodeBitFields<DWORD>, PixelConverters::EncodeBitFields<DWORD> },
+    };
+
+    for (const Converter& c : converters)
+    {
+        if (c.biBitCount == biBitCount && c.biCompression == biCompression)
+            return &c;
+    }
+    return nullptr;
+}
+
+bool PixelFormat::IsSupported(WORD biBitCount, DWORD biCompression)
+{
+    return FindConverter(biBitCount, biCompression) != nullptr;
+}
+
+bool PixelFormat::AreBitFieldsValid(const BITMAPINFOHEADER* header, const DWORD* pBitFields)
+{
+    if (header->biBitCount == 0 || header->biBitCount > 32)
+        return false;
+    const DWORD pixel = header->biBitCount == 32 ? 0xFFFFFFFF : (1u << header->biBitCount) - 1;
+    const int count = header->biSize >= sizeof(BITMAPINFOHEADER) + 4 * sizeof(DWORD) ? 4 : 3;
+    DWORD used = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        const DWORD mask = pBitFields[i];
+        if (!BitField::IsContiguous(mask) || (mask & ~pixel) != 0 || (mask & used) != 0)
+            return false;
+        used |= mask;
+    }
+    return true;
+}
+
+PixelFormat::PixelFormat(const BITMAPINFOHEADER* header, const DWORD* pBitFields, const RGBQUAD* pColor, int iColorCount)
+    : converter(FindConverter(header->biBitCount, header->biCompression))
+    , biBitCount(header->biBitCount)
+    , pColor(pColor)
+    , iColorCount(iColorCount)
+{
+    if (converter == nullptr)
+        throw Error(Format(TEXT("biBitCount %d biCompression %d not supported"), header->biBitCount, header->biCompression));
+
+    if (header->biCompression == BI_BITFIELDS)
+    {
+        if (!AreBitFieldsValid(header, pBitFields))
+            throw Error(TEXT("Invalid bit field masks"));
+        red = BitField(pBitFields[0]);
+        green = BitField(pBitFields[1]);
+        blue = BitField(pBitFields[2]);
+        // Only a header with room for a fourth mask has alpha, with three the AND mask decides as in GDI
+        if (header->biSize >= sizeof(BITMAPINFOHEADER) + 4 * sizeof(DWORD))
+            alpha = BitField(pBitFields[3]);
+    }
+    else if (biBitCount == 16)
+    {
+        red = BitField(0x7C00);
+        green = BitField(0x03E0);
+        blue = BitField(0x001F);
+    }
+    else if (biBitCount == 32)
+    {
+        red = BitField(0x00FF0000);
+        green = BitField(0x0000FF00);
+        blue = BitField(0x000000FF);
+        alpha = BitField(0xFF000000);
+    }
+}
+
+int PixelFormat::GetNearestColour(const RGBQUAD c) const
+{
+    const RGBQUAD* it = std::min_element(pColor, pColor + iColorCount, [c](RGBQUAD x, RGBQUAD y)
+        {
+            return ColourDistanceSq(x, c) < ColourDistanceSq(y, c);
+        });
+    return int(it - pColor);
+}
@@ -0,0 +1,79 @@
+#pragma once
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+inline long ColourDistanceSq(RGBQUAD e1, RGBQUAD e2)
+{
+    const long rmean = ((long) e1.rgbRed + (long) e2.rgbRed) / 2;
+    const long r = (long) e1.rgbRed - (long) e2.rgbRed;
+    const long g = (long) e1.rgbGreen - (long) e2.rgbGreen;
+    const long b = (long) e1.rgbBlue - (long) e2.rgbBlue;
+    const long s = 0;// (long) e1.rgbReserved - (long) e2.rgbReserved;
+    return (((512 + rmean) * r * r) >> 8) + 4 * g * g + (((767 - rmean) * b * b) >> 8) + s * s;
+}
+
+// One channel of a BI_BITFIELDS pixel, the mask is a single run of bits
+struct BitField
+{
+    // Throws on a mask with gaps, Extract would index past lut
+    BitField(DWORD mask = 0);
+
+    static bool IsContiguous(DWORD mask);
+
+    BYTE Extract(DWORD v) const
+    {
+        const DWORD n = (v & mask) >> shift;
+        return bits <= 8 ? lut[n] : static_cast<BYTE>(n >> (bits - 8));
+    }
+
+    DWORD Insert(BYTE c) const;
+
+    DWORD mask;
+    int shift;
+    int bits;
+    BYTE lut[256]; // scales an n bit value to 8 bits, when bits <= 8
+};
+
+// Converts rows of DIB pixels to and from RGBQUAD.
+// Formats are looked up in a table by biBitCount and biCompression, so adding one is a new table row.
+// Colours decode with rgbReserved 255 unless the format carries alpha, the AND mask is left to the caller.
+class PixelFormat
+{
+public:
+    PixelFormat(const BITMAPINFOHEADER* header, const DWORD* pBitFields, const RGBQUAD* pColor, int iColorCount);
+
+    WORD GetBitCount() const { return biBitCount; }
+    bool HasAlpha() const { return alpha.mask != 0; }
+
+    void DecodeRow(const BYTE* pRow, int x, int count, RGBQUAD* pDst) const { converter->Decode(*this, pRow, x, count, pDst); }
+    void EncodeRow(BYTE* pRow, int x, int count, const RGBQUAD* pSrc) const { converter->Encode(*this, pRow, x, count, pSrc); }
+
+    int GetNearestColour(const RGBQUAD c) const;
+
+    static bool IsSupported(WORD biBitCount, DWORD biCompression);
+    // BI_BITFIELDS masks each a single run of bits within biBitCount, none overlapping.
+    // The alpha mask is read when the header is large enough to hold it.
+    static bool AreBitFieldsValid(const BITMAPINFOHEADER* header, const DWORD* pBitFields);
+
+private:
+    friend struct PixelConverters;
+
+    struct Converter
+    {
+        WORD biBitCount;
+        DWORD biCompression;
+        void (*Decode)(const PixelFormat& f, const BYTE* pRow, int x, int count, RGBQUAD* pDst);
+        void (*Encode)(const PixelFormat& f, BYTE* pRow, int x, int count, const RGBQUAD* pSrc);
+    };
+
+    static const Converter* FindConverter(WORD biBitCount, DWORD biCompression);
+
+    const Converter* converter;
+    WORD biBitCount;
+    BitField red;
+    BitField green;
+    BitField blue;
+    BitField alpha;
+    const RGBQUAD* pColor;
+    int iColorCount;
+};
@@ -0,0 +1,651 @@
+#include "Png.h"
+
+#include "Bitmap.h"
+#include "Job.h"
+#include "Utils.h"
+#include <algorithm>
+#include <cstdlib>
+#include <queue>
+
+namespace
+{
+    class BitWriter
+    {
+    public:
+        explicit BitWriter(std::vector<BYTE>& out)
+            : out(out), bits(0), count(0)
+        {
+        }
+
+        // n <= 16
+        void Put(DWORD value, int n)
+        {
+            bits |= value << count;
+            count += n;
+            while (count >= 8)
+            {
+                out.push_back(static_cast<BYTE>(bits));
+                bits >>= 8;
+                count -= 8;
+            }
+        }
+
+        void Flush()
+        {
+            if (count > 0)
+                out.push_back(static_cast<BYTE>(bits));
+            bits = 0;
+            count = 0;
+        }
+
+    private:
+        std::vector<BYTE>& out;
+        DWORD bits;
+        int count;
+    };
+
+    const WORD LengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+    const BYTE LengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+    const WORD DistBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+    const BYTE DistExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+    const BYTE CodeLengthOrder[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+    const int WindowSize = 32768;
+    const int MinMatch = 3;
+    const int MaxMatch = 258;
+    const int HashBits = 15;
+
+    int LengthCode(int len)
+    {
+        return static_cast<int>(std::upper_bound(std::begin(LengthBase), std::end(LengthBase), len) - std::begin(LengthBase)) - 1;
+    }
+
+    int DistCode(int dist)
+    {
+        return static_cast<int>(std::upper_bound(std::begin(DistBase), std::end(DistBase), dist) - std::begin(DistBase)) - 1;
+    }
+
+    // dist 0 is a literal in len
+    struct Token
+    {
+        WORD len;
+        WORD dist;
+    };
+
+    struct Effort
+    {
+        int chain;  // hash chain entries searched
+        int nice;   // stop searching at a match this long
+        bool lazy;  // check whether the next position has a longer match
+    };
+
+    Effort GetEffort(int effort)
+    {
+        static const Effort table[] = {
+            { 4, 8, false },
+            { 8, 16, false },
+            { 16, 32, false },
+            { 16, 32, true },
+            { 32, 64, true },
+            { 128, 128, true },
+            { 256, 258, true },
+            { 1024, 258, true },
+            { 4096, 258, true },
+        };
+        return table[(std::min)((std::max)(effort, 1), 9) - 1];
+    }
+
+    // LZ77 over the whole input with hash chains, deterministic for a given input and effort
+    std::vector<Token> FindMatches(const BYTE* p, size_t size, const Effort& effort)
+    {
+        std::vector<Token> tokens;
+        tokens.reserve(size / 2 + 1);
+
+        std::vector<int> head(size_t(1) << HashBits, -1);
+        std::vector<int> prev(size, -1);
+
+        auto hash = [p](size_t i)
+        {
+            const DWORD v = p[i] | (p[i + 1] << 8) | (p[i + 2] << 16);
+            return (v * 2654435761u) >> (32 - HashBits);
+        };
+        auto insert = [&](size_t i)
+        {
+            if (i + MinMatch <= size)
+            {
+                const DWORD h = hash(i);
+                prev[i] = head[h];
+                head[h] = static_cast<int>(i);
+            }
+        };
+        auto match = [&](size_t i, int& bestdist)
+        {
+            int best = 0;
+            if (i + MinMatch > size)
+                return best;
+            const int maxlen = static_cast<int>((std::min)(size_t(MaxMatch), size - i));
+            int chain = effort.chain;
+            for (int c = head[hash(i)]; c >= 0 && i - c <= WindowSize && chain-- > 0; c = prev[c])
+            {
+                if (p[c + best] != p[i + best])
+                    continue;
+                int len = 0;
+                while (len < maxlen && p[c + len] == p[i + len])
+                    ++len;
+                if (len > best)
+                {
+                    best = len;
+                    bestdist = static_cast<int>(i - c);
+                    if (len >= effort.nice || len == maxlen)
+                        break;
+                }
+            }
+            return best >= MinMatch ? best : 0;
+        };
+
+        // The chains can make one image take seconds at high effort, check every 64K positions
+        size_t i = 0;
+        size_t check = 0;
+        while (i < size)
+        {
+            if (i >= check)
+            {
+                JobCheck();
+                check = i + 0x10000;
+            }
+            int dist = 0;
+            int len = match(i, dist);
+            if (len > 0 && effort.lazy && len < effort.nice)
+            {
+                insert(i);
+                int nextdist = 0;
+                const int nextlen = match(i + 1, nextdist);
+                if (nextlen > len)
+                {
+                    tokens.push_back({ p[i], 0 });
+                    ++i;
+                    len = nextlen;
+                    dist = nextdist;
+                }
+                else
+                {
+                    tokens.push_back({ static_cast<WORD>(len), static_cast<WORD>(dist) });
+                    for (size_t j = i + 1; j < i + len; ++j)
+                        insert(j);
+                    i += len;
+                    continue;
+                }
+            }
+
+            if (len > 0)
+            {
+                tokens.push_back({ static_cast<WORD>(len), static_cast<WORD>(dist) });
+                for (size_t j = i; j < i + len; ++j)
+                    insert(j);
+                i += len;
+            }
+            else
+            {
+                tokens.push_back({ p[i], 0 });
+                insert(i);
+                ++i;
+            }
+        }
+        return tokens;
+    }
+
+    // Huffman code lengths limited to maxbits, halving the frequencies until the tree fits
+    std::vector<BYTE> BuildLengths(std::vector<DWORD> freq, int maxbits)
+    {
+        const int n = static_cast<int>(freq.size());
+        std::vector<BYTE> lengths(n, 0);
+
+        for (;;)
+        {
+            typedef std::pair<ULONGLONG, int> Node; // weight, node
+            std::priority_queue<Node, std::vector<Node>, std::greater<Node>> queue;
+            std::vector<int> parent;
+            for (int s = 0; s < n; ++s)
+            {
+                if (freq[s] > 0)
+                {
+                    queue.push({ freq[s], static_cast<int>(parent.size()) });
+                    parent.push_back(s); // leaf, holds its symbol until the tree is built
+                }
+            }
+
+            const int leaves = static_cast<int>(parent.size());
+            if (leaves == 0)
+                return lengths;
+            if (leaves == 1)
+            {
+                lengths[parent[0]] = 1;
+                return lengths;
+            }
+
+            std::vector<int> symbol(parent);
+            parent.assign(leaves, -1);
+            while (queue.size() > 1)
+            {
+                const Node a = queue.top();
+                queue.pop();
+                const Node b = queue.top();
+                queue.pop();
+                const int node = static_cast<int>(parent.size());
+                parent.push_back(-1);
+                parent[a.second] = node;
+                parent[b.second] = node;
+                queue.push({ a.first + b.first, node });
+            }
+
+            std::vector<int> depth(parent.size(), 0);
+            for (int i = static_cast<int>(parent.size()) - 2; i >= 0; --i)
+                depth[i] = depth[parent[i]] + 1;
+
+            const int maxdepth = *std::max_element(depth.begin(), depth.begin() + leaves);
+            if (maxdepth <= maxbits)
+            {
+                for (int l = 0; l < leaves; ++l)
+                    lengths[symbol[l]] = static_cast<BYTE>(depth[l]);
+                return lengths;
+            }
+
+            for (DWORD& f : freq)
+                if (f > 0)
+                    f = (f >> 1) | 1;
+        }
+    }
+
+    // Canonical codes, bit reversed as deflate sends them LSB first
+    std::vector<WORD> BuildCodes(const std::vector<BYTE>& lengths)
+    {
+        WORD count[16] = {};
+        for (const BYTE l : lengths)
+            ++count[l];
+        count[0] = 0;
+
+        WORD next[16] = {};
+        WORD code = 0;
+        for (int bits = 1; bits < 16; ++bits)
+        {
+            code = (code + count[bits - 1]) << 1;
+            next[bits] = code;
+        }
+
+        std::vector<WORD> codes(lengths.size(), 0);
+        for (size_t s = 0; s < lengths.size(); ++s)
+        {
+            const int len = lengths[s];
+            if (len == 0)
+                continue;
+            const WORD c = next[len]++;
+            WORD r = 0;
+            for (int b = 0; b < len; ++b)
+                r |= ((c >> b) & 1) << (len - 1 - b);
+            codes[s] = r;
+        }
+        return codes;
+    }
+
+    // Run length encode the code lengths with the 16, 17 and 18 repeat codes
+    // returns symbol | (extra << 8)
+    std::vector<WORD> EncodeLengths(const std::vector<BYTE>& lengths)
+    {
+        std::vector<WORD> out;
+        size_t i = 0;
+        while (i < lengths.size())
+        {
+            const BYTE l = lengths[i];
+            size_t run = 1;
+            while (i + run < lengths.size() && lengths[i + run] == l)
+                ++run;
+
+            if (l == 0 && run >= 3)
+            {
+                const size_t n = (std::min)(run, size_t(138));
+                if (n >= 11)
+                    out.push_back(static_cast<WORD>(18 | ((n - 11) << 8)));
+                else
+                    out.push_back(static_cast<WORD>(17 | ((n - 3) << 8)));
+                i += n;
+            }
+            else if (l != 0 && run >= 4)
+            {
+                out.push_back(l);
+                const size_t n = (std::min)(run - 1, size_t(6));
+                out.push_back(static_cast<WORD>(16 | ((n - 3) << 8)));
+                i += 1 + n;
+            }
+            else
+            {
+                out.push_back(l);
+                ++i;
+            }
+        }
+        return out;
+    }
+
+    void WriteBlock(BitWriter& bw, const Token* tokens, size_t count, bool bFinal)
+    {
+        std::vector<DWORD> litfreq(286, 0);
+        std::vector<DWORD> distfreq(30, 0);
+        for (size_t t = 0; t < count; ++t)
+        {
+            if (tokens[t].dist == 0)
+                ++litfreq[tokens[t].len];
+            else
+            {
+                ++litfreq[257 + LengthCode(tokens[t].len)];
+                ++distfreq[DistCode(tokens[t].dist)];
+            }
+        }
+        ++litfreq[256];
+        if (std::all_of(distfreq.begin(), distfreq.end(), [](DWORD f) { return f == 0; }))
+            distfreq[0] = 1;
+
+        const std::vector<BYTE> litlen = BuildLengths(litfreq, 15);
+        const std::vector<BYTE> distlen = BuildLengths(distfreq, 15);
+        const std::vector<WORD> litcode = BuildCodes(litlen);
+        const std::vector<WORD> distcode = BuildCodes(distlen);
+
+        int hlit = 286;
+        while (hlit > 257 && litlen[hlit - 1] == 0)
+            --hlit;
+        int hdist = 30;
+        while (hdist > 1 && distlen[hdist - 1] == 0)
+            --hdist;
+
+        std::vector<BYTE> all(litlen.begin(), litlen.begin() + hlit);
+        all.insert(all.end(), distlen.begin(), distlen.begin() + hdist);
+        const std::vector<WORD> rle = EncodeLengths(all);
+
+        std::vector<DWORD> clfreq(19, 0);
+        for (const WORD s : rle)
+            ++clfreq[s & 0xFF];
+        const std::vector<BYTE> cllen = BuildLengths(clfreq, 7);
+        const std::vector<WORD> clcode = BuildCodes(cllen);
+
+        int hclen = 19;
+        while (hclen > 4 && cllen[CodeLengthOrder[hclen - 1]] == 0)
+            --hclen;
+
+        bw.Put(bFinal ? 1 : 0, 1);
+        bw.Put(2, 2); // dynamic Huffman
+        bw.Put(hlit - 257, 5);
+        bw.Put(hdist - 1, 5);
+        bw.Put(hclen - 4, 4);
+        for (int i = 0; i < hclen; ++i)
+            bw.Put(cllen[CodeLengthOrder[i]], 3);
+        for (const WORD s : rle)
+        {
+            const int sym = s & 0xFF;
+            bw.Put(clcode[sym], cllen[sym]);
+            if (sym == 16)
+                bw.Put(s >> 8, 2);
+            else if (sym == 17)
+                bw.Put(s >> 8, 3);
+            else if (sym == 18)
+                bw.Put(s >> 8, 7);
+        }
+
+        for (size_t t = 0; t < count; ++t)
+        {
+            const Token& tok = tokens[t];
+            if (tok.dist == 0)
+                bw.Put(litcode[tok.len], litlen[tok.len]);
+            else
+            {
+                const int lc = LengthCode(tok.len);
+                bw.Put(litcode[257 + lc], litlen[257 + lc]);
+                bw.Put(tok.len - LengthBase[lc], LengthExtra[lc]);
+                const int dc = DistCode(tok.dist);
+                bw.Put(distcode[dc], distlen[dc]);
+                bw.Put(tok.dist - DistBase[dc], DistExtra[dc]);
+            }
+        }
+        bw.Put(litcode[256], litlen[256]);
+    }
+
+    DWORD Adler32(const BYTE* p, size_t size)
+    {
+        DWORD a = 1, b = 0;
+        while (size > 0)
+        {
+            // 5552 bytes is the most that can be summed before b overflows
+            const size_t n = (std::min)(size, size_t(5552));
+            for (size_t i = 0; i < n; ++i)
+            {
+                a += p[i];
+                b += a;
+            }
+            a %= 65521;
+            b %= 65521;
+            p += n;
+            size -= n;
+        }
+        return (b << 16) | a;
+    }
+
+    void PutBE32(std::vector<BYTE>& out, DWORD v)
+    {
+        out.push_back(static_cast<BYTE>(v >> 24));
+        out.push_back(static_cast<BYTE>(v >> 16));
+        out.push_back(static_cast<BYTE>(v >> 8));
+        out.push_back(static_cast<BYTE>(v));
+    }
+
+    DWORD GetBE32(const BYTE* p)
+    {
+        return DWORD(p[0]) << 24 | DWORD(p[1]) << 16 | DWORD(p[2]) << 8 | p[3];
+    }
+
+    void PutChunk(std::vector<BYTE>& out, const char type[4], const BYTE* pData, size_t size)
+    {
+        PutBE32(out, static_cast<DWORD>(size));
+        const size_t start = out.size();
+        out.insert(out.end(), type, type + 4);
+        out.insert(out.end(), pData, pData + size);
+        PutBE32(out, Crc32(0, out.data() + start, out.size() - start));
+    }
+
+    BYTE Paeth(BYTE a, BYTE b, BYTE c)
+    {
+        const int p = a + b - c;
+        const int pa = abs(p - a);
+        const int pb = abs(p - b);
+        const int pc = abs(p - c);
+        if (pa <= pb && pa <= pc)
+            return a;
+        return pb <= pc ? b : c;
+    }
+}
+
+DWORD Crc32(DWORD crc, const BYTE* pData, size_t size)
+{
+    static const struct Table
+    {
+        DWORD v[256];
+        Table()
+        {
+            for (DWORD n = 0; n < 256; ++n)
+            {
+                DWORD c = n;
+                for (int k = 0; k < 8; ++k)
+                    c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+                v[n] = c;
+            }
+        }
+    } table;
+
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i)
+        crc = table.v[(crc ^ pData[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+std::vector<BYTE> ZlibCompress(const BYTE* pData, size_t size, int effort)
+{
+    std::vector<BYTE> out;
+    out.push_back(0x78);
+    out.push_back(0xDA);
+
+    const std::vector<Token> tokens = FindMatches(pData, size, GetEffort(effort));
+
+    BitWriter bw(out);
+    const size_t BlockTokens = 16384;
+    size_t t = 0;
+    do
+    {
+        JobCheck();
+        const size_t n = (std::min)(BlockTokens, tokens.size() - t);
+        WriteBlock(bw, tokens.data() + t, n, t + n == tokens.size());
+        t += n;
+    } while (t < tokens.size());
+    bw.Flush();
+
+    PutBE32(out, Adler32(pData, size));
+    return out;
+}
+
+std::vector<BYTE> EncodePng(const Bitmap& bitmap, int effort)
+{
+    const LONG width = bitmap.GetWidth();
+    const LONG height = bitmap.GetHeight();
+    const size_t stride = static_cast<size_t>(width) * 4;
+
+    // Each row gets the filter with the smallest sum of absolute differences
+    std::vector<BYTE> filtered;
+    filtered.reserve((stride + 1) * height);
+    std::vector<BYTE> row(stride), prior(stride, 0);
+    std::vector<BYTE> candidate[5];
+    for (std::vector<BYTE>& c : candidate)
+        c.resize(stride);
+
+    for (LONG y = 0; y < height; ++y)
+    {
+        const RGBQUAD* pRow = bitmap.GetRow(y);
+        for (LONG x = 0; x < width; ++x)
+        {
+            row[x * 4 + 0] = pRow[x].rgbRed;
+            row[x * 4 + 1] = pRow[x].rgbGreen;
+            row[x * 4 + 2] = pRow[x].rgbBlue;
+            row[x * 4 + 3] = pRow[x].rgbReserved;
+        }
+
+        for (size_t i = 0; i < stride; ++i)
+        {
+            const BYTE a = i >= 4 ? row[i - 4] : 0;
+            const BYTE b = prior[i];
+            const BYTE c = i >= 4 ? prior[i - 4] : 0;
+            candidate[0][i] = row[i];
+            candidate[1][i] = row[i] - a;
+            candidate[2][i] = row[i] - b;
+            candidate[3][i] = row[i] - static_cast<BYTE>((a + b) / 2);
+            candidate[4][i] = row[i] - Paeth(a, b, c);
+        }
+
+        int best = 0;
+        ULONGLONG bestsum = ~0ull;
+        for (int f = 0; f < 5; ++f)
+        {
+            ULONGLONG sum = 0;
+            for (const BYTE v : candidate[f])
+                sum += v < 128 ? v : 256 - v;
+            if (sum < bestsum)
+            {
+                bestsum = sum;
+                best = f;
+            }
+        }
+
+        filtered.push_back(static_cast<BYTE>(best));
+        filtered.insert(filtered.end(), candidate[best].begin(), candidate[best].end());
+        row.swap(prior);
+    }
+
+    std::vector<BYTE> png = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+
+    std::vector<BYTE> ihdr;
+    PutBE32(ihdr, width);
+    PutBE32(ihdr, height);
+    ihdr.push_back(8);  // bit depth
+    ihdr.push_back(6);  // RGBA
+    ihdr.push_back(0);  // deflate
+    ihdr.push_back(0);  // adaptive filtering
+    ihdr.push_back(0);  // no interlace
+    PutChunk(png, "IHDR", ihdr.data(), ihdr.size());
+
+    const std::vector<BYTE> idat = ZlibCompress(filtered.data(), filtered.size(), effort);
+    PutChunk(png, "IDAT", idat.data(), idat.size());
+    PutChunk(png, "IEND", nullptr, 0);
+    return png;
+}
+
+std::vector<BYTE> CanonicalPng(const BYTE* pData, DWORD dwSize)
+{
+    struct Chunk
+    {
+        int group;          // 0 before PLTE, 1 PLTE, 2 before IDAT, 3 IDAT, 4 after IDAT
+        const BYTE* type;
+        const BYTE* pData;
+        DWORD size;
+    };
+
+    const BYTE* const pEnd = pData + dwSize;
+    const BYTE* p = pData + 8;
+    std::vector<Chunk> chunks;
+    int group = 0;
+    bool bEnd = false;
+    while (!bEnd)
+    {
+        if (pEnd - p < 12 || GetBE32(p) > static_cast<DWORD>(pEnd - p - 12))
+            throw Error(TEXT("Invalid png chunk"));
+        const DWORD size = GetBE32(p);
+        const BYTE* type = p + 4;
+        p += 12 + size;
+
+        if (memcmp(type, "IEND", 4) == 0)
+            bEnd = true;
+        else if (memcmp(type, "IHDR", 4) == 0)
+            chunks.push_back({ -1, type, type + 4, size });
+        else if (memcmp(type, "PLTE", 4) == 0)
+        {
+            group = 2;
+            chunks.push_back({ 1, type, type + 4, size });
+        }
+        else if (memcmp(type, "IDAT", 4) == 0)
+        {
+            group = 4;
+            chunks.push_back({ 3, type, type + 4, size });
+        }
+        else if (memcmp(type, "tIME", 4) != 0)
+            chunks.push_back({ group, type, type + 4, size });
+    }
+    if (chunks.empty() || chunks.front().group != -1)
+        throw Error(TEXT("Invalid png chunk"));
+
+    // Ancillary chunks keep their place relative to PLTE and IDAT, within that in order of type.
+    // tIME is dropped as it changes on every save.
+    std::stable_sort(chunks.begin(), chunks.end(), [](const Chunk& a, const Chunk& b)
+        {
+            if (a.group != b.group)
+                return a.group < b.group;
+            return a.group != 3 && memcmp(a.type, b.type, 4) < 0;
+        });
+
+    std::vector<BYTE> png(pData, pData + 8);
+    png.reserve(dwSize);
+    std::vector<BYTE> idat;
+    for (const Chunk& c : chunks)
+    {
+        // The split of the image data over IDAT chunks is arbitrary, it all goes in one
+        if (c.group == 3)
+            idat.insert(idat.end(), c.pData, c.pData + c.size);
+        else
+            PutChunk(png, reinterpret_cast<const char*>(c.type), c.pData, c.size);
+        if (c.group == 3 && (&c == &chunks.back() || (&c)[1].group != 3))
+            PutChunk(png, "IDAT", idat.data(), idat.size());
+    }
+    PutChunk(png, "IEND", nullptr, 0);
+    return png;
+}
@@ -0,0 +1,19 @@
+#pragma once
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <vector>
+
+class Bitmap;
+
+// PNG encoder with its own deflate so the output depends only on the pixels and effort,
+// not on the GDI+ version, and the match search can be made stronger than GDI+ does.
+// effort 1 (fastest) to 9 (longest hash chains, lazy matching)
+std::vector<BYTE> EncodePng(const Bitmap& bitmap, int effort = 6);
+
+// zlib stream of data
+std::vector<BYTE> ZlibCompress(const BYTE* pData, size_t size, int effort);
+DWORD Crc32(DWORD crc, const BYTE* pData, size_t size);
+
+// The same image with ancillary chunks in a fixed order, tIME dropped and the image data in one IDAT,
+// so files differing only in how they were written come out byte identical
+std::vector<BYTE> CanonicalPng(const BYTE* pData, DWORD dwSize);
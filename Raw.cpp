@@ -0,0 +1,265 @@
+#include "Raw.h"
+
+#include "IconImage.h"
+#include "PixelFormat.h"
+#include "Png.h"
+#include "Utils.h"
+#include <tchar.h>
+#include <algorithm>
+#include <cstring>
+#if defined(_M_IX86) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+    // RGBA <-> BGRA, red and blue trade places
+    void SwapRedBlue(const BYTE* pSrc, BYTE* pDst, int count)
+    {
+        int x = 0;
+#if defined(_M_IX86) || defined(_M_X64)
+        const __m128i ga = _mm_set1_epi32(0xFF00FF00);
+        const __m128i low = _mm_set1_epi32(0x000000FF);
+        for (; x + 4 <= count; x += 4)
+        {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSrc + x * 4));
+            const __m128i rb = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 16), low), _mm_slli_epi32(_mm_and_si128(v, low), 16));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(pDst + x * 4), _mm_or_si128(_mm_and_si128(v, ga), rb));
+        }
+#endif
+        for (; x < count; ++x)
+        {
+            const BYTE* s = pSrc + x * 4;
+            BYTE* d = pDst + x * 4;
+            const BYTE r = s[0];
+            d[0] = s[2];
+            d[1] = s[1];
+            d[2] = r;
+            d[3] = s[3];
+        }
+    }
+
+    void ConvertRow(const BYTE* pSrc, RawFormat from, BYTE* pDst, RawFormat to, int count)
+    {
+        if (from == to)
+            memmove(pDst, pSrc, count * sizeof(RGBQUAD));
+        else
+            SwapRedBlue(pSrc, pDst, count);
+    }
+
+    void CheckSize(const RawImage& image, LONG width, LONG height)
+    {
+        if (image.width != width || image.height != height)
+            throw Error(TEXT("Image size mismatch"));
+    }
+
+    Bitmap LoadBmp(const std::vector<BYTE>& data)
+    {
+        if (data.size() < sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER))
+            throw Error(TEXT("Invalid bitmap"));
+        const BITMAPFILEHEADER* pFileHeader = reinterpret_cast<const BITMAPFILEHEADER*>(data.data());
+        const BITMAPINFOHEADER* header = reinterpret_cast<const BITMAPINFOHEADER*>(data.data() + sizeof(BITMAPFILEHEADER));
+        if (header->biSize < sizeof(BITMAPINFOHEADER) || header->biSize > data.size() - sizeof(BITMAPFILEHEADER))
+            throw Error(TEXT("Invalid bitmap"));
+        if (header->biWidth <= 0 || header->biWidth > 0x10000 || header->biHeight == 0 || header->biHeight < -0x10000 || header->biHeight > 0x10000 || header->biBitCount > 32)
+            throw Error(TEXT("Invalid bitmap"));
+
+        const bool bTopDown = header->biHeight < 0;
+        const LONG width = header->biWidth;
+        const LONG height = bTopDown ? -header->biHeight : header->biHeight;
+
+        // Masks follow a plain header, the larger headers hold them in the same place
+        size_t offset = sizeof(BITMAPFILEHEADER) + header->biSize;
+        const DWORD* pBitFields = reinterpret_cast<const DWORD*>(data.data() + sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER));
+        if (header->biCompression == BI_BITFIELDS && header->biSize == sizeof(BITMAPINFOHEADER))
+            offset += 3 * sizeof(DWORD);
+
+        int iColorCount = 0;
+        if (header->biBitCount <= 8)
+        {
+            iColorCount = 1 << header->biBitCount;
+            if (header->biClrUsed != 0 && header->biClrUsed < DWORD(iColorCount))
+                iColorCount = header->biClrUsed;
+        }
+        const ULONGLONG stride = (ULONGLONG(width) * header->biBitCount + 31) / 32 * 4;
+        if (offset + iColorCount * sizeof(RGBQUAD) > data.size() || pFileHeader->bfOffBits > data.size()
+            || stride * height > data.size() - pFileHeader->bfOffBits)
+            throw Error(TEXT("Invalid bitmap"));
+
+        // Masks from any bmp, checked before PixelFormat builds its lookup tables from them
+        if (header->biCompression == BI_BITFIELDS)
+        {
+            const size_t masks = header->biSize >= sizeof(BITMAPINFOHEADER) + 4 * sizeof(DWORD) ? 4 : 3;
+            if (sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + masks * sizeof(DWORD) > data.size()
+                || !PixelFormat::AreBitFieldsValid(header, pBitFields))
+                throw Error(TEXT("Invalid bitmap"));
+        }
+
+        const PixelFormat format(header, pBitFields, reinterpret_cast<const RGBQUAD*>(data.data() + offset), iColorCount);
+        Bitmap bitmap(width, height);
+        bool bAlpha = false;
+        for (LONG y = 0; y < height; ++y)
+        {
+            const BYTE* pRow = data.data() + pFileHeader->bfOffBits + stride * (bTopDown ? y : height - 1 - y);
+            RGBQUAD* pDst = bitmap.GetRow(y);
+            format.DecodeRow(pRow, 0, width, pDst);
+            for (LONG x = 0; x < width && !bAlpha; ++x)
+                bAlpha = pDst[x].rgbReserved != 0;
+        }
+
+        // Most 32-bit bitmaps leave the fourth byte unused as 0
+        if (!bAlpha)
+        {
+            RGBQUAD* p = bitmap.GetPixels();
+            for (size_t i = 0; i < size_t(width) * height; ++i)
+                p[i].rgbReserved = 255;
+        }
+        return bitmap;
+    }
+}
+
+bool ParseRawFormat(LPCTSTR str, RawFormat& format)
+{
+    if (_tcsicmp(str, TEXT("bgra")) == 0)
+        format = RAW_BGRA;
+    else if (_tcsicmp(str, TEXT("rgba")) == 0)
+        format = RAW_RGBA;
+    else
+        return false;
+    return true;
+}
+
+RawImage View(Bitmap& bitmap)
+{
+    return { reinterpret_cast<BYTE*>(bitmap.GetPixels()), bitmap.GetWidth(), bitmap.GetHeight(), static_cast<LONG>(bitmap.GetWidth() * sizeof(RGBQUAD)), RAW_BGRA };
+}
+
+bool ViewEntry(IconFile::Entry& entry, RawImage& view)
+{
+    if (entry.IsPNG() || !entry.IsInBounds())
+        return false;
+    const BITMAPINFOHEADER* header = entry.GetBITMAPINFOHEADER();
+    if (header->biBitCount != 32 || header->biCompression != BI_RGB)
+        return false;
+
+    const LONG width = header->biWidth;
+    const LONG height = header->biHeight / 2;
+    const DWORD dwBytesPerLineXOR = entry.GetBytesPerLineXOR();
+    const DWORD dwBytesPerLineAND = entry.GetBytesPerLineAND();
+    BYTE* pXOR = reinterpret_cast<BYTE*>(entry.GetColors() + entry.GetColorSize());
+    const BYTE* pAND = pXOR + dwBytesPerLineXOR * height;
+
+    // The mask is mostly clear, only its set bits need the alpha looked at
+    for (LONG y = 0; y < height; ++y)
+    {
+        const BYTE* pMask = pAND + y * dwBytesPerLineAND;
+        const RGBQUAD* pRow = reinterpret_cast<const RGBQUAD*>(pXOR + y * dwBytesPerLineXOR);
+        for (LONG x = 0; x < width; x += 8)
+        {
+            const BYTE b = pMask[x / 8];
+            if (b == 0)
+                continue;
+            for (LONG i = 0; i < 8 && x + i < width; ++i)
+            {
+                if ((b & (0x80 >> i)) && pRow[x + i].rgbReserved != 0)
+                    return false;
+            }
+        }
+    }
+
+    view = { pXOR + (height - 1) * dwBytesPerLineXOR, width, height, -static_cast<LONG>(dwBytesPerLineXOR), RAW_BGRA };
+    return true;
+}
+
+void CopyRaw(const RawImage& src, const RawImage& dst)
+{
+    CheckSize(dst, src.width, src.height);
+    for (int y = 0; y < src.height; ++y)
+        ConvertRow(src.GetRow(y), src.format, dst.GetRow(y), dst.format, src.width);
+}
+
+Bitmap FromRaw(const RawImage& src)
+{
+    Bitmap bitmap(src.width, src.height);
+    CopyRaw(src, View(bitmap));
+    return bitmap;
+}
+
+IconFile::Entry EncodeRaw(const RawImage& src, int pngsize, const IconFile::Entry::allocator_type& alloc)
+{
+    if (src.width < 1 || src.width > 256 || src.height < 1 || src.height > 256)
+        throw Error(TEXT("Icon size not supported"));
+
+    if (pngsize > 0 && (std::max)(src.width, src.height) >= pngsize)
+    {
+        const std::vector<BYTE> png = EncodePng(FromRaw(src));
+        IconFile::Entry entry(alloc);
+        entry.dir.bWidth = static_cast<BYTE>(src.width);   // 256 wraps to 0
+        entry.dir.bHeight = static_cast<BYTE>(src.height);
+        entry.dir.wPlanes = 1;
+        entry.dir.wBitCount = 32;
+        entry.SetDataSize(static_cast<DWORD>(png.size()));
+        memcpy(entry.GetData(), png.data(), png.size());
+        return entry;
+    }
+
+    IconFile::Entry entry = CreateEntry(src.width, src.height, 32, alloc);
+    const IconImage image(entry);
+    std::vector<RGBQUAD> row(src.format == RAW_BGRA ? 0 : src.width);
+    for (int y = 0; y < src.height; ++y)
+    {
+        if (src.format == RAW_BGRA)
+            image.PutRow(y, reinterpret_cast<const RGBQUAD*>(src.GetRow(y)));
+        else
+        {
+            SwapRedBlue(src.GetRow(y), reinterpret_cast<BYTE*>(row.data()), src.width);
+            image.PutRow(y, row.data());
+        }
+    }
+    return entry;
+}
+
+IconFile IconFromRaw(const std::vector<RawImage>& images, int pngsize, std::pmr::memory_resource* mr)
+{
+    IconFile IconData(mr);
+    IconData.Header.idType = TYPE_ICON;
+    IconData.entry.reserve(images.size());
+    for (const RawImage& image : images)
+        IconData.entry.push_back(EncodeRaw(image, pngsize, IconData.entry.get_allocator()));
+    IconData.UpdateOffsets();
+    return IconData;
+}
+
+void ExportEntry(const IconFile::Entry& entry, const RawImage& dst)
+{
+    if (entry.IsPNG())
+    {
+        Bitmap bitmap = Decode(entry);
+        CopyRaw(View(bitmap), dst);
+        return;
+    }
+
+    const IconImage image(entry);
+    CheckSize(dst, image.GetWidth(), image.GetHeight());
+    std::vector<RGBQUAD> row(dst.format == RAW_BGRA ? 0 : image.GetWidth());
+    for (int y = 0; y < image.GetHeight(); ++y)
+    {
+        if (dst.format == RAW_BGRA)
+            image.GetRow(y, reinterpret_cast<RGBQUAD*>(dst.GetRow(y)));
+        else
+        {
+            image.GetRow(y, row.data());
+            SwapRedBlue(reinterpret_cast<const BYTE*>(row.data()), dst.GetRow(y), image.GetWidth());
+        }
+    }
+}
+
+Bitmap LoadImageFile(LPCTSTR lpFilename)
+{
+    const std::vector<BYTE> data = ReadAllBytes(lpFilename);
+    if (IsPNG(data.data(), data.size()))
+        return DecodePng(data.data(), static_cast<DWORD>(data.size()));
+    if (data.size() >= 2 && data[0] == 'B' && data[1] == 'M')
+        return LoadBmp(data);
+    throw Error(TEXT("Not a png or bmp file"));
+}
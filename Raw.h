@@ -0,0 +1,47 @@
+#pragma once
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <cstddef>
+#include <vector>
+
+#include "Bitmap.h"
+#include "IconFile.h"
+
+enum RawFormat { RAW_BGRA, RAW_RGBA };
+
+bool ParseRawFormat(LPCTSTR str, RawFormat& format);
+
+// 32-bit straight alpha pixels in memory owned elsewhere, eg a frame in shared memory.
+// Rows are stride bytes apart, negative for a bottom-up image with pPixels at the top row.
+struct RawImage
+{
+    BYTE* pPixels;
+    LONG width;
+    LONG height;
+    LONG stride;
+    RawFormat format;
+
+    BYTE* GetRow(int y) const { return pPixels + static_cast<ptrdiff_t>(y) * stride; }
+};
+
+// No copy, valid while bitmap is unchanged
+RawImage View(Bitmap& bitmap);
+// No copy where the entry already holds what Decode would give: 32-bit BI_RGB with every pixel
+// hidden by the AND mask also at alpha 0. The view is bottom-up into the entry data.
+bool ViewEntry(IconFile::Entry& entry, RawImage& view);
+
+// Equal sizes, the format is converted on the way
+void CopyRaw(const RawImage& src, const RawImage& dst);
+Bitmap FromRaw(const RawImage& src);
+
+// A 32-bit entry, PNG from pngsize up (0 for never). BMP entries are written straight from the
+// source rows, with no intermediate bitmap when it is BGRA.
+IconFile::Entry EncodeRaw(const RawImage& src, int pngsize, const IconFile::Entry::allocator_type& alloc = {});
+// An entry per image, in order
+IconFile IconFromRaw(const std::vector<RawImage>& images, int pngsize, std::pmr::memory_resource* mr = std::pmr::get_default_resource());
+
+// dst is the size of the entry. BMP entries decode straight into dst rows when it is BGRA.
+void ExportEntry(const IconFile::Entry& entry, const RawImage& dst);
+
+// A .png or .bmp file, BMP by the PixelFormat table
+Bitmap LoadImageFile(LPCTSTR lpFilename);
@@ -0,0 +1,145 @@
+#include "ResourceIndex.h"
+
+#include "Utils.h"
+#include <algorithm>
+#include <functional>
+
+size_t ResourceIndex::KeyHash::operator()(const Key& key) const
+{
+    auto hash = [](const ResourceId& id)
+    {
+        return id.IsName() ? std::hash<std::wstring>()(id.GetName()) : id.GetId();
+    };
+    return hash(key.type) * 31 + hash(key.name);
+}
+
+BOOL CALLBACK ResourceIndex::IndexType(HMODULE hModule, LPTSTR lpType, LONG_PTR lParam)
+{
+    EnumResourceNames(hModule, lpType, IndexName, lParam);
+    return TRUE;
+}
+
+BOOL CALLBACK ResourceIndex::IndexName(HMODULE hModule, LPCTSTR lpType, LPTSTR lpName, LONG_PTR lParam)
+{
+    EnumResourceLanguages(hModule, lpType, lpName, IndexLanguage, lParam);
+    return TRUE;
+}
+
+BOOL CALLBACK ResourceIndex::IndexLanguage(HMODULE hModule, LPCTSTR lpType, LPCTSTR lpName, WORD wLanguage, LONG_PTR lParam)
+{
+    ResourceIndex* pIndex = reinterpret_cast<ResourceIndex*>(lParam);
+
+    const HRSRC hResInfo = FindResourceEx(hModule, lpType, lpName, wLanguage);
+    if (hResInfo == NULL)
+        return TRUE;
+    const HGLOBAL hRes = LoadResource(hModule, hResInfo);
+    if (hRes == NULL)
+        return TRUE;
+
+    const Range range = { static_cast<const BYTE*>(LockResource(hRes)), SizeofResource(hModule, hResInfo) };
+    pIndex->index[{ ResourceId(lpType), ResourceId(lpName) }].push_back({ wLanguage, range });
+    return TRUE;
+}
+
+ResourceIndex::ResourceIndex(HMODULE hModule)
+{
+    EnumResourceTypes(hModule, IndexType, reinterpret_cast<LONG_PTR>(this));
+}
+
+ResourceIndex::ResourceIndex(HMODULE hModule, std::initializer_list<LPCTSTR> types)
+{
+    for (LPCTSTR lpType : types)
+        EnumResourceNames(hModule, lpType, IndexName, reinterpret_cast<LONG_PTR>(this));
+}
+
+ResourceIndex::ResourceIndex(const ResourceTree& resources)
+{
+    for (const auto& type : resources)
+        for (const auto& name : type.second)
+        {
+            Langs& langs = index[{ type.first, name.first }];
+            for (const auto& lang : name.second)
+                langs.push_back({ lang.first, { lang.second.data.data(), static_cast<DWORD>(lang.second.data.size()) } });
+        }
+}
+
+const ResourceIndex::Langs* ResourceIndex::FindLangs(const ResourceId& type, const ResourceId& name) const
+{
+    const auto it = index.find({ type, name });
+    return it != index.end() && !it->second.empty() ? &it->second : nullptr;
+}
+
+const ResourceIndex::Range* ResourceIndex::FindExact(const ResourceId& type, const ResourceId& name, LANGID lang) const
+{
+    const Langs* langs = FindLangs(type, name);
+    if (langs == nullptr)
+        return nullptr;
+    for (const auto& l : *langs)
+        if (l.first == lang)
+            return &l.second;
+    return nullptr;
+}
+
+const ResourceIndex::Range* ResourceIndex::Find(const ResourceId& type, const ResourceId& name, LANGID lang, LANGID* pFound) const
+{
+    const Langs* langs = FindLangs(type, name);
+    if (langs == nullptr)
+        return nullptr;
+
+    std::vector<LANGID> available;
+    for (const auto& l : *langs)
+        available.push_back(l.first);
+    const LANGID picked = PickLanguage(available, lang);
+    const auto found = std::find_if(langs->begin(), langs->end(), [picked](const auto& l) { return l.first == picked; });
+    if (pFound != nullptr)
+        *pFound = picked;
+    return &found->second;
+}
+
+std::vector<ResourceId> ResourceIndex::GetNames(const ResourceId& type) const
+{
+    std::vector<ResourceId> names;
+    for (const auto& it : index)
+        if (it.first.type == type)
+            names.push_back(it.first.name);
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+std::vector<LANGID> ResourceIndex::GetLanguages(const ResourceId& type, const ResourceId& name) const
+{
+    std::vector<LANGID> langs;
+    if (const Langs* l = FindLangs(type, name))
+        for (const auto& it : *l)
+            langs.push_back(it.first);
+    return langs;
+}
+
+std::vector<LANGID> GetLanguageFallback(LANGID lang)
+{
+    const LANGID candidates[] = {
+        lang,
+        MAKELANGID(PRIMARYLANGID(lang), SUBLANG_NEUTRAL),
+        MAKELANGID(PRIMARYLANGID(lang), SUBLANG_DEFAULT),
+        MAKELANGID(LANG_NEUTRAL, SUBLANG_NEUTRAL),
+        GetUserDefaultUILanguage(),
+        MAKELANGID(LANG_ENGLISH, SUBLANG_ENGLISH_US),
+    };
+
+    std::vector<LANGID> langs;
+    for (const LANGID l : candidates)
+        if (std::find(langs.begin(), langs.end(), l) == langs.end())
+            langs.push_back(l);
+    return langs;
+}
+
+LANGID PickLanguage(const std::vector<LANGID>& available, LANGID lang)
+{
+    for (const LANGID fallback : GetLanguageFallback(lang))
+        if (std::find(available.begin(), available.end(), fallback) != available.end())
+            return fallback;
+
+    // Any sublanguage of the same language, otherwise whatever there is
+    const auto it = std::find_if(available.begin(), available.end(), [lang](LANGID l) { return PRIMARYLANGID(l) == PRIMARYLANGID(lang); });
+    return it != available.end() ? *it : available.front();
+}
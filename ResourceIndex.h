@@ -0,0 +1,66 @@
+#pragma once
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <initializer_list>
+#include <unordered_map>
+#include <vector>
+
+#include "PeFile.h"
+
+// Every resource of a module by type, name and language.
+// Built once so lookups don't walk the resource tree, the data is not copied
+// so the module (or ResourceTree) must outlive the index.
+class ResourceIndex
+{
+public:
+    struct Range
+    {
+        const BYTE* pData;
+        DWORD dwSize;
+    };
+
+    explicit ResourceIndex(HMODULE hModule);
+    // Only the resources of these types, for a lookup that shouldn't walk the whole module
+    ResourceIndex(HMODULE hModule, std::initializer_list<LPCTSTR> types);
+    explicit ResourceIndex(const ResourceTree& resources);
+
+    // The best language of a resource by the fallback chain for lang, nullptr if there is none.
+    // pFound receives the language picked.
+    const Range* Find(const ResourceId& type, const ResourceId& name, LANGID lang, LANGID* pFound = nullptr) const;
+    // Exact language only
+    const Range* FindExact(const ResourceId& type, const ResourceId& name, LANGID lang) const;
+
+    std::vector<ResourceId> GetNames(const ResourceId& type) const;
+    std::vector<LANGID> GetLanguages(const ResourceId& type, const ResourceId& name) const;
+
+private:
+    struct Key
+    {
+        ResourceId type;
+        ResourceId name;
+
+        bool operator==(const Key& other) const { return type == other.type && name == other.name; }
+    };
+
+    struct KeyHash
+    {
+        size_t operator()(const Key& key) const;
+    };
+
+    typedef std::vector<std::pair<LANGID, Range>> Langs;
+
+    const Langs* FindLangs(const ResourceId& type, const ResourceId& name) const;
+
+    static BOOL CALLBACK IndexType(HMODULE hModule, LPTSTR lpType, LONG_PTR lParam);
+    static BOOL CALLBACK IndexName(HMODULE hModule, LPCTSTR lpType, LPTSTR lpName, LONG_PTR lParam);
+    static BOOL CALLBACK IndexLanguage(HMODULE hModule, LPCTSTR lpType, LPCTSTR lpName, WORD wLanguage, LONG_PTR lParam);
+
+    std::unordered_map<Key, Langs, KeyHash> index;
+};
+
+// Languages to try in order for lang: itself, its primary language, neutral,
+// the user's UI language then US English
+std::vector<LANGID> GetLanguageFallback(LANGID lang);
+// The one of available, which must not be empty, that lang picks: the first in its fallback chain,
+// any sublanguage of the same language, otherwise the first
+LANGID PickLanguage(const std::vector<LANGID>& available, LANGID lang);
@@ -0,0 +1,212 @@
+#include "Terminal.h"
+
+#include "Utils.h"
+#include <cstdio>
+#include <algorithm>
+
+namespace
+{
+    const char UPPER_HALF_BLOCK[] = "\xE2\x96\x80"; // U+2580 in UTF-8
+    const char LOWER_HALF_BLOCK[] = "\xE2\x96\x84"; // U+2584 in UTF-8
+
+    // Colour of a cell half, rgbReserved == 0 means terminal default
+    RGBQUAD ToCell(const RGBQUAD c)
+    {
+        if (c.rgbReserved == 0)
+            return { 128, 128, 128, 255 };
+        else
+            return { c.rgbBlue, c.rgbGreen, c.rgbRed, 255 };
+    }
+
+    const RGBQUAD NONE = {};
+
+    bool operator==(const RGBQUAD a, const RGBQUAD b)
+    {
+        return a.rgbBlue == b.rgbBlue && a.rgbGreen == b.rgbGreen && a.rgbRed == b.rgbRed && a.rgbReserved == b.rgbReserved;
+    }
+
+    bool operator!=(const RGBQUAD a, const RGBQUAD b)
+    {
+        return !(a == b);
+    }
+
+    void AppendNumber(std::string& out, int n)
+    {
+        if (n >= 100)
+            out += char('0' + n / 100);
+        if (n >= 10)
+            out += char('0' + n / 10 % 10);
+        out += char('0' + n % 10);
+    }
+
+    class Cursor
+    {
+    public:
+        Cursor(std::string& out)
+            : out(out), fg(NONE), bg(NONE)
+        {
+        }
+
+        void Foreground(const RGBQUAD c)
+        {
+            if (fg != c)
+            {
+                Colour(38, c);
+                fg = c;
+            }
+        }
+
+        void Background(const RGBQUAD c)
+        {
+            if (bg != c)
+            {
+                if (c.rgbReserved == 0)
+                    out += "\x1b[49m";
+                else
+                    Colour(48, c);
+                bg = c;
+            }
+        }
+
+        void Cell(const RGBQUAD top, const RGBQUAD bottom)
+        {
+            if (top == bottom)
+            {
+                Background(top);
+                out += ' ';
+            }
+            else if (top.rgbReserved == 0)
+            {
+                Background(NONE);
+                Foreground(bottom);
+                out += LOWER_HALF_BLOCK;
+            }
+            else
+            {
+                Background(bottom);
+                Foreground(top);
+                out += UPPER_HALF_BLOCK;
+            }
+        }
+
+        void EndLine()
+        {
+            if (fg.rgbReserved != 0 || bg.rgbReserved != 0)
+                out += "\x1b[0m";
+            out += '\n';
+            fg = NONE;
+            bg = NONE;
+        }
+
+    private:
+        void Colour(int sgr, const RGBQUAD c)
+        {
+            out += "\x1b[";
+            AppendNumber(out, sgr);
+            out += ";2;";
+            AppendNumber(out, c.rgbRed);
+            out += ';';
+            AppendNumber(out, c.rgbGreen);
+            out += ';';
+            AppendNumber(out, c.rgbBlue);
+            out += 'm';
+        }
+
+        std::string& out;
+        RGBQUAD fg;
+        RGBQUAD bg;
+    };
+
+    int GetConsoleColumns()
+    {
+        CONSOLE_SCREEN_BUFFER_INFO csbi;
+        if (GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &csbi))
+            return csbi.srWindow.Right - csbi.srWindow.Left + 1;
+        else
+            return 80;
+    }
+}
+
+TerminalSheet::TerminalSheet(int iColumns)
+    : iColumns(iColumns > 0 ? iColumns : GetConsoleColumns())
+{
+}
+
+void TerminalSheet::Add(const IconImage& image)
+{
+    Tile tile;
+    tile.width = image.GetWidth();
+    tile.height = image.GetHeight();
+    tile.pixels.resize(tile.width * tile.height);
+    for (int y = 0; y < tile.height; ++y)
+        image.GetRow(y, tile.pixels.data() + y * tile.width);
+    std::transform(tile.pixels.begin(), tile.pixels.end(), tile.pixels.begin(), ToCell);
+    tiles.push_back(std::move(tile));
+}
+
+void TerminalSheet::RenderRow(std::string& out, std::vector<Tile>::const_iterator begin, std::vector<Tile>::const_iterator end) const
+{
+    LONG height = 0;
+    for (auto it = begin; it != end; ++it)
+        if (it->height > height)
+            height = it->height;
+
+    Cursor cursor(out);
+    for (int y = 0; y < height; y += 2)
+    {
+        for (auto it = begin; it != end; ++it)
+        {
+            if (it != begin)
+                cursor.Cell(NONE, NONE);
+            for (int x = 0; x < it->width; ++x)
+            {
+                const RGBQUAD top = y < it->height ? it->GetPixel(x, y) : NONE;
+                const RGBQUAD bottom = y + 1 < it->height ? it->GetPixel(x, y + 1) : NONE;
+                cursor.Cell(top, bottom);
+            }
+        }
+        cursor.EndLine();
+    }
+    cursor.EndLine();
+}
+
+std::string TerminalSheet::Render() const
+{
+    std::string out;
+    auto begin = tiles.begin();
+    while (begin != tiles.end())
+    {
+        // Pack as many tiles as fit across the terminal, always at least one
+        auto end = begin;
+        int width = 0;
+        do
+        {
+            width += end->width + 1;
+            ++end;
+        } while (end != tiles.end() && width + end->width <= iColumns);
+
+        RenderRow(out, begin, end);
+        begin = end;
+    }
+    return out;
+}
+
+void TerminalSheet::Flush()
+{
+    const std::string out = Render();
+
+    fflush(stdout);
+    const UINT cp = GetConsoleOutputCP();
+    SetConsoleOutputCP(CP_UTF8);
+    try
+    {
+        CheckWriteFile(GetStdHandle(STD_OUTPUT_HANDLE), out.data(), static_cast<DWORD>(out.size()));
+        SetConsoleOutputCP(cp);
+    }
+    catch (...)
+    {
+        SetConsoleOutputCP(cp);
+        throw;
+    }
+    tiles.clear();
+}
@@ -0,0 +1,37 @@
+#pragma once
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <string>
+#include <vector>
+
+#include "IconImage.h"
+
+// Renders images to a 24-bit colour terminal.
+// Uses the upper half block so each character cell shows two pixel rows,
+// emits colour escapes only when the colour changes
+// and builds the whole frame in one buffer for a single write.
+class TerminalSheet
+{
+public:
+    explicit TerminalSheet(int iColumns = 0);
+
+    void Add(const IconImage& image);
+
+    std::string Render() const;
+    void Flush();
+
+private:
+    struct Tile
+    {
+        LONG width;
+        LONG height;
+        std::vector<RGBQUAD> pixels;
+
+        RGBQUAD GetPixel(int x, int y) const { return pixels[y * width + x]; }
+    };
+
+    void RenderRow(std::string& out, std::vector<Tile>::const_iterator begin, std::vector<Tile>::const_iterator end) const;
+
+    int iColumns;
+    std::vector<Tile> tiles;
+};
@@ -1,7 +1,10 @@
 #pragma once
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#include <tchar.h>
+#include <new>
 #include <string>
+#include <vector>
 
 #ifdef UNICODE
 #define tstring wstring
@@ -37,6 +40,83 @@ private:
     std::tstring m_msg;
 };
 
+// Describes the exception being handled, call from a catch block
+inline std::tstring ErrorMessage()
+{
+    try
+    {
+        throw;
+    }
+    catch (const WinError& e)
+    {
+        TCHAR msg[32];
+        _stprintf_s(msg, ARRAYSIZE(msg), TEXT("Error: 0x%08x"), e.GetError());
+        return msg;
+    }
+    catch (const Error& e)
+    {
+        return e.GetMsg();
+    }
+    catch (const std::bad_alloc&)
+    {
+        return TEXT("Out of memory");
+    }
+    catch (...)
+    {
+        return TEXT("Unknown error");
+    }
+}
+
+inline std::string ToUtf8(const std::tstring& s)
+{
+#ifdef UNICODE
+    if (s.empty())
+        return std::string();
+    const int len = WideCharToMultiByte(CP_UTF8, 0, s.data(), static_cast<int>(s.size()), nullptr, 0, nullptr, nullptr);
+    std::string r(len, '\0');
+    WideCharToMultiByte(CP_UTF8, 0, s.data(), static_cast<int>(s.size()), &r[0], len, nullptr, nullptr);
+    return r;
+#else
+    return s;
+#endif
+}
+
+inline void AppendJsonString(std::string& out, const std::tstring& s)
+{
+    out += '"';
+    for (const char c : ToUtf8(s))
+    {
+        switch (c)
+        {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        default: out += c; break;
+        }
+    }
+    out += '"';
+}
+
+inline void AppendCsvString(std::string& out, const std::tstring& s)
+{
+    out += '"';
+    for (const char c : ToUtf8(s))
+    {
+        if (c == '"')
+            out += '"';
+        out += c;
+    }
+    out += '"';
+}
+
+inline bool HasExtension(LPCTSTR lpFilename, LPCTSTR ext)
+{
+    LPCTSTR e = _tcsrchr(lpFilename, TEXT('.'));
+    return e != nullptr && _tcsicmp(e, ext) == 0;
+}
+
 #define CHECK(expr) if (!(expr)) throw WinError();
 
 inline void CheckReadFile(
@@ -48,6 +128,20 @@ inline void CheckReadFile(
     CHECK(ReadFile(hFile, lpBuffer, nNumberOfBytesToRead, &dwRead, nullptr) && dwRead == nNumberOfBytesToRead);
 }
 
+// Reads at offset whatever the file pointer, no seek first
+inline void CheckReadFileAt(
+    _In_ HANDLE hFile,
+    _In_ ULONGLONG offset,
+    _Out_writes_bytes_(nNumberOfBytesToRead) LPVOID lpBuffer,
+    _In_ DWORD nNumberOfBytesToRead)
+{
+    OVERLAPPED ov = {};
+    ov.Offset = static_cast<DWORD>(offset);
+    ov.OffsetHigh = static_cast<DWORD>(offset >> 32);
+    DWORD dwRead = 0;
+    CHECK(ReadFile(hFile, lpBuffer, nNumberOfBytesToRead, &dwRead, &ov) && dwRead == nNumberOfBytesToRead);
+}
+
 inline void CheckWriteFile(
     _In_ HANDLE hFile,
     _In_reads_bytes_(nNumberOfBytesToWrite) LPCVOID lpBuffer,
@@ -56,3 +150,43 @@ inline void CheckWriteFile(
     DWORD dwWrite = 0;
     CHECK(WriteFile(hFile, lpBuffer, nNumberOfBytesToWrite, &dwWrite, nullptr) && dwWrite == nNumberOfBytesToWrite);
 }
+
+inline void WriteAllBytes(LPCTSTR lpFilename, LPCVOID pData, size_t size)
+{
+    if (size > MAXDWORD)
+        throw Error(TEXT("File too large"));
+    const HANDLE hFile = CreateFile(lpFilename, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, 0, NULL);
+    CHECK(hFile != INVALID_HANDLE_VALUE);
+    try
+    {
+        CheckWriteFile(hFile, pData, static_cast<DWORD>(size));
+        CloseHandle(hFile);
+    }
+    catch (...)
+    {
+        CloseHandle(hFile);
+        throw;
+    }
+}
+
+inline std::vector<BYTE> ReadAllBytes(LPCTSTR lpFilename)
+{
+    const HANDLE hFile = CreateFile(lpFilename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    CHECK(hFile != INVALID_HANDLE_VALUE);
+    try
+    {
+        LARGE_INTEGER size;
+        CHECK(GetFileSizeEx(hFile, &size));
+        if (size.QuadPart > MAXDWORD)
+            throw Error(TEXT("File too large"));
+        std::vector<BYTE> data(static_cast<size_t>(size.QuadPart));
+        CheckReadFile(hFile, data.data(), static_cast<DWORD>(data.size()));
+        CloseHandle(hFile);
+        return data;
+    }
+    catch (...)
+    {
+        CloseHandle(hFile);
+        throw;
+    }
+}
@@ -0,0 +1,67 @@
+// libFuzzer target for IconImage and the pixel formats. The input is an ICONDIR followed by the entry data,
+// Validate runs on it, then every row, the mask and an indexed transform whether it passed or not.
+// Build fuzz\FuzzImage.vcxproj (x64) and run
+//     FuzzImage.exe corpus
+#include "Bitmap.h"
+#include "IconFile.h"
+#include "IconImage.h"
+#include "Utils.h"
+#include <cstdint>
+#include <cstring>
+#include <memory_resource>
+
+// Invalid input may only surface as Error or WinError, anything else reaches libFuzzer as a crash
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    if (size < sizeof(ICONDIR))
+        return 0;
+
+    std::pmr::monotonic_buffer_resource arena;
+    IconFile IconData(&arena);
+    IconData.Header.idType = TYPE_ICON;
+    IconData.entry.emplace_back();
+    IconFile::Entry& entry = IconData.entry.back();
+    memcpy(&entry.dir, data, sizeof(ICONDIR));
+    entry.DataFromMemory(data + sizeof(ICONDIR), size - sizeof(ICONDIR));
+    // PNG entries decode through GDI+, not this code
+    if (entry.IsPNG())
+        return 0;
+    IconData.UpdateOffsets();
+
+    try
+    {
+        IconData.Validate(false);
+    }
+    catch (const Error&)
+    {
+    }
+
+    try
+    {
+        const IconImage image(entry);
+        std::vector<RGBQUAD> row(image.GetWidth());
+        for (int y = 0; y < image.GetHeight(); ++y)
+        {
+            image.GetRow(y, row.data());
+            image.PutRow(y, row.data());
+        }
+        image.PutMask(image.GetMask());
+        if (image.IsIndexed())
+        {
+            image.TransformIndexed([](RGBQUAD c)
+                {
+                    c.rgbRed = static_cast<BYTE>(255 - c.rgbRed);
+                    c.rgbReserved = c.rgbGreen < 128 ? 0 : 255;
+                    return c;
+                });
+        }
+        Decode(entry);
+    }
+    catch (const Error&)
+    {
+    }
+    catch (const WinError&)
+    {
+    }
+    return 0;
+}
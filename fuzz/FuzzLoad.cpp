@@ -0,0 +1,73 @@
+// libFuzzer target for IconFile::Load, the filtered Load and FromMemory. The input is an .ico or .cur file.
+// Build fuzz\FuzzLoad.vcxproj (x64), seed a corpus with "IcoUtils generate corpus 100" and run
+//     FuzzLoad.exe corpus
+#include "IconFile.h"
+#include "Utils.h"
+#include <cstdint>
+#include <memory_resource>
+
+namespace
+{
+    // Load only takes a file name, each process writes the input to its own file
+    std::tstring InputFile()
+    {
+        TCHAR dir[MAX_PATH];
+        CHECK(GetTempPath(ARRAYSIZE(dir), dir));
+        return std::tstring(dir) + TEXT("FuzzLoad") + std::to_wstring(GetCurrentProcessId()) + TEXT(".ico");
+    }
+
+    void SaveAgain(const IconFile& IconData)
+    {
+        std::pmr::monotonic_buffer_resource arena;
+        const std::vector<BYTE> data = IconData.SaveToMemory(true);
+        IconFile::FromMemory(data.data(), data.size(), true, &arena);
+    }
+}
+
+// Invalid input may only surface as Error or WinError, anything else reaches libFuzzer as a crash
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    static const std::tstring file = InputFile();
+    try
+    {
+        WriteAllBytes(file.c_str(), data, size);
+    }
+    catch (const WinError&)
+    {
+        return 0;
+    }
+
+    try
+    {
+        std::pmr::monotonic_buffer_resource arena;
+        SaveAgain(IconFile::Load(file.c_str(), true, &arena));
+    }
+    catch (const Error&)
+    {
+    }
+    catch (const WinError&)
+    {
+    }
+
+    try
+    {
+        std::pmr::monotonic_buffer_resource arena;
+        SaveAgain(IconFile::Load(file.c_str(), [](int i, const ICONDIR& dir) { return i % 2 == 1 || dir.wBitCount == 32; }, false, &arena));
+    }
+    catch (const Error&)
+    {
+    }
+    catch (const WinError&)
+    {
+    }
+
+    try
+    {
+        std::pmr::monotonic_buffer_resource arena;
+        IconFile::FromMemory(data, size, false, &arena);
+    }
+    catch (const Error&)
+    {
+    }
+    return 0;
+}
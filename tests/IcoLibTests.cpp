@@ -0,0 +1,497 @@
+#include "AniFile.h"
+#include "Atlas.h"
+#include "Bitmap.h"
+#include "Generate.h"
+#include "IconFile.h"
+#include "IconImage.h"
+#include "IconOps.h"
+#include "Job.h"
+#include "Mask.h"
+#include "PeFile.h"
+#include "Pipeline.h"
+#include "ResourceIndex.h"
+#include "Utils.h"
+#include <tchar.h>
+#include <cstdio>
+#include <cstring>
+#include <memory_resource>
+
+namespace
+{
+    int g_failed = 0;
+
+#define TEST(x) if (!(x)) { ++g_failed; _ftprintf(stderr, TEXT("%hs(%d): failed: %s\n"), __FILE__, __LINE__, TEXT(#x)); }
+
+    // Counts what is allocated through it, the memory comes from the default resource
+    class CountingResource : public std::pmr::memory_resource
+    {
+    public:
+        size_t allocations = 0;
+
+    private:
+        void* do_allocate(size_t bytes, size_t alignment) override
+        {
+            ++allocations;
+            return std::pmr::get_default_resource()->allocate(bytes, alignment);
+        }
+
+        void do_deallocate(void* p, size_t bytes, size_t alignment) override
+        {
+            std::pmr::get_default_resource()->deallocate(p, bytes, alignment);
+        }
+
+        bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+        {
+            return this == &other;
+        }
+    };
+
+    std::tstring TempFile(LPCTSTR name)
+    {
+        TCHAR dir[MAX_PATH];
+        CHECK(GetTempPath(ARRAYSIZE(dir), dir));
+        return std::tstring(dir) + name;
+    }
+
+    GenerateOptions SmallIcon()
+    {
+        GenerateOptions options;
+        options.sizes = { 16, 32 };
+        options.depths = { 4, 32 };
+        options.pngsize = 0;
+        return options;
+    }
+
+    // The entry table once and each payload once, nothing is copied on the way through
+    void TestLoadTransformSaveAllocations()
+    {
+        const std::vector<BYTE> bytes = IconGenerator(1).GenerateIcon(SmallIcon()).SaveToMemory(false);
+        const std::tstring file = TempFile(TEXT("IcoLibTests.ico"));
+        WriteAllBytes(file.c_str(), bytes.data(), bytes.size());
+
+        CountingResource counter;
+        IconFile IconData = IconFile::Load(file.c_str(), false, &counter);
+        const size_t entries = IconData.entry.size();
+        TEST(entries == 4);
+        TEST(counter.allocations == 1 + entries);
+
+        Recolor(IconData.entry[0], RGBQUAD{ 0, 0, 0, 0 }, RGBQUAD{ 255, 255, 255, 0 });
+        IconFile moved = std::move(IconData);
+        TEST(counter.allocations == 1 + entries);
+
+        const std::vector<BYTE> saved = moved.SaveToMemory(false);
+        TEST(counter.allocations == 1 + entries);
+        TEST(saved.size() == bytes.size());
+
+        DeleteFile(file.c_str());
+    }
+
+    // The command line picks a loader with ?:, the result has to be built in place
+    void TestConditionalInitialiserAllocations()
+    {
+        IconGenerator generator(2);
+        const std::vector<BYTE> icon = generator.GenerateIcon(SmallIcon()).SaveToMemory(false);
+        const std::vector<BYTE> module = generator.GenerateModule(SmallIcon(), 1);
+        const std::tstring icofile = TempFile(TEXT("IcoLibTests.ico"));
+        const std::tstring dllfile = TempFile(TEXT("IcoLibTests.dll"));
+        WriteAllBytes(icofile.c_str(), icon.data(), icon.size());
+        WriteAllBytes(dllfile.c_str(), module.data(), module.size());
+
+        for (const bool bResource : { false, true })
+        {
+            CountingResource counter;
+            const IconFile IconData = bResource
+                ? IconFile::FromResource(dllfile.c_str(), 1, 0, false, &counter)
+                : IconFile::Load(icofile.c_str(), false, &counter);
+            TEST(IconData.entry.size() == 4);
+            TEST(counter.allocations == 1 + IconData.entry.size());
+        }
+
+        DeleteFile(icofile.c_str());
+        DeleteFile(dllfile.c_str());
+    }
+
+    // Black and white swapped on a 4-bit entry where black is also under masked pixels:
+    // index 0 becomes white for the visible pixels, the masked ones must not follow it
+    void TestTransformIndexedSharedSwap()
+    {
+        IconFile::Entry entry = CreateEntry(16, 16, 4);
+        const IconImage image(entry);
+        std::vector<BYTE> row(16, 7);
+        row[0] = 0;
+        row[1] = 0;
+        row[2] = 15;
+        for (int y = 0; y < 16; ++y)
+            image.PutIndexRow(y, row.data());
+        Mask mask = image.GetMask();
+        mask.Set(1, 0, true);
+        image.PutMask(mask);
+
+        const RGBQUAD black = { 0, 0, 0, 255 };
+        const RGBQUAD white = { 255, 255, 255, 255 };
+        auto equal = [](RGBQUAD a, RGBQUAD b) { return a.rgbRed == b.rgbRed && a.rgbGreen == b.rgbGreen && a.rgbBlue == b.rgbBlue && a.rgbReserved == b.rgbReserved; };
+        image.TransformIndexed([&](RGBQUAD c)
+            {
+                if (c.rgbReserved != 0 && equal(c, black))
+                    return white;
+                if (c.rgbReserved != 0 && equal(c, white))
+                    return black;
+                return c;
+            });
+
+        TEST(equal(image.GetColour(0, 0), white));
+        TEST(equal(image.GetColour(2, 0), black));
+        TEST(equal(image.GetColour(0, 1), white));
+        TEST(equal(image.GetColour(2, 1), black));
+        const RGBQUAD masked = image.GetColour(1, 0);
+        TEST(masked.rgbReserved == 0 && masked.rgbRed == 0 && masked.rgbGreen == 0 && masked.rgbBlue == 0);
+    }
+
+    // Three BI_BITFIELDS masks carry no alpha, the pixels are opaque unless the AND mask hides them
+    void TestBitFieldsThreeMasksOpaque()
+    {
+        const DWORD masks[3] = { 0x00FF0000, 0x0000FF00, 0x000000FF };
+        const DWORD pixels[2] = { 0x00123456, 0x00123456 };
+        const BYTE andmask[4] = { 0x40, 0, 0, 0 };
+
+        BITMAPINFOHEADER header = {};
+        header.biSize = sizeof(BITMAPINFOHEADER);
+        header.biWidth = 2;
+        header.biHeight = 2;
+        header.biPlanes = 1;
+        header.biBitCount = 32;
+        header.biCompression = BI_BITFIELDS;
+
+        ICONHEADER iconheader = {};
+        iconheader.idType = TYPE_ICON;
+        iconheader.idCount = 1;
+        ICONDIR dir = {};
+        dir.bWidth = 2;
+        dir.bHeight = 1;
+        dir.wPlanes = 1;
+        dir.wBitCount = 32;
+        dir.dwBytesInRes = sizeof(header) + sizeof(masks) + sizeof(pixels) + sizeof(andmask);
+        dir.dwImageOffset = sizeof(iconheader) + sizeof(dir);
+
+        std::vector<BYTE> data;
+        auto append = [&data](const void* p, size_t size) { data.insert(data.end(), static_cast<const BYTE*>(p), static_cast<const BYTE*>(p) + size); };
+        append(&iconheader, sizeof(iconheader));
+        append(&dir, sizeof(dir));
+        append(&header, sizeof(header));
+        append(masks, sizeof(masks));
+        append(pixels, sizeof(pixels));
+        append(andmask, sizeof(andmask));
+
+        const IconFile IconData = IconFile::FromMemory(data.data(), data.size(), false);
+        const IconImage image(IconData.entry.at(0));
+        const RGBQUAD visible = image.GetColour(0, 0);
+        TEST(visible.rgbReserved == 255 && visible.rgbRed == 0x12 && visible.rgbGreen == 0x34 && visible.rgbBlue == 0x56);
+        TEST(image.GetColour(1, 0).rgbReserved == 0);
+    }
+
+    // Padding past the width must stay clear, the icon AND mask is written from these rows as they are
+    bool IsPaddingClear(const Mask& mask)
+    {
+        for (int y = 0; y < mask.GetHeight(); ++y)
+            for (int x = mask.GetWidth(); x < static_cast<int>(mask.GetBytesPerLine() * 8); ++x)
+                if (mask.Get(x, y))
+                    return false;
+        return true;
+    }
+
+    // Dilate and erode against a pixel by pixel reference, at widths around the 32 bit words
+    // so the carry between words and the fill of the last word are exercised
+    void TestMaskMorphology()
+    {
+        for (const int width : { 1, 31, 32, 33, 37, 64, 70 })
+        {
+            const int height = 5;
+            Mask mask(width, height);
+            for (int y = 0; y < height; ++y)
+                for (int x = 0; x < width; ++x)
+                    mask.Set(x, y, (x * 7 + y * 13) % 5 == 0 || x == 31 || x == 32);
+
+            for (const bool bDilate : { true, false })
+            {
+                Mask morphed = mask;
+                if (bDilate)
+                    morphed.Dilate();
+                else
+                    morphed.Erode();
+
+                bool bMatch = true;
+                for (int y = 0; y < height; ++y)
+                    for (int x = 0; x < width; ++x)
+                    {
+                        bool expected = !bDilate;
+                        for (int dy = -1; dy <= 1; ++dy)
+                            for (int dx = -1; dx <= 1; ++dx)
+                                if (x + dx >= 0 && x + dx < width && y + dy >= 0 && y + dy < height)
+                                    expected = bDilate ? expected || mask.Get(x + dx, y + dy) : expected && mask.Get(x + dx, y + dy);
+                        bMatch = bMatch && morphed.Get(x, y) == expected;
+                    }
+                TEST(bMatch);
+                TEST(IsPaddingClear(morphed));
+            }
+
+            Mask inverted = mask;
+            inverted.Invert();
+            TEST(IsPaddingClear(inverted));
+            inverted.Union(mask);
+            bool bAll = true;
+            for (int y = 0; y < height; ++y)
+                for (int x = 0; x < width; ++x)
+                    bAll = bAll && inverted.Get(x, y);
+            TEST(bAll);
+            TEST(IsPaddingClear(inverted));
+        }
+    }
+
+    // FromAlpha takes 16 pixels at a time then the rest, ApplyToAlpha clears exactly the set pixels
+    void TestMaskAlpha()
+    {
+        Bitmap bitmap(37, 3);
+        for (int y = 0; y < bitmap.GetHeight(); ++y)
+            for (int x = 0; x < bitmap.GetWidth(); ++x)
+                bitmap.GetRow(y)[x] = { 10, 20, 30, static_cast<BYTE>((x + y) % 3 == 0 ? 0 : 200) };
+
+        const Mask mask = Mask::FromAlpha(bitmap);
+        bool bMatch = true;
+        for (int y = 0; y < bitmap.GetHeight(); ++y)
+            for (int x = 0; x < bitmap.GetWidth(); ++x)
+                bMatch = bMatch && mask.Get(x, y) == ((x + y) % 3 == 0);
+        TEST(bMatch);
+        TEST(IsPaddingClear(mask));
+
+        Bitmap opaque(37, 3);
+        for (int y = 0; y < opaque.GetHeight(); ++y)
+            for (int x = 0; x < opaque.GetWidth(); ++x)
+                opaque.GetRow(y)[x] = { 10, 20, 30, 255 };
+        mask.ApplyToAlpha(opaque);
+        bMatch = true;
+        for (int y = 0; y < opaque.GetHeight(); ++y)
+            for (int x = 0; x < opaque.GetWidth(); ++x)
+                bMatch = bMatch && opaque.GetRow(y)[x].rgbReserved == (mask.Get(x, y) ? 0 : 255);
+        TEST(bMatch);
+    }
+
+    // Two inputs of the same name from different directories must not race on one output
+    void TestPipelineRejectsDuplicateOutputs()
+    {
+        const std::vector<PipelineJob> jobs = { { TEXT("a\\x.ico"), TEXT("out\\x.ico") }, { TEXT("b\\x.ico"), TEXT("OUT\\X.ICO") } };
+        bool bThrown = false;
+        try
+        {
+            RunPipeline(jobs, [](const std::tstring&, std::vector<BYTE> data) { return data; });
+        }
+        catch (const Error&)
+        {
+            bThrown = true;
+        }
+        TEST(bThrown);
+    }
+
+    // A group localised twice: replacing the German copy leaves the neutral one and its icons alone
+    void TestReplaceIconGroupKeepsOtherLanguages()
+    {
+        IconGenerator generator(3);
+        PeFile pe = PeFile::FromMemory(generator.GenerateModule(SmallIcon(), 1));
+        const LANGID neutral = MAKELANGID(LANG_NEUTRAL, SUBLANG_NEUTRAL);
+        const LANGID german = MAKELANGID(LANG_GERMAN, SUBLANG_GERMAN);
+        ResourceLangs& langs = pe.GetResources()[ResourceId(RT_GROUP_ICON)][ResourceId(1)];
+        langs[german] = langs[neutral];
+        const std::vector<BYTE> before = langs[neutral].data;
+
+        GenerateOptions options = SmallIcon();
+        options.sizes = { 48 };
+        pe.ReplaceIconGroup(ResourceId(1), german, generator.GenerateIcon(options));
+
+        TEST(langs.size() == 2);
+        TEST(langs[neutral].data == before);
+        TEST(reinterpret_cast<const ICONHEADER*>(langs[german].data.data())->idCount == 2);
+        const ResourceIndex index(pe.GetResources());
+        TEST(IconFile::FromResource(index, 1, neutral, false).entry.size() == 4);
+        TEST(IconFile::FromResource(index, 1, german, false).entry.size() == 2);
+
+        options.type = TYPE_CURSOR;
+        bool bThrown = false;
+        try
+        {
+            pe.ReplaceIconGroup(ResourceId(1), neutral, generator.GenerateIcon(options));
+        }
+        catch (const Error&)
+        {
+            bThrown = true;
+        }
+        TEST(bThrown);
+        TEST(langs[neutral].data == before);
+    }
+
+    // The transform succeeds and the write can't, the job must still count the file as failed
+    void TestPipelineWriteFailureCounted()
+    {
+        const std::tstring input = TempFile(TEXT("IcoLibTests-pipeline.ico"));
+        IconGenerator(1).GenerateIcon(SmallIcon()).Save(input.c_str(), false);
+        const std::tstring output = TempFile(TEXT("IcoLibTests-missing\\out.ico"));
+
+        JobControl job(1);
+        PipelineOptions options;
+        options.pJob = &job;
+        const size_t failed = RunPipeline({ { input, output } }, [](const std::tstring&, std::vector<BYTE> data) { return data; }, options);
+        const JobProgress progress = job.GetProgress();
+        TEST(failed == 1);
+        TEST(progress.files == 1);
+        TEST(progress.failed == 1);
+
+        DeleteFile(input.c_str());
+    }
+
+    // Each shelf loads a file once for all its entries there, every slot must still hold its own entry
+    void TestAtlasMatchesEntries()
+    {
+        const std::tstring a = TempFile(TEXT("IcoLibTests-atlas-a.ico"));
+        const std::tstring b = TempFile(TEXT("IcoLibTests-atlas-b.ico"));
+        IconGenerator(1).GenerateIcon(SmallIcon()).Save(a.c_str(), false);
+        IconGenerator(2).GenerateIcon(SmallIcon()).Save(b.c_str(), false);
+        const std::tstring atlasfile = TempFile(TEXT("IcoLibTests-atlas.bmp"));
+        const std::tstring mapfile = TempFile(TEXT("IcoLibTests-atlas.csv"));
+
+        const std::vector<std::tstring> files = { a, b, a };
+        AtlasOptions options = {};
+        options.width = 16;
+        BuildAtlas(files, atlasfile.c_str(), mapfile.c_str(), options, false);
+
+        const std::vector<BYTE> bmp = ReadAllBytes(atlasfile.c_str());
+        const BITMAPV5HEADER* const header = reinterpret_cast<const BITMAPV5HEADER*>(bmp.data() + sizeof(BITMAPFILEHEADER));
+        const RGBQUAD* const pixels = reinterpret_cast<const RGBQUAD*>(bmp.data() + sizeof(BITMAPFILEHEADER) + sizeof(BITMAPV5HEADER));
+        const LONG width = header->bV5Width;
+
+        const std::vector<BYTE> map = ReadAllBytes(mapfile.c_str());
+        const std::string text(map.begin(), map.end());
+        int count = 0;
+        size_t pos = text.find('\n') + 1;
+        while (pos < text.size())
+        {
+            const size_t end = text.find('\n', pos);
+            const std::string line = text.substr(pos, end - pos);
+            pos = end + 1;
+
+            const size_t quote = line.find('"', 1);
+            const std::string name = line.substr(1, quote - 1);
+            int entry = 0, x = 0, y = 0, w = 0, h = 0;
+            TEST(sscanf(line.c_str() + quote + 1, ",%d,%d,%d,%d,%d", &entry, &x, &y, &w, &h) == 5);
+            TEST(name == ToUtf8(a) || name == ToUtf8(b));
+
+            const IconFile IconData = IconFile::Load((name == ToUtf8(a) ? a : b).c_str(), false);
+            const Bitmap expected = Decode(IconData.entry.at(entry));
+            TEST(expected.GetWidth() == w && expected.GetHeight() == h);
+            bool same = true;
+            for (int row = 0; row < h && same; ++row)
+                same = memcmp(pixels + size_t(y + row) * width + x, expected.GetRow(row), w * sizeof(RGBQUAD)) == 0;
+            TEST(same);
+            ++count;
+        }
+        TEST(count == 12);
+
+        DeleteFile(a.c_str());
+        DeleteFile(b.c_str());
+        DeleteFile(atlasfile.c_str());
+        DeleteFile(mapfile.c_str());
+    }
+
+    void AppendChunk(std::vector<BYTE>& out, const char* id, const std::vector<BYTE>& data)
+    {
+        const DWORD size = static_cast<DWORD>(data.size());
+        out.insert(out.end(), id, id + 4);
+        out.insert(out.end(), reinterpret_cast<const BYTE*>(&size), reinterpret_cast<const BYTE*>(&size) + sizeof(size));
+        out.insert(out.end(), data.begin(), data.end());
+        if (size & 1)
+            out.push_back(0);
+    }
+
+    // anih, LIST fram with a chunk between its frames, then LIST INFO and rate after the frames
+    std::vector<BYTE> MakeAni(const std::vector<BYTE>& frame0, const std::vector<BYTE>& frame1)
+    {
+        ANIHEADER header = {};
+        header.cbSize = sizeof(ANIHEADER);
+        header.nFrames = 2;
+        header.nSteps = 2;
+        header.bfAttributes = AF_ICON;
+
+        std::vector<BYTE> fram = { 'f', 'r', 'a', 'm' };
+        AppendChunk(fram, "icon", frame0);
+        AppendChunk(fram, "junk", { 1, 2, 3 });
+        AppendChunk(fram, "icon", frame1);
+        std::vector<BYTE> info = { 'I', 'N', 'F', 'O' };
+        AppendChunk(info, "INAM", { 'a', 0 });
+
+        std::vector<BYTE> body = { 'A', 'C', 'O', 'N' };
+        AppendChunk(body, "anih", std::vector<BYTE>(reinterpret_cast<const BYTE*>(&header), reinterpret_cast<const BYTE*>(&header) + sizeof(header)));
+        AppendChunk(body, "LIST", fram);
+        AppendChunk(body, "LIST", info);
+        AppendChunk(body, "rate", { 10, 0, 0, 0, 20, 0, 0, 0 });
+
+        std::vector<BYTE> riff;
+        AppendChunk(riff, "RIFF", body);
+        return riff;
+    }
+
+    // Save keeps every chunk where it was, replacing a frame only changes that frame's payload
+    void TestAniSaveKeepsChunkOrder()
+    {
+        const std::vector<BYTE> frame0 = IconGenerator(1).GenerateIcon(SmallIcon()).SaveToMemory(false);
+        GenerateOptions options = SmallIcon();
+        options.sizes = { 48 };
+        const std::vector<BYTE> frame1 = IconGenerator(2).GenerateIcon(options).SaveToMemory(false);
+        const std::tstring output = TempFile(TEXT("IcoLibTests-ani.ani"));
+
+        const std::vector<BYTE> original = MakeAni(frame0, frame1);
+        AniFile ani = AniFile::FromMemory(original);
+        TEST(ani.GetFrameCount() == 2);
+        ani.Save(output.c_str());
+        TEST(ReadAllBytes(output.c_str()) == original);
+
+        ani.SetFrame(0, IconFile::FromMemory(frame1.data(), frame1.size(), false), false);
+        ani.Save(output.c_str());
+        TEST(ReadAllBytes(output.c_str()) == MakeAni(frame1, frame1));
+
+        DeleteFile(output.c_str());
+    }
+
+    // An exception fails the test and the rest still run
+    void Run(void (*test)())
+    {
+        try
+        {
+            test();
+        }
+        catch (const WinError& e)
+        {
+            _ftprintf(stderr, TEXT("Error: 0x%08x\n"), e.GetError());
+            ++g_failed;
+        }
+        catch (const Error& e)
+        {
+            _ftprintf(stderr, TEXT("%s\n"), e.GetMsg().c_str());
+            ++g_failed;
+        }
+    }
+}
+
+int _tmain()
+{
+    Run(TestLoadTransformSaveAllocations);
+    Run(TestConditionalInitialiserAllocations);
+    Run(TestTransformIndexedSharedSwap);
+    Run(TestBitFieldsThreeMasksOpaque);
+    Run(TestPipelineWriteFailureCounted);
+    Run(TestPipelineRejectsDuplicateOutputs);
+    Run(TestReplaceIconGroupKeepsOtherLanguages);
+    Run(TestMaskMorphology);
+    Run(TestMaskAlpha);
+    Run(TestAtlasMatchesEntries);
+    Run(TestAniSaveKeepsChunkOrder);
+
+    _tprintf(TEXT("%d failed\n"), g_failed);
+    return g_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}